@@ -0,0 +1,116 @@
+// Compares the client registry lookup and broadcast iteration cost of
+// std::map against ConnectionTable at different server populations.
+
+#include <algorithm>
+#include <chrono>
+#include <connection_table.h>
+#include <map>
+#include <numeric>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct Client_t
+{
+    std::string m_sNick;
+};
+
+// Prevents the optimizer from throwing the measured work away.
+volatile size_t g_nSink = 0;
+
+template <typename Fn>
+double MeasureNsPerOp(size_t nOps, Fn&& fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    g_nSink = fn();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (double)nOps;
+}
+
+void RunScenario(size_t nClients)
+{
+    const size_t nLookups = 1'000'000;
+    const size_t nBroadcastRounds = std::max<size_t>(1, 10'000'000 / nClients);
+
+    // Handles look like real ones: increasing, with gaps left by disconnected clients.
+    std::mt19937 rng(42);
+    std::vector<HSteamNetConnection> handles(nClients);
+    HSteamNetConnection hNext = 1;
+    for (auto& hConn : handles)
+    {
+        hNext += 1 + rng() % 4;
+        hConn = hNext;
+    }
+
+    std::map<HSteamNetConnection, Client_t> mapClients;
+    ConnectionTable<Client_t> tableClients;
+    for (HSteamNetConnection hConn : handles)
+    {
+        std::string nick = "BraveWarrior" + std::to_string(10000 + rng() % 100000);
+        mapClients[hConn].m_sNick = nick;
+        tableClients.Insert(hConn).m_sNick = nick;
+    }
+
+    std::vector<HSteamNetConnection> lookupOrder(nLookups);
+    for (auto& hConn : lookupOrder)
+        hConn = handles[rng() % nClients];
+
+    double mapLookupNs = MeasureNsPerOp(
+        nLookups,
+        [&]()
+        {
+            size_t nSum = 0;
+            for (HSteamNetConnection hConn : lookupOrder)
+                nSum += mapClients.find(hConn)->second.m_sNick.size();
+            return nSum;
+        });
+    double tableLookupNs = MeasureNsPerOp(
+        nLookups,
+        [&]()
+        {
+            size_t nSum = 0;
+            for (HSteamNetConnection hConn : lookupOrder)
+                nSum += tableClients.Find(hConn)->m_sNick.size();
+            return nSum;
+        });
+
+    double mapIterateNs = MeasureNsPerOp(
+        nBroadcastRounds * nClients,
+        [&]()
+        {
+            size_t nSum = 0;
+            for (size_t i = 0; i < nBroadcastRounds; ++i)
+                for (auto& c : mapClients)
+                    nSum += c.first;
+            return nSum;
+        });
+    double tableIterateNs = MeasureNsPerOp(
+        nBroadcastRounds * nClients,
+        [&]()
+        {
+            size_t nSum = 0;
+            for (size_t i = 0; i < nBroadcastRounds; ++i)
+                for (auto& [hConn, client] : tableClients)
+                    nSum += hConn;
+            return nSum;
+        });
+
+    printf(
+        "%8zu | %12.2f | %14.2f | %15.2f | %17.2f\n", nClients, mapLookupNs, tableLookupNs, mapIterateNs,
+        tableIterateNs);
+}
+
+} // namespace
+
+int main()
+{
+    printf("ns per operation (broadcast iteration is per recipient)\n");
+    printf(" clients | map lookup   | table lookup   | map broadcast   | table broadcast\n");
+    for (size_t nClients : {100, 10'000, 100'000})
+        RunScenario(nClients);
+    return 0;
+}
@@ -0,0 +1,377 @@
+// Drives a whole ChatServer in-process, with its clients on the other end of CreateSocketPair loopback
+// connections, so the numbers cover the real accept, relay and send paths without any network.
+// Everything runs on this thread: the server with one shard ticked inline, and the clients.
+// Scenarios:
+//   broadcast_1_to_n: one client talks, everybody else in the lobby receives
+//   chatter_n_to_n:   every client talks, every line goes to everybody else
+//   join_storm:       every client connects at once, until each has its welcome
+//   nick_storm:       every client renames at once, until each has its confirmation
+// Prints one JSON object per line and scenario.  `messages` are what the clients received (chat lines,
+// welcomes, confirmations), `allocs_per_msg` counts the heap allocations of this thread per such
+// message, and the latency is from sending (or connecting) to receiving, in microseconds.
+
+#include <allocation_counter.h>
+#include <async_log_sink.h>
+#include <atomic>
+#include <charconv>
+#include <chat_server.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <latency_histogram.h>
+#include <loop_waiter.h>
+#include <my_cpp_utils/logger.h>
+#include <non_blocking_console_user_input.h>
+#include <stdio.h>
+#include <steam/isteamnetworkingutils.h>
+#include <steam/steamnetworkingsockets.h>
+#include <steam_networking_init_RAII.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <wire_protocol.h>
+
+namespace
+{
+
+constexpr std::string_view k_sWelcomePrefix = "Welcome, stranger.";
+constexpr std::string_view k_sRenamedPrefix = "Thou shalt henceforth be known as ";
+constexpr auto k_timeout = std::chrono::seconds(60);
+
+struct Result_t
+{
+    const char* szScenario = "";
+    size_t nClients = 0;
+    uint64 nMessages = 0;
+    double flSeconds = 0;
+    uint64 nAllocations = 0;
+    LatencyHistogram latencyUsec;
+};
+
+void PrintResult(const Result_t& result)
+{
+    double flMessages = (double)std::max<uint64>(result.nMessages, 1);
+    printf(
+        "{\"scenario\":\"%s\",\"clients\":%zu,\"messages\":%llu,\"seconds\":%.3f,\"msgs_per_s\":%.0f,"
+        "\"allocs_per_msg\":%.3f,\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+        result.szScenario, result.nClients, (unsigned long long)result.nMessages, result.flSeconds,
+        (double)result.nMessages / std::max(result.flSeconds, 1e-9), (double)result.nAllocations / flMessages,
+        (unsigned long long)result.latencyUsec.GetPercentile(50),
+        (unsigned long long)result.latencyUsec.GetPercentile(99),
+        (unsigned long long)result.latencyUsec.GetPercentile(99.9), (unsigned long long)result.latencyUsec.GetMax());
+    fflush(stdout);
+}
+
+// The client ends of the loopback connections, all in one poll group.
+class Clients
+{
+public:
+    struct Client_t
+    {
+        HSteamNetConnection hConn = k_HSteamNetConnection_Invalid;
+        SteamNetworkingMicroseconds usecStarted = 0; // When they connected, or asked for a new nick.
+        bool bWelcomed = false;
+        bool bRenamed = false;
+    };
+private:
+    ChatServer& server;
+    ISteamNetworkingSockets* pInterface;
+    ISteamNetworkingUtils* pUtils;
+    HSteamNetPollGroup hPollGroup;
+    std::vector<Client_t> clients;
+    std::unordered_map<HSteamNetConnection, size_t> indexByConn;
+    std::string sendBuffer; // Keeps its capacity between messages.
+    Result_t* pResult = nullptr; // What received messages count towards.
+public:
+    Clients(ChatServer& server_)
+      : server(server_), pInterface(SteamNetworkingSockets()), pUtils(SteamNetworkingUtils()),
+        hPollGroup(pInterface->CreatePollGroup())
+    {}
+    ~Clients() { pInterface->DestroyPollGroup(hPollGroup); }
+    void CountInto(Result_t* pResult_) { pResult = pResult_; }
+
+    // Open `nClients` connections and hand the server ends to the server, all in the same tick.
+    bool Connect(size_t nClients)
+    {
+        for (size_t i = 0; i < nClients; ++i)
+        {
+            Client_t client;
+            HSteamNetConnection hServerConn = k_HSteamNetConnection_Invalid;
+            if (!pInterface->CreateSocketPair(&client.hConn, &hServerConn, false, nullptr, nullptr))
+            {
+                fprintf(stderr, "CreateSocketPair failed\n");
+                return false;
+            }
+            pInterface->SetConnectionPollGroup(client.hConn, hPollGroup);
+            client.usecStarted = pUtils->GetLocalTimestamp();
+            indexByConn[client.hConn] = clients.size();
+            clients.push_back(client);
+            server.AdoptConnection(hServerConn);
+        }
+        return PumpUntil([&]() { return CountIf([](const Client_t& c) { return c.bWelcomed; }) == clients.size(); });
+    }
+
+    // Hang up on the server, and wait until it has let go of everybody.
+    bool DisconnectAll()
+    {
+        for (const Client_t& client : clients)
+            pInterface->CloseConnection(client.hConn, 0, "Bench done", false);
+        clients.clear();
+        indexByConn.clear();
+        return PumpUntil([&]() { return server.GetNicks().Size() == 0; });
+    }
+
+    // Say a line that carries the time it was sent.
+    void Say(size_t nClient)
+    {
+        char szLine[32];
+        int cbLine = snprintf(szLine, sizeof(szLine), "%lld", (long long)pUtils->GetLocalTimestamp());
+        sendBuffer.clear();
+        Wire::Append<WireType::Say>(sendBuffer, 0, std::string_view(szLine, (size_t)cbLine));
+        Send(clients[nClient].hConn);
+    }
+
+    void SetNick(size_t nClient)
+    {
+        char szNick[32];
+        int cbNick = snprintf(szNick, sizeof(szNick), "Bench%zu", nClient);
+        sendBuffer.clear();
+        Wire::Append<WireType::SetNick>(sendBuffer, 0, std::string_view(szNick, (size_t)cbNick));
+        clients[nClient].usecStarted = pUtils->GetLocalTimestamp();
+        Send(clients[nClient].hConn);
+    }
+
+    template <typename Pred>
+    size_t CountIf(Pred&& pred) const
+    {
+        size_t nCount = 0;
+        for (const Client_t& client : clients)
+            nCount += pred(client) ? 1 : 0;
+        return nCount;
+    }
+
+    // Tick the server and receive on the clients until `done()`.  Returns false on timeout.
+    template <typename Done>
+    bool PumpUntil(Done&& done)
+    {
+        auto deadline = std::chrono::steady_clock::now() + k_timeout;
+        while (!done())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                fprintf(stderr, "Timed out\n");
+                return false;
+            }
+            server.Tick();
+            Receive();
+        }
+        return true;
+    }
+private:
+    void Send(HSteamNetConnection hConn)
+    {
+        pInterface->SendMessageToConnection(
+            hConn, sendBuffer.data(), (uint32)sendBuffer.size(), k_nSteamNetworkingSend_Reliable, nullptr);
+    }
+
+    void Receive()
+    {
+        SteamNetworkingMessage_t* incomingMessages[256];
+        int nMessages;
+        while ((nMessages = pInterface->ReceiveMessagesOnPollGroup(hPollGroup, incomingMessages, 256)) > 0)
+        {
+            SteamNetworkingMicroseconds usecNow = pUtils->GetLocalTimestamp();
+            for (int i = 0; i < nMessages; ++i)
+            {
+                auto itClient = indexByConn.find(incomingMessages[i]->m_conn);
+                if (itClient != indexByConn.end())
+                {
+                    Client_t& client = clients[itClient->second];
+                    Wire::ForEachMessage(
+                        incomingMessages[i]->m_pData, (size_t)incomingMessages[i]->m_cbSize,
+                        [&](const WireMessage& msg) { OnMessage(client, msg, usecNow); });
+                }
+                incomingMessages[i]->Release();
+            }
+        }
+    }
+
+    void OnMessage(Client_t& client, const WireMessage& msg, SteamNetworkingMicroseconds usecNow)
+    {
+        if (msg.eType == WireType::Chat)
+        {
+            // Only the timestamp is in the line.
+            SteamNetworkingMicroseconds usecSent = 0;
+            std::from_chars(msg.sBody.data(), msg.sBody.data() + msg.sBody.size(), usecSent);
+            Count(usecNow - usecSent);
+        }
+        else if (msg.eType == WireType::Notice && !client.bWelcomed && msg.sBody.starts_with(k_sWelcomePrefix))
+        {
+            client.bWelcomed = true;
+            Count(usecNow - client.usecStarted);
+        }
+        else if (msg.eType == WireType::Notice && !client.bRenamed && msg.sBody.starts_with(k_sRenamedPrefix))
+        {
+            client.bRenamed = true;
+            Count(usecNow - client.usecStarted);
+        }
+    }
+
+    void Count(SteamNetworkingMicroseconds usecLatency)
+    {
+        if (!pResult)
+            return;
+        ++pResult->nMessages;
+        pResult->latencyUsec.Record((uint64)std::max<SteamNetworkingMicroseconds>(usecLatency, 0));
+    }
+};
+
+// Measures whatever `run` makes the clients receive.
+template <typename Run>
+bool Measure(Clients& clients, Result_t& result, Run&& run)
+{
+    clients.CountInto(&result);
+    uint64 nAllocationsBefore = AllocationCounter::GetThreadAllocations();
+    auto start = std::chrono::steady_clock::now();
+    bool bOk = run();
+    result.flSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.nAllocations = AllocationCounter::GetThreadAllocations() - nAllocationsBefore;
+    clients.CountInto(nullptr);
+    if (bOk)
+        PrintResult(result);
+    return bOk;
+}
+
+// One client says `nLines` lines, one at a time, each delivered to everybody else before the next.
+bool RunBroadcast(Clients& clients, size_t nClients, size_t nLines)
+{
+    if (!clients.Connect(nClients))
+        return false;
+    Result_t result;
+    result.szScenario = "broadcast_1_to_n";
+    result.nClients = nClients;
+    bool bOk = Measure(
+        clients, result,
+        [&]()
+        {
+            for (size_t i = 0; i < nLines; ++i)
+            {
+                uint64 nExpected = result.nMessages + (nClients - 1);
+                clients.Say(0);
+                if (!clients.PumpUntil([&]() { return result.nMessages >= nExpected; }))
+                    return false;
+            }
+            return true;
+        });
+    return clients.DisconnectAll() && bOk;
+}
+
+// Every client says a line, then all of them are delivered, `nRounds` times.
+bool RunChatter(Clients& clients, size_t nClients, size_t nRounds)
+{
+    if (!clients.Connect(nClients))
+        return false;
+    Result_t result;
+    result.szScenario = "chatter_n_to_n";
+    result.nClients = nClients;
+    bool bOk = Measure(
+        clients, result,
+        [&]()
+        {
+            for (size_t i = 0; i < nRounds; ++i)
+            {
+                uint64 nExpected = result.nMessages + nClients * (nClients - 1);
+                for (size_t nClient = 0; nClient < nClients; ++nClient)
+                    clients.Say(nClient);
+                if (!clients.PumpUntil([&]() { return result.nMessages >= nExpected; }))
+                    return false;
+            }
+            return true;
+        });
+    return clients.DisconnectAll() && bOk;
+}
+
+bool RunJoinStorm(Clients& clients, size_t nClients)
+{
+    Result_t result;
+    result.szScenario = "join_storm";
+    result.nClients = nClients;
+    bool bOk = Measure(clients, result, [&]() { return clients.Connect(nClients); });
+    return clients.DisconnectAll() && bOk;
+}
+
+bool RunNickStorm(Clients& clients, size_t nClients)
+{
+    if (!clients.Connect(nClients))
+        return false;
+    Result_t result;
+    result.szScenario = "nick_storm";
+    result.nClients = nClients;
+    bool bOk = Measure(
+        clients, result,
+        [&]()
+        {
+            for (size_t nClient = 0; nClient < nClients; ++nClient)
+                clients.SetNick(nClient);
+            return clients.PumpUntil(
+                [&]() { return clients.CountIf([](const Clients::Client_t& c) { return c.bRenamed; }) == nClients; });
+        });
+    return clients.DisconnectAll() && bOk;
+}
+
+} // namespace
+
+int main()
+{
+    // The same random nicks every run.
+    srand(1);
+    utils::Logger::Init("relay_bench.log", spdlog::level::warn);
+    AsyncLogSink logSink(AsyncLogSink::Options{});
+
+    SteamNetworkingInitRAII::Options steamOptions;
+    steamOptions.debugSeverity = k_ESteamNetworkingSocketsDebugOutputType_Warning;
+    SteamNetworkingInitRAII steamNetworkingInitRAII(steamOptions);
+    SteamNetworkingInitRAII::SetDebugCallback(
+        [&logSink](ESteamNetworkingSocketsDebugOutputType eType, const char* pszMsg)
+        { logSink.Write(AsyncLogSink::FromDebugOutputType(eType), "[DebugOutput] ", pszMsg); });
+
+    // Loopback connections are still paced like real ones.  Take the brakes off, so the server is
+    // what is measured.
+    ISteamNetworkingUtils* pUtils = SteamNetworkingUtils();
+    pUtils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_SendRateMin, 1024 * 1024 * 1024);
+    pUtils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_SendRateMax, 1024 * 1024 * 1024);
+    pUtils->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_SendBufferSize, 64 * 1024 * 1024);
+
+    // The console stays idle, with a quit flag of its own so that stdin closing does not stop the server.
+    std::atomic<bool> inputQuitFlag = {};
+    std::atomic<bool> serverQuitFlag = {};
+    LoopWaiter loopWaiter(LoopWaiter::Options{});
+    NonBlockingConsoleUserInput nonBlockingConsoleUserInput(inputQuitFlag, loopWaiter);
+
+    // One shard ticked inline, and nothing to hold the clients back.
+    ChatServer::Options serverOptions;
+    serverOptions.nWorkers = 1;
+    serverOptions.nMaxClients = 100'000;
+    serverOptions.flAcceptsPerSec = 1e9;
+    serverOptions.nAcceptBurst = 100'000;
+    serverOptions.nMaxPendingAccepts = 100'000;
+    serverOptions.shardOptions.flMessagesPerSec = 0;
+    serverOptions.shardOptions.flBytesPerSec = 0;
+    serverOptions.nHelloWaitMs = 0; // Our clients never say Hello.
+    bool bOk = true;
+    {
+        ChatServer server(nonBlockingConsoleUserInput, serverQuitFlag, loopWaiter, logSink, serverOptions);
+        server.Start(0);
+        {
+            Clients clients(server);
+            bOk = bOk && RunBroadcast(clients, 1'000, 200);
+            bOk = bOk && RunChatter(clients, 100, 20);
+            bOk = bOk && RunJoinStorm(clients, 2'000);
+            bOk = bOk && RunNickStorm(clients, 500);
+        }
+        serverQuitFlag = true;
+        server.Stop();
+    }
+    return bOk ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// Counts heap allocations and time per relayed line on the server's send path,
+// for rooms of 1k and 10k clients.  Compares three ways of handing one line to
+// every member of a room:
+//   copy:   a buffer per recipient, which is what SendMessageToConnection does internally
+//   shared: one ref-counted SharedPayload from the heap, attached to every message
+//   pooled: the same, with the payload block taken from a PayloadPool
+// Messages are released right after "sending", the way the library frees them once
+// they are acknowledged, so the pool reaches its steady state.
+// SendMessages is never called: the library's own cost of queueing, encrypting and
+// sending is the same in all three modes and is not in these numbers.  relay_bench
+// measures the whole path, the library included, over real loopback connections.
+// Nor is the library needed to run it: AllocateMessage below stands in for
+// ISteamNetworkingUtils::AllocateMessage and allocates what it does, the message and,
+// if asked for, its buffer, both counted.
+
+#include <allocation_counter.h>
+#include <chrono>
+#include <cstring>
+#include <payload_pool.h>
+#include <shared_payload.h>
+#include <stdio.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+enum class Mode
+{
+    Copy,
+    Shared,
+    Pooled
+};
+
+const char* ModeName(Mode mode)
+{
+    switch (mode)
+    {
+    case Mode::Copy:
+        return "copy";
+    case Mode::Shared:
+        return "shared";
+    case Mode::Pooled:
+        return "pooled";
+    }
+    return "?";
+}
+
+// The message header is the library's own type, whose destructor only it may call.
+struct BenchMessage_t : SteamNetworkingMessage_t
+{
+    static void FreeBuffer(SteamNetworkingMessage_t* pMsg) { ::operator delete(pMsg->m_pData); }
+    static void Destroy(SteamNetworkingMessage_t* pMsg)
+    {
+        if (pMsg->m_pfnFreeData)
+            pMsg->m_pfnFreeData(pMsg);
+        delete static_cast<BenchMessage_t*>(pMsg);
+    }
+};
+
+SteamNetworkingMessage_t* AllocateMessage(int cbAllocateBuffer)
+{
+    BenchMessage_t* pMsg = new BenchMessage_t();
+    pMsg->m_pfnRelease = &BenchMessage_t::Destroy;
+    if (cbAllocateBuffer > 0)
+    {
+        pMsg->m_pData = ::operator new((size_t)cbAllocateBuffer);
+        pMsg->m_cbSize = cbAllocateBuffer;
+        pMsg->m_pfnFreeData = &BenchMessage_t::FreeBuffer;
+    }
+    return pMsg;
+}
+
+struct Result_t
+{
+    double flAllocationsPerLine = 0;
+    double flNsPerLine = 0;
+};
+
+Result_t RunScenario(Mode mode, size_t nClients, size_t nLines)
+{
+    std::string line(48, 'x');
+    std::vector<SteamNetworkingMessage_t*> outgoingBatch;
+    outgoingBatch.reserve(nClients);
+    PayloadPool::Ptr pPool = PayloadPool::Create(PayloadPool::Options());
+
+    auto relayLine = [&]()
+    {
+        SharedPayload* pPayload = nullptr;
+        if (mode != Mode::Copy)
+        {
+            PayloadPool* pPayloadPool = mode == Mode::Pooled ? pPool.get() : nullptr;
+            pPayload = SharedPayload::Create(line.data(), (uint32)line.size(), pPayloadPool);
+        }
+        for (size_t i = 0; i < nClients; ++i)
+        {
+            SteamNetworkingMessage_t* pMsg;
+            if (pPayload)
+            {
+                pMsg = AllocateMessage(0);
+                pPayload->AttachTo(pMsg);
+            }
+            else
+            {
+                pMsg = AllocateMessage((int)line.size());
+                memcpy(pMsg->m_pData, line.data(), line.size());
+            }
+            pMsg->m_conn = (HSteamNetConnection)(i + 1);
+            outgoingBatch.push_back(pMsg);
+        }
+        if (pPayload)
+            pPayload->Release();
+
+        // Stands in for SendMessages and the library freeing them later.
+        for (SteamNetworkingMessage_t* pMsg : outgoingBatch)
+            pMsg->Release();
+        outgoingBatch.clear();
+    };
+
+    // Warm up, so the pool is filled.
+    for (int i = 0; i < 16; ++i)
+        relayLine();
+
+    uint64 nAllocationsBefore = AllocationCounter::GetThreadAllocations();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nLines; ++i)
+        relayLine();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    Result_t result;
+    result.flAllocationsPerLine =
+        (double)(AllocationCounter::GetThreadAllocations() - nAllocationsBefore) / (double)nLines;
+    result.flNsPerLine = std::chrono::duration<double, std::nano>(elapsed).count() / (double)nLines;
+    return result;
+}
+
+} // namespace
+
+int main()
+{
+    printf("# Excludes SendMessages, see relay_bench for the whole send path.\n");
+    printf("%8s %8s %16s %14s %14s\n", "clients", "mode", "allocs/line", "allocs/msg", "us/line");
+    for (size_t nClients : {1'000, 10'000})
+    {
+        size_t nLines = 2'000'000 / nClients;
+        for (Mode mode : {Mode::Copy, Mode::Shared, Mode::Pooled})
+        {
+            Result_t result = RunScenario(mode, nClients, nLines);
+            printf(
+                "%8zu %8s %16.2f %14.3f %14.1f\n", nClients, ModeName(mode), result.flAllocationsPerLine,
+                result.flAllocationsPerLine / (double)nClients, result.flNsPerLine / 1000.0);
+        }
+    }
+    return 0;
+}
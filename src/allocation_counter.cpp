@@ -0,0 +1,33 @@
+#include "allocation_counter.h"
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+thread_local uint64 t_nAllocations = 0;
+} // namespace
+
+uint64 AllocationCounter::GetThreadAllocations()
+{
+    return t_nAllocations;
+}
+
+// Replacements of the global allocation functions. The array and nothrow
+// forms forward to these by default, so they are counted as well.
+void* operator new(std::size_t nSize)
+{
+    ++t_nAllocations;
+    if (void* p = std::malloc(nSize ? nSize : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
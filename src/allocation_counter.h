@@ -0,0 +1,10 @@
+#pragma once
+#include <steam/steamnetworkingtypes.h>
+
+// Counts calls to the global operator new made by the calling thread.
+// Used to check that hot paths, like relaying a chat line, do not allocate.
+class AllocationCounter
+{
+public:
+    static uint64 GetThreadAllocations();
+};
@@ -14,8 +14,72 @@ static void PrintUsageAndExit(int rc = 1)
     fflush(stderr);
     printf(
         R"usage(Usage:
-    example_chat client SERVER_ADDR
-    example_chat server [--port PORT]
+    example_chat client SERVER_ADDR [WAIT_OPTIONS] [LOG_OPTIONS]
+    example_chat server [--port PORT] [SERVER_OPTIONS] [WAIT_OPTIONS] [LOG_OPTIONS]
+    example_chat loadgen SERVER_ADDR [LOADGEN_OPTIONS] [WAIT_OPTIONS] [LOG_OPTIONS]
+    example_chat transcript SEGMENT_FILE
+
+SERVER_OPTIONS:
+    --workers N                     Shards, each with its own poll group and thread (default: 1)
+    --stats-interval S              Append a JSON stats line every S seconds (default: 0, off)
+    --stats-file PATH               Where to append stats lines (default: chat_server_stats.jsonl)
+    --admin-socket PATH             Also take console commands, one per line, from a Unix domain socket
+                                    at PATH, and answer each with a line (default: off)
+    --send-budget-kb KB             Outbound backlog per client before the slow consumer policy applies (default: 256)
+    --send-limit-kb KB              Outbound backlog per client before it is disconnected (default: 1024)
+    --slow-consumer drop|coalesce|disconnect
+                                    What happens to clients over their send budget (default: coalesce)
+    --batch-frame-kb KB             Pack a tick's lines into frames up to KB for clients that support it,
+                                    0 turns it off (default: 16)
+    --max-rooms N                   Rooms there may be at once, the lobby included (default: 1000)
+    --empty-room-linger S           Seconds a room nobody is in keeps its name and history before it is
+                                    reclaimed (default: 300)
+    --history-lines N               Lines kept per room and replayed to newcomers, 0 turns it off (default: 100)
+    --history-kb KB                 Memory for them per room, at most 256 (default: 32)
+    --transcript-dir DIR            Keep a durable transcript of every line in DIR, and restore the room
+                                    history from it on startup (default: off)
+    --transcript-segment-mb MB      Start a new transcript file after MB (default: 64)
+    --transcript-fsync-ms MS        Make transcript lines durable at least this often (default: 1000)
+    --presence-priority N           Priority of the lane for typing indicators, heartbeats and read markers;
+                                    higher numbers yield to chat, which has 0 (default: 0)
+    --presence-weight N             Its share of the bandwidth against chat's 3 when priorities tie (default: 1)
+    --flood-rate R                  Messages per second a client may send, more are dropped; 0 for no limit
+                                    (default: 20)
+    --flood-burst N                 Messages a client may send at once after a quiet spell (default: 40)
+    --flood-kb-rate KB              Kilobytes per second a client may send; 0 for no limit (default: 32)
+    --flood-strikes N               Disconnect a client after N seconds in a row over its limits; 0 never
+                                    does (default: 5)
+    --max-clients N                 Turn away connections beyond N clients (default: 10000)
+    --accept-rate R                 New connections accepted per second (default: 500)
+    --accept-burst N                New connections accepted at once after a quiet spell (default: 200)
+    --accept-queue N                Connections that may wait to be accepted, beyond that they are
+                                    turned away (default: 5000)
+    --shutdown-timeout-ms MS        Longest wait on shutdown for the clients to receive what is still
+                                    queued for them (default: 2000)
+    --snapshot PATH                 On shutdown, write the rooms and every client's session to PATH; on
+                                    startup, read it back so clients can resume (default: off)
+    --resume-window S               Seconds a session waits to be resumed, those read from the snapshot
+                                    and those of clients whose connection dropped; 0 forgets the latter
+                                    right away (default: 60)
+    --hello-wait-ms MS              How long a newcomer is held back waiting for a Hello that may resume
+                                    a session; 0 introduces them right away (default: 250)
+
+LOADGEN_OPTIONS:
+    --clients N                     Connections to open (default: 100)
+    --rate R                        Lines per second sent by each client (default: 1)
+    --msg-size S                    Bytes per line (default: 64)
+    --duration T                    Seconds to send for (default: 10)
+    --typing-rate R                 Typing indicators per second sent by each client, unreliable (default: 0)
+    --batch-frames 0|1              Ask the server to pack each tick's lines into one message (default: 1)
+
+WAIT_OPTIONS:
+    --wait busy|adaptive|blocking   How the main loop waits when idle (default: adaptive)
+    --idle-timeout-ms MS            Longest single wait while idle (default: 10)
+
+LOG_OPTIONS:
+    --debug-severity LEVEL          Networking library output: none|bug|error|important|warning|msg|verbose|
+                                    debug|everything (default: msg).  The server can change it with /loglevel.
+    --log-overflow drop|block       What the networking threads do when the log ring is full (default: drop)
 )usage");
     fflush(stdout);
     exit(rc);
@@ -26,13 +90,14 @@ AppOptions ReadAppOptions(int argc, const char* argv[])
     const uint16 DEFAULT_SERVER_PORT = 27020;
 
     AppOptions options;
-    auto& [bServer, bClient, nPort, addrServer] = options;
+    auto& [bServer, bClient, nPort, addrServer, loopWaiterOptions, serverOptions, bLoadGen, loadGeneratorOptions,
+           steamNetworkingOptions, logSinkOptions, bTranscript, sTranscriptSegment, consoleInputOptions] = options;
     nPort = DEFAULT_SERVER_PORT;
     addrServer.Clear();
 
     for (int i = 1; i < argc; ++i)
     {
-        if (!bClient && !bServer)
+        if (!bClient && !bServer && !bLoadGen && !bTranscript)
         {
             if (!strcmp(argv[i], "client"))
             {
@@ -44,6 +109,23 @@ AppOptions ReadAppOptions(int argc, const char* argv[])
                 bServer = true;
                 continue;
             }
+            if (!strcmp(argv[i], "loadgen"))
+            {
+                bLoadGen = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "transcript"))
+            {
+                bTranscript = true;
+                continue;
+            }
+        }
+        if (bTranscript)
+        {
+            if (!sTranscriptSegment.empty())
+                PrintUsageAndExit();
+            sTranscriptSegment = argv[i];
+            continue;
         }
         if (!strcmp(argv[i], "--port"))
         {
@@ -56,8 +138,409 @@ AppOptions ReadAppOptions(int argc, const char* argv[])
             continue;
         }
 
+        if (!strcmp(argv[i], "--workers"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nWorkers = atoi(argv[i]);
+            if (serverOptions.nWorkers <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats-interval"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nStatsIntervalSec = atoi(argv[i]);
+            if (serverOptions.nStatsIntervalSec < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats-file"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.sStatsFile = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--admin-socket"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            consoleInputOptions.sAdminSocketPath = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--send-budget-kb"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.cbSendBudget = atoi(argv[i]) * 1024;
+            if (serverOptions.shardOptions.cbSendBudget <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--send-limit-kb"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.cbSendHardLimit = atoi(argv[i]) * 1024;
+            if (serverOptions.shardOptions.cbSendHardLimit <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--slow-consumer"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            if (!strcmp(argv[i], "drop"))
+                serverOptions.shardOptions.slowConsumerPolicy = ChatShard::SlowConsumerPolicy::Drop;
+            else if (!strcmp(argv[i], "coalesce"))
+                serverOptions.shardOptions.slowConsumerPolicy = ChatShard::SlowConsumerPolicy::Coalesce;
+            else if (!strcmp(argv[i], "disconnect"))
+                serverOptions.shardOptions.slowConsumerPolicy = ChatShard::SlowConsumerPolicy::Disconnect;
+            else
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--batch-frame-kb"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.cbMaxBatchFrame = atoi(argv[i]) * 1024;
+            if (serverOptions.shardOptions.cbMaxBatchFrame < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--max-rooms"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nRooms = atoi(argv[i]);
+            if (nRooms <= 0)
+                PrintUsageAndExit();
+            serverOptions.roomOptions.nMaxRooms = (uint32)nRooms;
+            continue;
+        }
+        if (!strcmp(argv[i], "--empty-room-linger"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.roomOptions.nEmptyRoomLingerSec = atoi(argv[i]);
+            if (serverOptions.roomOptions.nEmptyRoomLingerSec < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--history-lines"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nLines = atoi(argv[i]);
+            if (nLines < 0)
+                PrintUsageAndExit();
+            serverOptions.historyOptions.nMaxLines = (uint32)nLines;
+            continue;
+        }
+        if (!strcmp(argv[i], "--history-kb"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            // A replay goes out as one message, which must stay under the library's size limit.
+            int nKb = atoi(argv[i]);
+            if (nKb <= 0 || nKb > 256)
+                PrintUsageAndExit();
+            serverOptions.historyOptions.cbMaxBytes = (uint32)nKb * 1024;
+            continue;
+        }
+        if (!strcmp(argv[i], "--transcript-dir"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.transcriptOptions.sDirectory = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--transcript-segment-mb"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nMb = atoi(argv[i]);
+            if (nMb <= 0)
+                PrintUsageAndExit();
+            serverOptions.transcriptOptions.cbSegmentSize = (uint64)nMb << 20;
+            continue;
+        }
+        if (!strcmp(argv[i], "--transcript-fsync-ms"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nFsyncMs = atoi(argv[i]);
+            if (nFsyncMs <= 0)
+                PrintUsageAndExit();
+            serverOptions.transcriptOptions.fsyncInterval = std::chrono::milliseconds(nFsyncMs);
+            continue;
+        }
+        if (!strcmp(argv[i], "--presence-priority"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.lanePriorities[WireLane::k_nPresence] = atoi(argv[i]);
+            if (serverOptions.lanePriorities[WireLane::k_nPresence] < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--presence-weight"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nWeight = atoi(argv[i]);
+            if (nWeight <= 0 || nWeight > 0xFFFF)
+                PrintUsageAndExit();
+            serverOptions.laneWeights[WireLane::k_nPresence] = (uint16)nWeight;
+            continue;
+        }
+        if (!strcmp(argv[i], "--flood-rate"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.flMessagesPerSec = atof(argv[i]);
+            if (serverOptions.shardOptions.flMessagesPerSec < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--flood-burst"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.nMessageBurst = atoi(argv[i]);
+            if (serverOptions.shardOptions.nMessageBurst <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--flood-kb-rate"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.flBytesPerSec = atof(argv[i]) * 1024;
+            if (serverOptions.shardOptions.flBytesPerSec < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--flood-strikes"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.shardOptions.nFloodStrikesToDisconnect = atoi(argv[i]);
+            if (serverOptions.shardOptions.nFloodStrikesToDisconnect < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--max-clients"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nMaxClients = atoi(argv[i]);
+            if (serverOptions.nMaxClients <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--accept-rate"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.flAcceptsPerSec = atof(argv[i]);
+            if (serverOptions.flAcceptsPerSec <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--accept-burst"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nAcceptBurst = atoi(argv[i]);
+            if (serverOptions.nAcceptBurst <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--accept-queue"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nMaxPendingAccepts = atoi(argv[i]);
+            if (serverOptions.nMaxPendingAccepts <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--shutdown-timeout-ms"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nShutdownTimeoutMs = atoi(argv[i]);
+            if (serverOptions.nShutdownTimeoutMs < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--snapshot"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.sSnapshotFile = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--resume-window"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nResumeWindowSec = atoi(argv[i]);
+            if (serverOptions.nResumeWindowSec < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--hello-wait-ms"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            serverOptions.nHelloWaitMs = atoi(argv[i]);
+            if (serverOptions.nHelloWaitMs < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--clients"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            loadGeneratorOptions.nClients = atoi(argv[i]);
+            if (loadGeneratorOptions.nClients <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--rate"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            loadGeneratorOptions.flRatePerClient = atof(argv[i]);
+            if (loadGeneratorOptions.flRatePerClient <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--msg-size"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            loadGeneratorOptions.nMessageSize = atoi(argv[i]);
+            if (loadGeneratorOptions.nMessageSize <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--duration"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            loadGeneratorOptions.nDurationSec = atoi(argv[i]);
+            if (loadGeneratorOptions.nDurationSec <= 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--typing-rate"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            loadGeneratorOptions.flTypingRatePerClient = atof(argv[i]);
+            if (loadGeneratorOptions.flTypingRatePerClient < 0)
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--batch-frames"))
+        {
+            ++i;
+            if (i >= argc || (strcmp(argv[i], "0") && strcmp(argv[i], "1")))
+                PrintUsageAndExit();
+            loadGeneratorOptions.bBatchFrames = argv[i][0] == '1';
+            continue;
+        }
+        if (!strcmp(argv[i], "--wait"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            if (!strcmp(argv[i], "busy"))
+                loopWaiterOptions.mode = LoopWaiter::Mode::BusyPoll;
+            else if (!strcmp(argv[i], "adaptive"))
+                loopWaiterOptions.mode = LoopWaiter::Mode::Adaptive;
+            else if (!strcmp(argv[i], "blocking"))
+                loopWaiterOptions.mode = LoopWaiter::Mode::Blocking;
+            else
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--idle-timeout-ms"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            int nIdleTimeoutMs = atoi(argv[i]);
+            if (nIdleTimeoutMs <= 0)
+                PrintUsageAndExit();
+            loopWaiterOptions.idleTimeout = std::chrono::milliseconds(nIdleTimeoutMs);
+            continue;
+        }
+        if (!strcmp(argv[i], "--debug-severity"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            if (!SteamNetworkingInitRAII::ParseDebugSeverity(argv[i], steamNetworkingOptions.debugSeverity))
+                PrintUsageAndExit();
+            continue;
+        }
+        if (!strcmp(argv[i], "--log-overflow"))
+        {
+            ++i;
+            if (i >= argc)
+                PrintUsageAndExit();
+            if (!strcmp(argv[i], "drop"))
+                logSinkOptions.overflowPolicy = AsyncLogSink::OverflowPolicy::Drop;
+            else if (!strcmp(argv[i], "block"))
+                logSinkOptions.overflowPolicy = AsyncLogSink::OverflowPolicy::Block;
+            else
+                PrintUsageAndExit();
+            continue;
+        }
+
         // Anything else, must be server address to connect to
-        if (bClient && addrServer.IsIPv6AllZeros())
+        if ((bClient || bLoadGen) && addrServer.IsIPv6AllZeros())
         {
             if (!addrServer.ParseString(argv[i]))
                 MY_LOG_FMT(error, "Invalid server address '{}'", argv[i]);
@@ -69,7 +552,8 @@ AppOptions ReadAppOptions(int argc, const char* argv[])
         PrintUsageAndExit();
     }
 
-    if (bClient == bServer || (bClient && addrServer.IsIPv6AllZeros()))
+    if ((int)bClient + (int)bServer + (int)bLoadGen + (int)bTranscript != 1 ||
+        ((bClient || bLoadGen) && addrServer.IsIPv6AllZeros()) || (bTranscript && sTranscriptSegment.empty()))
         PrintUsageAndExit();
 
     return options;
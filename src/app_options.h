@@ -1,5 +1,12 @@
 #pragma once
+#include <async_log_sink.h>
+#include <chat_server.h>
+#include <load_generator.h>
+#include <loop_waiter.h>
+#include <non_blocking_console_user_input.h>
 #include <steam/steamnetworkingsockets.h>
+#include <steam_networking_init_RAII.h>
+#include <string>
 
 struct AppOptions
 {
@@ -7,6 +14,15 @@ struct AppOptions
     bool bClient = false;
     int nPort = 0;
     SteamNetworkingIPAddr addrServer;
+    LoopWaiter::Options loopWaiterOptions;
+    ChatServer::Options serverOptions;
+    bool bLoadGen = false;
+    LoadGenerator::Options loadGeneratorOptions;
+    SteamNetworkingInitRAII::Options steamNetworkingOptions;
+    AsyncLogSink::Options logSinkOptions;
+    bool bTranscript = false;
+    std::string sTranscriptSegment; // The segment to print.
+    NonBlockingConsoleUserInput::Options consoleInputOptions;
 };
 
 AppOptions ReadAppOptions(int argc, const char* argv[]);
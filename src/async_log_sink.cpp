@@ -0,0 +1,85 @@
+#include "async_log_sink.h"
+#include <algorithm>
+#include <my_cpp_utils/logger.h>
+
+AsyncLogSink::AsyncLogSink(const Options& options) : options(options), ring(options.nCapacity)
+{
+    writerThread = std::thread([this]() { RunWriter(); });
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+    bStop = true;
+    writerThread.join();
+    if (uint64 nLost = GetDroppedCount())
+        MY_LOG_FMT(warn, "[AsyncLogSink] Dropped {} line(s) because the ring was full", nLost);
+}
+
+void AsyncLogSink::Write(Level eLevel, std::string_view sPrefix, std::string_view sText)
+{
+    Record_t record;
+    record.m_eLevel = eLevel;
+    size_t cbPrefix = std::min(sPrefix.size(), k_cbMaxLine);
+    size_t cbText = std::min(sText.size(), k_cbMaxLine - cbPrefix);
+    sPrefix.copy(record.m_szText, cbPrefix);
+    sText.copy(record.m_szText + cbPrefix, cbText);
+    record.m_cbText = (uint16)(cbPrefix + cbText);
+
+    while (!ring.TryPush(std::move(record)))
+    {
+        if (options.overflowPolicy == OverflowPolicy::Drop)
+        {
+            nDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+AsyncLogSink::Level AsyncLogSink::FromDebugOutputType(ESteamNetworkingSocketsDebugOutputType eType)
+{
+    if (eType <= k_ESteamNetworkingSocketsDebugOutputType_Error)
+        return Level::Error;
+    if (eType <= k_ESteamNetworkingSocketsDebugOutputType_Warning)
+        return Level::Warn;
+    return Level::Info;
+}
+
+void AsyncLogSink::RunWriter()
+{
+    while (!bStop)
+    {
+        if (WriteBatch() == 0)
+            std::this_thread::sleep_for(options.flushInterval);
+    }
+    // Producers are gone by now, so this empties the ring.
+    while (WriteBatch() > 0)
+    {
+    }
+}
+
+int AsyncLogSink::WriteBatch()
+{
+    // Bounded, so a flood of lines does not keep the writer from noticing bStop.
+    static constexpr int k_nMaxBatch = 256;
+    int nLines = 0;
+    Record_t record;
+    while (nLines < k_nMaxBatch && ring.TryPop(record))
+    {
+        ++nLines;
+        std::string_view sText(record.m_szText, record.m_cbText);
+        switch (record.m_eLevel)
+        {
+        case Level::Error:
+            MY_LOG_FMT(error, "{}", sText);
+            break;
+        case Level::Warn:
+            MY_LOG_FMT(warn, "{}", sText);
+            break;
+        default:
+            MY_LOG_FMT(info, "{}", sText);
+            break;
+        }
+    }
+    return nLines;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mpsc_queue.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string_view>
+#include <thread>
+
+// Moves log I/O off the networking threads.  Producers copy a line into a
+// preallocated slot of a lock-free ring; a writer thread drains the ring in
+// batches into the regular logger.  Any thread may write.
+class AsyncLogSink
+{
+public:
+    enum class Level
+    {
+        Info,
+        Warn,
+        Error
+    };
+    enum class OverflowPolicy
+    {
+        Drop, // Count the line and move on; the networking threads never wait.
+        Block // Spin until the writer makes room; nothing is lost.
+    };
+    struct Options
+    {
+        size_t nCapacity = 1 << 12; // Lines in flight.  Must be a power of two.
+        OverflowPolicy overflowPolicy = OverflowPolicy::Drop;
+        std::chrono::milliseconds flushInterval{5}; // How long the writer sleeps when the ring is empty.
+    };
+    static constexpr size_t k_cbMaxLine = 496; // Longer lines are truncated.
+private:
+    struct Record_t
+    {
+        Level m_eLevel = Level::Info;
+        uint16 m_cbText = 0;
+        char m_szText[k_cbMaxLine];
+    };
+    Options options;
+    MpscQueue<Record_t> ring;
+    std::atomic<bool> bStop = false;
+    std::atomic<uint64> nDropped = 0;
+    std::thread writerThread;
+public:
+    AsyncLogSink(const Options& options);
+    // Writes out everything still queued.
+    ~AsyncLogSink();
+    // `sPrefix` and `sText` are copied into one line, so callers need not format them together.
+    void Write(Level eLevel, std::string_view sPrefix, std::string_view sText);
+    void Write(Level eLevel, std::string_view sText) { Write(eLevel, {}, sText); }
+    uint64 GetDroppedCount() const { return nDropped.load(std::memory_order_relaxed); }
+    static Level FromDebugOutputType(ESteamNetworkingSocketsDebugOutputType eType);
+private:
+    void RunWriter();
+    int WriteBatch();
+};
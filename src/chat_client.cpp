@@ -1,43 +1,82 @@
 #include "chat_client.h"
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cstring>
 #include <my_cpp_utils/logger.h>
 #include <steam/isteamnetworkingutils.h>
 #include <steam/steamnetworkingsockets.h>
-#include <thread>
+#include <steam_networking_init_RAII.h>
+
+namespace
+{
+
+// Everybody in the room hears our heartbeat this often, whether or not it changed.
+constexpr SteamNetworkingMicroseconds k_usecHeartbeatInterval = 15'000'000;
+// Read markers are sent at most this often, however fast lines arrive.
+constexpr SteamNetworkingMicroseconds k_usecReadMarkerInterval = 1'000'000;
+// A restarting server is back within seconds, so keep looking for it about that long.
+constexpr SteamNetworkingMicroseconds k_usecReconnectDelay = 1'000'000;
+constexpr int k_nMaxReconnectAttempts = 10;
+
+} // namespace
 
 ChatClient* ChatClient::s_pCallbackInstance = nullptr;
 
-ChatClient::ChatClient(NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag)
-  : nonBlockingConsoleUserInput(nonBlockingConsoleUserInput), quitFlag(quitFlag)
+ChatClient::ChatClient(
+    NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter)
+  : nonBlockingConsoleUserInput(nonBlockingConsoleUserInput), quitFlag(quitFlag), loopWaiter(loopWaiter)
 {}
 
 void ChatClient::Run(const SteamNetworkingIPAddr& serverAddr)
 {
     // Select instance to use.  For now we'll always use the default.
     m_pInterface = SteamNetworkingSockets();
+    m_serverAddr = serverAddr;
+    Connect();
+
+    while (!quitFlag)
+    {
+        int nWork = PollIncomingMessages();
+        nWork += PollConnectionStateChanges();
+        nWork += ReconnectIfDue();
+        nWork += PollLocalUserInput();
+        nWork += SendEphemeralMessages();
+        loopWaiter.Wait(nWork > 0);
+    }
+}
 
+void ChatClient::Connect()
+{
     // Start connecting
     char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
-    serverAddr.ToString(szAddr, sizeof(szAddr), true);
+    m_serverAddr.ToString(szAddr, sizeof(szAddr), true);
     MY_LOG_FMT(info, "Connecting to chat server at {}", szAddr);
     SteamNetworkingConfigValue_t opt;
     opt.SetPtr(
         k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
-    m_hConnection = m_pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
+    m_hConnection = m_pInterface->ConnectByIPAddress(m_serverAddr, 1, &opt);
     if (m_hConnection == k_HSteamNetConnection_Invalid)
         MY_LOG(error, "Failed to create connection");
+}
 
-    while (!quitFlag)
-    {
-        PollIncomingMessages();
-        PollConnectionStateChanges();
-        PollLocalUserInput();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
+int ChatClient::ReconnectIfDue()
+{
+    if (m_usecReconnectAt == 0 || SteamNetworkingUtils()->GetLocalTimestamp() < m_usecReconnectAt)
+        return 0;
+    m_usecReconnectAt = 0;
+    ++m_nReconnectAttempts;
+    Connect();
+    return 1;
 }
 
-void ChatClient::PollIncomingMessages()
+int ChatClient::PollIncomingMessages()
 {
+    // Nothing to receive while we are between connections.
+    if (m_hConnection == k_HSteamNetConnection_Invalid)
+        return 0;
+
+    int nMessages = 0;
     while (!quitFlag)
     {
         ISteamNetworkingMessage* pIncomingMsg = nullptr;
@@ -45,22 +84,81 @@ void ChatClient::PollIncomingMessages()
         if (numMsgs == 0)
             break;
         if (numMsgs < 0)
+        {
             MY_LOG(error, "Error checking for messages");
+            break;
+        }
+        ++nMessages;
 
-        // Just echo anything we get from the server
-        fwrite(pIncomingMsg->m_pData, 1, pIncomingMsg->m_cbSize, stdout);
-        fputc('\n', stdout);
+        // A message may hold several envelopes.
+        auto handleMessage = [this](const WireMessage& msg) { HandleServerMessage(msg); };
+        if (!Wire::ForEachMessage(pIncomingMsg->m_pData, (size_t)pIncomingMsg->m_cbSize, handleMessage))
+            MY_LOG(error, "Received a malformed message");
 
         // We don't need this anymore.
         pIncomingMsg->Release();
     }
+    return nMessages;
 }
 
-void ChatClient::PollLocalUserInput()
+void ChatClient::HandleServerMessage(const WireMessage& msg)
 {
+    switch (msg.eType)
+    {
+    case WireType::Welcome:
+        m_nOwnId = msg.nSender;
+        MY_LOG_FMT(info, "Server knows us as #{}, agreed capabilities: {}", m_nOwnId, msg.nFlags);
+        break;
+
+    case WireType::NickMap:
+        m_nicks[msg.nSender] = msg.sBody;
+        break;
+
+    case WireType::Session:
+        m_sResumeToken = msg.sBody;
+        break;
+
+    case WireType::Notice:
+        // Just echo anything the server tells us
+        printf("%.*s\n", (int)msg.sBody.size(), msg.sBody.data());
+        break;
+
+    case WireType::Chat:
+        {
+            ++m_nChatLinesSeen;
+            auto itNick = m_nicks.find(msg.nSender);
+            if (itNick != m_nicks.end())
+                printf("%s: %.*s\n", itNick->second.c_str(), (int)msg.sBody.size(), msg.sBody.data());
+            else
+                printf("#%u: %.*s\n", msg.nSender, (int)msg.sBody.size(), msg.sBody.data());
+            break;
+        }
+
+    case WireType::Replay:
+        {
+            std::string_view sNick, sText;
+            if (Wire::DecodeReplay(msg.sBody, sNick, sText))
+            {
+                printf(
+                    "(earlier) %.*s: %.*s\n", (int)sNick.size(), sNick.data(), (int)sText.size(), sText.data());
+            }
+            break;
+        }
+
+    default:
+        // Typing, Presence and ReadMarker are for clients with a user interface to show them in, and newer
+        // servers may send things we don't know about.
+        break;
+    }
+}
+
+int ChatClient::PollLocalUserInput()
+{
+    int nCommands = 0;
     std::string cmd;
     while (!quitFlag && nonBlockingConsoleUserInput.GetNext(cmd))
     {
+        ++nCommands;
         // Check for known commands
         if (strcmp(cmd.c_str(), "/quit") == 0)
         {
@@ -68,17 +166,98 @@ void ChatClient::PollLocalUserInput()
             MY_LOG(info, "Disconnecting from chat server");
 
             // Close the connection gracefully.
-            // We use linger mode to ask for any remaining reliable data
-            // to be flushed out.  But remember this is an application
-            // protocol on UDP.  See ShutdownSteamDatagramConnectionSockets
+            // We wait for any remaining reliable data to be acknowledged, since
+            // lingering alone would not hold up the library shutting down.  But
+            // remember this is an application protocol on UDP, so not forever.
+            SteamNetworkingInitRAII::WaitForFlush(m_pInterface, {m_hConnection}, k_shutdownTimeout);
             m_pInterface->CloseConnection(m_hConnection, 0, "Goodbye", true);
             break;
         }
 
-        // Anything else, just send it to the server and let them parse it
-        m_pInterface->SendMessageToConnection(
-            m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr);
+        if (!EncodeUserInput(cmd))
+        {
+            printf(
+                "Unknown command '%s'. Known commands: /nick NAME, /join ROOM, /leave, /rooms [PAGE], /away, /back, "
+                "/quit\n",
+                cmd.c_str());
+            continue;
+        }
+        SendToServer();
+    }
+    return nCommands;
+}
+
+bool ChatClient::EncodeUserInput(std::string_view sInput)
+{
+    m_sendBuffer.clear();
+    if (sInput.empty() || sInput[0] != '/')
+    {
+        Wire::Append<WireType::Say>(m_sendBuffer, m_nOwnId, sInput);
+        return true;
+    }
+
+    size_t nNameEnd = std::min(sInput.find(' '), sInput.size());
+    std::string_view sName = sInput.substr(0, nNameEnd);
+    std::string_view sArgs = sInput.substr(std::min(nNameEnd + 1, sInput.size()));
+    if (sName == "/nick")
+        Wire::Append<WireType::SetNick>(m_sendBuffer, m_nOwnId, sArgs);
+    else if (sName == "/join")
+        Wire::Append<WireType::Join>(m_sendBuffer, m_nOwnId, sArgs);
+    else if (sName == "/leave")
+        Wire::Append<WireType::Leave>(m_sendBuffer, m_nOwnId);
+    else if (sName == "/rooms")
+        Wire::Append<WireType::ListRooms>(m_sendBuffer, m_nOwnId, sArgs);
+    else if (sName == "/away" || sName == "/back")
+    {
+        // Tell the room right away rather than at the next heartbeat.
+        m_nPresence = sName == "/away" ? WirePresence::k_nAway : WirePresence::k_nActive;
+        Wire::Append<WireType::Presence>(m_sendBuffer, m_nOwnId, {}, m_nPresence);
+    }
+    else
+        return false;
+    return true;
+}
+
+int ChatClient::SendEphemeralMessages()
+{
+    // Nothing to say until the server has welcomed us.
+    if (m_nOwnId == 0)
+        return 0;
+
+    int nSent = 0;
+    SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+    if (usecNow >= m_usecNextHeartbeat)
+    {
+        m_usecNextHeartbeat = usecNow + k_usecHeartbeatInterval;
+        m_sendBuffer.clear();
+        Wire::Append<WireType::Presence>(m_sendBuffer, m_nOwnId, {}, m_nPresence);
+        SendToServer();
+        ++nSent;
+    }
+    if (m_nChatLinesSeen != m_nChatLinesMarked && usecNow >= m_usecNextReadMarker)
+    {
+        m_usecNextReadMarker = usecNow + k_usecReadMarkerInterval;
+        m_nChatLinesMarked = m_nChatLinesSeen;
+        char marker[WireTraits<WireType::ReadMarker>::k_cbMaxBody];
+        char* pEnd = std::to_chars(marker, marker + sizeof(marker), m_nChatLinesMarked).ptr;
+        m_sendBuffer.clear();
+        Wire::Append<WireType::ReadMarker>(m_sendBuffer, m_nOwnId, std::string_view(marker, (size_t)(pEnd - marker)));
+        SendToServer();
+        ++nSent;
     }
+    return nSent;
+}
+
+void ChatClient::SendToServer()
+{
+    // Every client message is one envelope, and its type decides the lane.
+    uint16 nLane = WireLane::Of((WireType)(uint8)m_sendBuffer[0]);
+    SteamNetworkingMessage_t* pMsg = SteamNetworkingUtils()->AllocateMessage((int)m_sendBuffer.size());
+    memcpy(pMsg->m_pData, m_sendBuffer.data(), m_sendBuffer.size());
+    pMsg->m_conn = m_hConnection;
+    pMsg->m_nFlags = WireLane::SendFlagsOf(nLane);
+    pMsg->m_idxLane = nLane;
+    m_pInterface->SendMessages(1, &pMsg, nullptr);
 }
 
 void ChatClient::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo)
@@ -95,7 +274,18 @@ void ChatClient::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
     case k_ESteamNetworkingConnectionState_ClosedByPeer:
     case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
         {
-            quitFlag = true;
+            // Unless the server meant to be rid of us, e.g. kicked us, we may be able to pick up where we
+            // left off, say after it restarted.  Its reasons for that are above the generic one.
+            int nEndReason = pInfo->m_info.m_eEndReason;
+            bool bDismissed = nEndReason > k_ESteamNetConnectionEnd_App_Generic &&
+                              nEndReason <= k_ESteamNetConnectionEnd_App_Max;
+            bool bReconnect = !quitFlag && !bDismissed && !m_sResumeToken.empty() &&
+                              m_nReconnectAttempts < k_nMaxReconnectAttempts;
+            if (bReconnect)
+                m_usecReconnectAt = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecReconnectDelay;
+            else
+                quitFlag = true;
+            m_nOwnId = 0;
 
             // Print an appropriate message
             if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting)
@@ -126,6 +316,8 @@ void ChatClient::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
             // so we just pass 0's.
             m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
             m_hConnection = k_HSteamNetConnection_Invalid;
+            if (bReconnect)
+                MY_LOG(info, "We shall seek the host again shortly, and resume where we left off.");
             break;
         }
 
@@ -135,8 +327,20 @@ void ChatClient::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
         break;
 
     case k_ESteamNetworkingConnectionState_Connected:
-        MY_LOG(info, "Connected to server OK");
-        break;
+        {
+            MY_LOG(info, "Connected to server OK");
+            m_nReconnectAttempts = 0;
+            // Must come before anything is sent on the presence lane.
+            m_pInterface->ConfigureConnectionLanes(
+                pInfo->m_hConn, WireLane::k_nCount, WireLane::k_defaultPriorities.data(),
+                WireLane::k_defaultWeights.data());
+            // Ask for our messages of each server tick to be packed together, and to be who we were if
+            // this is not our first time.
+            m_sendBuffer.clear();
+            Wire::Append<WireType::Hello>(m_sendBuffer, 0, m_sResumeToken, WireHello::k_nFlagBatch);
+            SendToServer();
+            break;
+        }
 
     default:
         // Silences -Wswitch
@@ -146,11 +350,14 @@ void ChatClient::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
 
 void ChatClient::SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo)
 {
+    ++s_pCallbackInstance->nCallbacksThisTick;
     s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
 }
 
-void ChatClient::PollConnectionStateChanges()
+int ChatClient::PollConnectionStateChanges()
 {
     s_pCallbackInstance = this;
+    nCallbacksThisTick = 0;
     m_pInterface->RunCallbacks();
+    return nCallbacksThisTick;
 }
@@ -1,23 +1,56 @@
 #pragma once
+#include <chrono>
+#include <loop_waiter.h>
 #include <non_blocking_console_user_input.h>
 #include <steam/isteamnetworkingsockets.h>
 #include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <wire_protocol.h>
 
 class ChatClient
 {
+    // Longest /quit waits for our last lines to reach the server.
+    static constexpr std::chrono::milliseconds k_shutdownTimeout{1000};
     NonBlockingConsoleUserInput& nonBlockingConsoleUserInput;
     std::atomic<bool>& quitFlag;
-    HSteamNetConnection m_hConnection;
+    LoopWaiter& loopWaiter;
+    HSteamNetConnection m_hConnection = k_HSteamNetConnection_Invalid;
     ISteamNetworkingSockets* m_pInterface;
+    SteamNetworkingIPAddr m_serverAddr;
+    std::string m_sResumeToken; // From the server's Session, sent in our Hello when we come back.
+    SteamNetworkingMicroseconds m_usecReconnectAt = 0; // When to seek the server again, 0 if we are not lost.
+    int m_nReconnectAttempts = 0; // Since we were last connected.
+    uint32 m_nOwnId = 0;                            // From the server's Welcome.
+    std::unordered_map<uint32, std::string> m_nicks; // Sender id -> nick, from NickMap messages.
+    std::string m_sendBuffer;                       // Outgoing envelopes are encoded here.
+    uint8 m_nPresence = WirePresence::k_nActive;    // What our heartbeats say, changed by /away and /back.
+    SteamNetworkingMicroseconds m_usecNextHeartbeat = 0;
+    uint64 m_nChatLinesSeen = 0;   // Chat lines printed so far, which is what our read markers say.
+    uint64 m_nChatLinesMarked = 0; // The count in our last read marker.
+    SteamNetworkingMicroseconds m_usecNextReadMarker = 0;
 public:
-    ChatClient(NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag);
+    ChatClient(
+        NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter);
     void Run(const SteamNetworkingIPAddr& serverAddr);
 private:
-    void PollIncomingMessages();
-    void PollLocalUserInput();
+    void Connect();
+    // Once we lost the server, try again when it is time, as long as we have a session to resume.
+    int ReconnectIfDue();
+    int PollIncomingMessages();
+    void HandleServerMessage(const WireMessage& msg);
+    int PollLocalUserInput();
+    // Turn a console line into a request, e.g. "/join ROOM" into WireType::Join.  Returns false if unknown.
+    bool EncodeUserInput(std::string_view sInput);
+    // Send the heartbeat and read marker when they are due, on the presence lane.
+    int SendEphemeralMessages();
+    // Send m_sendBuffer on the lane of its envelope's type.
+    void SendToServer();
 private: // OnSteamNetConnectionStatusChanged stuff.
     void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo);
     static ChatClient* s_pCallbackInstance;
     static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo);
-    void PollConnectionStateChanges();
+    int PollConnectionStateChanges();
+    int nCallbacksThisTick = 0;
 };
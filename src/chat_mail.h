@@ -0,0 +1,38 @@
+#pragma once
+#include <mpsc_queue.h>
+#include <room_directory.h>
+#include <shared_payload.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <wire_protocol.h>
+
+// Work item passed between the central server thread and the shards.
+struct ChatMail
+{
+    enum class Type
+    {
+        None,
+        AddClient,       // Server -> shard: start serving `hConn` as `sNick`, with id `nClientId`, in no room yet.
+        IntroduceClient, // Server -> shard: everybody knows `hConn` now, put them in the lobby.
+        RemoveClient,    // Server -> shard: forget `hConn`.
+        DetachClient,    // Server -> shard: forget `hConn`, but its nick stays reserved for it to resume.
+        ResumeClient,    // Server -> shard: `hConn` is back as `sNick` with id `nClientId`, put them in `nRoom`
+                         // and replay its history from line `nHistoryLine`.
+        Broadcast,       // Any -> shard: send `pPayload` on `nLane` to the local clients in `nRoom` except `hConn`.
+        NickChanged,     // Shard -> server: `hConn` is now known as `sNick`.
+        RoomChanged,     // Shard -> server: `hConn` moved to `nRoom`.
+        EvictClient,     // Shard -> server: disconnect `hConn`, it cannot keep up with its traffic.
+        EvictFlooder,    // Shard -> server: disconnect `hConn`, it keeps sending faster than its flood limits.
+        Hello,           // Shard -> server: `hConn` said Hello, with the token to resume with in `sNick` if any.
+    };
+    Type eType = Type::None;
+    HSteamNetConnection hConn = k_HSteamNetConnection_Invalid;
+    std::string sNick;
+    SharedPayload* pPayload = nullptr; // The mail owns one reference.
+    uint32 nRoom = RoomDirectory::k_nAllRooms;
+    uint32 nClientId = 0;
+    uint16 nLane = WireLane::k_nChat;
+    uint64 nHistoryLine = 0;
+};
+
+using ChatMailbox = MpscQueue<ChatMail>;
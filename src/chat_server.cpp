@@ -1,167 +1,1120 @@
 #include "chat_server.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <filesystem>
 #include <my_cpp_utils/logger.h>
+#include <shared_payload.h>
+#include <steam_networking_init_RAII.h>
 #include <steam/isteamnetworkingutils.h>
 #include <steam/steamnetworkingsockets.h>
 #include <string>
-#include <thread>
 
 ChatServer* ChatServer::s_pCallbackInstance = nullptr;
 
-ChatServer::ChatServer(NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag)
-  : nonBlockingConsoleUserInput(nonBlockingConsoleUserInput), quitFlag(quitFlag)
-{}
+ChatServer::ChatServer(
+    NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter,
+    AsyncLogSink& logSink, const Options& options)
+  : nonBlockingConsoleUserInput(nonBlockingConsoleUserInput), quitFlag(quitFlag), loopWaiter(loopWaiter),
+    logSink(logSink), options(options), rooms(options.roomOptions, options.historyOptions),
+    pPayloadPool(PayloadPool::Create(options.shardOptions.payloadPoolOptions))
+{
+    // Before any client shows up, so the rooms have their history back by then.
+    if (!options.transcriptOptions.sDirectory.empty())
+        pTranscript = std::make_unique<TranscriptLog>(options.transcriptOptions, rooms);
+    if (!options.sSnapshotFile.empty())
+        LoadSnapshot();
+}
 
 void ChatServer::Run(uint16 nPort)
+{
+    Start(nPort);
+    while (!quitFlag)
+    {
+        int nWork = Tick();
+        // MY: Sleep only if nothing happened during this iteration, see LoopWaiter::Mode.
+        loopWaiter.Wait(nWork > 0);
+    }
+    Stop();
+}
+
+void ChatServer::Start(uint16 nPort)
 {
     // Select instance to use.  For now we'll always use the default.
     // But we could use SteamChatServerNetworkingSockets() on Steam.
     pInterface = SteamNetworkingSockets();
+    SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+    acceptBucket = TokenBucket(options.flAcceptsPerSec, std::max(1, options.nAcceptBurst), usecNow);
 
     // Start listening
-    SteamNetworkingIPAddr serverLocalAddr;
-    serverLocalAddr.Clear();
-    serverLocalAddr.m_port = nPort;
+    if (nPort != 0)
+    {
+        SteamNetworkingIPAddr serverLocalAddr;
+        serverLocalAddr.Clear();
+        serverLocalAddr.m_port = nPort;
 
-    SteamNetworkingConfigValue_t opt;
-    opt.SetPtr(
-        k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+        SteamNetworkingConfigValue_t opt;
+        opt.SetPtr(
+            k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
 
-    hListenSock = pInterface->CreateListenSocketIP(serverLocalAddr, 1, &opt);
-    if (hListenSock == k_HSteamListenSocket_Invalid)
-        MY_LOG_FMT(error, "[ChatServer] Failed to listen on port {}", nPort);
+        hListenSock = pInterface->CreateListenSocketIP(serverLocalAddr, 1, &opt);
+        if (hListenSock == k_HSteamListenSocket_Invalid)
+            MY_LOG_FMT(error, "[ChatServer] Failed to listen on port {}", nPort);
+    }
 
-    hPollGroup = pInterface->CreatePollGroup();
-    if (hPollGroup == k_HSteamNetPollGroup_Invalid)
-        MY_LOG_FMT(error, "[ChatServer] Failed to create poll group for server on port {}", nPort);
+    // MY: Each shard owns one poll group.  See ChatShard.
+    StartShards();
 
-    MY_LOG_FMT(info, "[ChatServer] Server listening on port {}", nPort);
+    statsReport.startTime = std::chrono::steady_clock::now();
+    statsReport.dumpWindow.lastReportTime = statsReport.commandWindow.lastReportTime = statsReport.startTime;
+    statsReport.nextDumpTime = statsReport.startTime + std::chrono::seconds(options.nStatsIntervalSec);
+    if (options.nStatsIntervalSec > 0)
+    {
+        statsReport.pFile = fopen(options.sStatsFile.c_str(), "a");
+        if (!statsReport.pFile)
+            MY_LOG_FMT(error, "[ChatServer] Failed to open stats file '{}'", options.sStatsFile);
+    }
 
-    while (!quitFlag)
+    MY_LOG_FMT(info, "[ChatServer] Server listening on port {} with {} worker(s)", nPort, shards.size());
+}
+
+int ChatServer::Tick()
+{
+    // MY: Recieve messages from clients until the ReceiveMessagesOnPollGroup is empty.
+    // With several workers the shards do this on their own threads.
+    int nWork = TickShardsInline();
+    // MY: Apply notifications from the shards, e.g. nick changes.
+    nWork += DrainMailbox();
+    // MY: Run all callbacks including OnSteamNetConnectionStatusChanged.
+    // - Case 01: Detect problems with connections and close them localy by API.
+    // - Case 02: Queue new connections for admission, or turn them away when full.
+    nWork += PollConnectionStateChanges();
+    // MY: AcceptConnection, SetConnectionPollGroup, Create Nickname, Send Welcome message, at a bounded rate.
+    nWork += AdmitPendingConnections();
+    // MY: Check if the user has entered `/quit` command and set the g_bQuit flag.
+    nWork += PollLocalUserInput();
+    if (rooms.UpdateRates())
+        ReclaimEmptyRooms();
+    DumpStatsIfDue();
+    return nWork;
+}
+
+void ChatServer::Stop()
+{
+    StopShards();
+    if (!options.sSnapshotFile.empty())
     {
-        PollIncomingMessages(); // MY: Recieve messages from clients until the ReceiveMessagesOnPollGroup is
-                                // empty.
-        PollConnectionStateChanges(); // MY: Run all callbacks including OnSteamNetConnectionStatusChanged.
-                                      // - Case 01: Detect problems with connections and close them localy by
-                                      // API.
-                                      // - Case 02: AcceptConnection, SetConnectionPollGroup, Create Nickname,
-                                      // Send
-                                      //   Welcome message.
-        PollLocalUserInput(); // MY: Check if the user has entered `/quit` command and set the g_bQuit flag.
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        // Whatever the shards told us last, e.g. a nick change, belongs in the snapshot.
+        DrainMailbox();
+        SaveSnapshot();
     }
 
     // Close all the connections
     MY_LOG(info, "[ChatServer] Closing connections...");
-    for (auto it : mapClients)
-    {
-        // Send them one more goodbye message.  Note that we also have the
-        // connection close reason as a place to send final data.  However,
-        // that's usually best left for more diagnostic/debug text not actual
-        // protocol strings.
-        SendStringToClient(it.first, "Server is shutting down. Goodbye.");
+    auto start = std::chrono::steady_clock::now();
 
-        // Close the connection.  We use "linger mode" to ask SteamNetworkingSockets
-        // to flush this out and close gracefully.
-        pInterface->CloseConnection(it.first, 0, "Server Shutdown", true);
+    // Send them one more goodbye message, encoded once and sent to all of them in one call.  Note that
+    // we also have the connection close reason as a place to send final data.  However, that's usually
+    // best left for more diagnostic/debug text not actual protocol strings.
+    std::string goodbye;
+    Wire::Append<WireType::Notice>(goodbye, 0, "Server is shutting down. Goodbye.");
+    SharedPayload* pGoodbye = SharedPayload::Create(goodbye.data(), (uint32)goodbye.size(), pPayloadPool.get());
+    std::vector<HSteamNetConnection> connections;
+    connections.reserve(directory.Size());
+    for (auto& [hConn, client] : directory)
+    {
+        SteamNetworkingMessage_t* pMsg = SteamNetworkingUtils()->AllocateMessage(0);
+        pGoodbye->AttachTo(pMsg);
+        pMsg->m_conn = hConn;
+        pMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+        outgoingMessages.push_back(pMsg);
+        connections.push_back(hConn);
     }
-    mapClients.clear();
+    pGoodbye->Release();
+    stats.RecordSend(outgoingMessages.size(), goodbye.size());
+    if (!outgoingMessages.empty())
+        pInterface->SendMessages((int)outgoingMessages.size(), outgoingMessages.data(), nullptr);
+    outgoingMessages.clear();
+
+    // Wait for it, and whatever was queued before it, to get through, but no longer than we were told.
+    // Closing with linger would not tell us when they were done, and would not help either: the library
+    // shuts down right after us and drops whatever is still lingering.  So this wait is all they get.
+    std::vector<HSteamNetConnection> unflushed = SteamNetworkingInitRAII::WaitForFlush(
+        pInterface, connections, std::chrono::milliseconds(options.nShutdownTimeoutMs));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    MY_LOG_FMT(
+        info, "[ChatServer] Flushed {} of {} connections in {} ms", connections.size() - unflushed.size(),
+        connections.size(), std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+    if (!unflushed.empty())
+        MY_LOG_FMT(warn, "[ChatServer] {} connection(s) lose what they had not received yet", unflushed.size());
 
-    pInterface->CloseListenSocket(hListenSock);
+    for (HSteamNetConnection hConn : connections)
+        pInterface->CloseConnection(hConn, 0, "Server Shutdown", false);
+    directory.Clear();
+    introducedByToken.clear();
+    awaitingHello.clear();
+    introduceThisTick.clear();
+    for (const PendingAccept_t& pending : admissionQueue)
+        pInterface->CloseConnection(pending.hConn, 0, "Server Shutdown", false);
+    admissionQueue.clear();
+
+    if (hListenSock != k_HSteamListenSocket_Invalid)
+        pInterface->CloseListenSocket(hListenSock);
     hListenSock = k_HSteamListenSocket_Invalid;
 
-    pInterface->DestroyPollGroup(hPollGroup);
-    hPollGroup = k_HSteamNetPollGroup_Invalid;
+    for (auto& pShard : shards)
+        pShard->LogCounters();
+    shards.clear();
+
+    if (statsReport.pFile)
+    {
+        fclose(statsReport.pFile);
+        statsReport.pFile = nullptr;
+    }
+}
+
+void ChatServer::Post(ChatMail&& mail)
+{
+    // Neither side waits for the other's mailbox, or the two could wait for each other forever.  Shards post
+    // to us from their own threads, so mail that does not fit waits in the overflow, in order.
+    if (bOverflow.load(std::memory_order_acquire) || !mailbox.TryPush(std::move(mail)))
+    {
+        std::lock_guard<std::mutex> lock{mutexOverflow};
+        overflowMail.push_back(std::move(mail));
+        bOverflow.store(true, std::memory_order_release);
+    }
+    loopWaiter.Notify();
+}
+
+bool ChatServer::PopMail(ChatMail& mail)
+{
+    // What went to the overflow was posted after everything in the mailbox at the time, and before
+    // anything that went to the mailbox once the overflow was taken.
+    if (!overflowBatch.empty())
+    {
+        mail = std::move(overflowBatch.front());
+        overflowBatch.pop_front();
+        return true;
+    }
+    if (mailbox.TryPop(mail))
+        return true;
+    if (!bOverflow.load(std::memory_order_acquire))
+        return false;
+    {
+        std::lock_guard<std::mutex> lock{mutexOverflow};
+        overflowBatch.swap(overflowMail);
+        bOverflow.store(false, std::memory_order_release);
+    }
+    return PopMail(mail);
+}
+
+void ChatServer::PostBroadcast(
+    SharedPayload* pPayload, HSteamNetConnection except, uint32 nRoom, const ChatShard* pSkipShard, uint16 nLane)
+{
+    for (auto& pShard : shards)
+    {
+        if (pShard.get() == pSkipShard)
+            continue;
+        pPayload->AddRef();
+        pShard->Post(ChatMail{ChatMail::Type::Broadcast, except, {}, pPayload, nRoom, 0, nLane});
+    }
+}
+
+void ChatServer::StartShards()
+{
+    int nWorkers = std::max(1, options.nWorkers);
+    shardLoad.assign(nWorkers, 0);
+    if (nWorkers == 1)
+    {
+        // A single shard is ticked by the server loop itself.
+        shards.push_back(std::make_unique<ChatShard>(*this, quitFlag, loopWaiter, 0, options.shardOptions));
+        return;
+    }
+
+    for (int i = 0; i < nWorkers; ++i)
+    {
+        workerWaiters.push_back(std::make_unique<LoopWaiter>(loopWaiter.GetOptions()));
+        shards.push_back(std::make_unique<ChatShard>(*this, quitFlag, *workerWaiters.back(), i, options.shardOptions));
+    }
+    for (auto& pShard : shards)
+        workerThreads.emplace_back([pShard = pShard.get()]() { pShard->RunWorker(); });
+}
+
+void ChatServer::StopShards()
+{
+    assert(quitFlag);
+    for (auto& pWaiter : workerWaiters)
+        pWaiter->Notify();
+    for (auto& thread : workerThreads)
+        thread.join();
+    workerThreads.clear();
+}
+
+int ChatServer::TickShardsInline()
+{
+    if (!workerThreads.empty())
+        return 0;
+    int nWork = 0;
+    for (auto& pShard : shards)
+        nWork += pShard->Tick();
+    return nWork;
+}
+
+int ChatServer::DrainMailbox()
+{
+    int nMails = 0;
+    ChatMail mail;
+    while (PopMail(mail))
+    {
+        ++nMails;
+
+        // The client may have disconnected in the meantime.
+        ClientInfo_t* pClient = directory.Find(mail.hConn);
+        if (!pClient)
+            continue;
+
+        switch (mail.eType)
+        {
+        case ChatMail::Type::NickChanged:
+            pClient->m_nick.Assign(mail.sNick);
+            if (!resumableSessions.empty())
+                Wire::Append<WireType::NickMap>(nickMapLog, pClient->m_nId, mail.sNick);
+            break;
+        case ChatMail::Type::RoomChanged:
+            pClient->m_nRoom = mail.nRoom;
+            break;
+        case ChatMail::Type::Hello:
+            // Only the first Hello counts, it may come after they were introduced without one.
+            if (pClient->m_bIntroduced)
+                break;
+            if (!mail.sNick.empty() && !resumableSessions.contains(mail.sNick))
+            {
+                // They may have lost us before we noticed, and their old connection is still here.
+                auto itStale = introducedByToken.find(mail.sNick);
+                if (itStale != introducedByToken.end())
+                {
+                    HSteamNetConnection hStale = itStale->second;
+                    std::string whatHappened = MY_FMT(
+                        "[ChatServer] Client {}: Back on a new connection.", directory.Find(hStale)->m_nick.View());
+                    DetachClient(hStale, whatHappened, true);
+                    pInterface->CloseConnection(hStale, 0, "Resumed on a new connection", false);
+                    pClient = directory.Find(mail.hConn);
+                }
+            }
+            if (mail.sNick.empty() || !ResumeSession(mail.hConn, *pClient, mail.sNick))
+            {
+                if (!mail.sNick.empty())
+                    SendStringToClient(mail.hConn, "Thy former self is lost to us. Thou art a stranger once more.");
+                introduceThisTick.push_back(mail.hConn);
+            }
+            break;
+        case ChatMail::Type::EvictClient:
+            {
+                std::string whatHappened = MY_FMT(
+                    "[ChatServer] Client {}: Disconnected, could not keep up with the chat.", pClient->m_nick.View());
+                RemoveClient(mail.hConn, whatHappened);
+                // Don't linger, whatever is still queued for them is what got them evicted.
+                pInterface->CloseConnection(
+                    mail.hConn, ChatShard::k_nEndReasonSlowConsumer, "Slow consumer", false);
+                break;
+            }
+        case ChatMail::Type::EvictFlooder:
+            {
+                std::string whatHappened = MY_FMT(
+                    "[ChatServer] Client {}: Disconnected, would not stop flooding the chat.", pClient->m_nick.View());
+                RemoveClient(mail.hConn, whatHappened);
+                pInterface->CloseConnection(mail.hConn, ChatShard::k_nEndReasonFlooding, "Flooding", false);
+                break;
+            }
+        default:
+            assert(!"Unexpected mail for the server");
+            break;
+        }
+    }
+    return nMails;
+}
+
+void ChatServer::RemoveClient(HSteamNetConnection hConn, const std::string& whatHappened)
+{
+    ClientInfo_t* pClient = directory.Find(hConn);
+    assert(pClient);
+
+    // The shard stops serving them before anybody hears about it.
+    shards[pClient->m_nShard]->Post(ChatMail{ChatMail::Type::RemoveClient, hConn, {}});
+    --shardLoad[pClient->m_nShard];
+    uint32 nRoom = pClient->m_nRoom;
+    bool bIntroduced = pClient->m_bIntroduced;
+    if (bIntroduced)
+        introducedByToken.erase(std::string(pClient->m_token.data(), pClient->m_token.size()));
+    directory.Erase(hConn);
+
+    // Send a message so everybody else in their room knows what happened, if they ever heard of them
+    if (bIntroduced)
+        SendStringToRoom(nRoom, whatHappened.c_str());
+    logSink.Write(AsyncLogSink::Level::Info, whatHappened);
+}
+
+void ChatServer::DetachClient(HSteamNetConnection hConn, const std::string& whatHappened, bool bTimedOut)
+{
+    ClientInfo_t* pClient = directory.Find(hConn);
+    assert(pClient && pClient->m_bIntroduced);
+
+    // The shard stops serving them, but their nick stays theirs.
+    shards[pClient->m_nShard]->Post(ChatMail{ChatMail::Type::DetachClient, hConn, {}});
+    --shardLoad[pClient->m_nShard];
+
+    // A connection that timed out was dead that long before we noticed, and nothing their room said
+    // since then reached them.  Better they see a few lines twice than miss them.
+    int32 nTimeoutMs = 0;
+    if (bTimedOut)
+    {
+        ESteamNetworkingConfigDataType eDataType = k_ESteamNetworkingConfig_Int32;
+        size_t cbTimeout = sizeof(nTimeoutMs);
+        SteamNetworkingUtils()->GetConfigValue(
+            k_ESteamNetworkingConfig_TimeoutConnected, k_ESteamNetworkingConfig_Connection, hConn, &eDataType,
+            &nTimeoutMs, &cbTimeout);
+    }
+    RoomDirectory::Room_t& room = rooms.Get(pClient->m_nRoom);
+    uint64 nHistoryLine = room.GetHistoryLineSecondsAgo((nTimeoutMs + 999) / 1000);
+
+    std::string sToken(pClient->m_token.data(), pClient->m_token.size());
+    size_t cbNickMapsHeard = cbNickMapLogTrimmed + nickMapLog.size();
+    HoldSession(
+        sToken, Resumable_t{pClient->m_nId, pClient->m_nick, pClient->m_nRoom, nHistoryLine, cbNickMapsHeard, 0},
+        SteamNetworkingUtils()->GetLocalTimestamp());
+    introducedByToken.erase(sToken);
+    directory.Erase(hConn);
+    AddRelaxed(stats.nSessionsDetached, 1);
+    logSink.Write(AsyncLogSink::Level::Info, whatHappened, " Holding their session.");
+}
+
+void ChatServer::DumpStatsIfDue()
+{
+    if (!statsReport.pFile || std::chrono::steady_clock::now() < statsReport.nextDumpTime)
+        return;
+    statsReport.nextDumpTime += std::chrono::seconds(options.nStatsIntervalSec);
+
+    std::string statsJson = BuildStatsJson(statsReport.dumpWindow);
+    fprintf(statsReport.pFile, "%s\n", statsJson.c_str());
+    fflush(statsReport.pFile);
+}
+
+std::string ChatServer::BuildStatsJson(RateWindow_t& window)
+{
+    auto now = std::chrono::steady_clock::now();
+    double flWindowSec = std::max(1e-3, std::chrono::duration<double>(now - window.lastReportTime).count());
+    double flUptimeSec = std::chrono::duration<double>(now - statsReport.startTime).count();
+    window.lastReportTime = now;
+
+    // Sum the shards.  Their counters are atomics, so this is safe while they run.
+    uint64 nMessagesIn = 0, nBytesIn = 0, nMessagesOut = stats.nMessagesOut, nBytesOut = stats.nBytesOut;
+    uint64 nFanouts = 0, nRelayedMessages = 0, nRelayAllocations = 0;
+    uint64 nSendBudgetHits = 0, nSendBudgetSkips = 0, nSlowConsumerEvictions = 0, nSendFailures = 0;
+    uint64 nBatchFrames = 0, nBatchedLines = 0, nMalformedMessages = 0, nEphemeralRelayed = 0;
+    uint64 nHistoryReplays = stats.nHistoryReplays, nHistoryLinesReplayed = stats.nHistoryLinesReplayed;
+    uint64 nFloodDrops = 0, nFloodEvictions = 0;
+    uint64 nConnectionsAdmitted = stats.nConnectionsAdmitted, nConnectionsRejected = stats.nConnectionsRejected;
+    uint64 nTranscriptLines = pTranscript ? pTranscript->GetLinesWritten() : 0;
+    uint64 nTranscriptDropped = pTranscript ? pTranscript->GetDroppedCount() : 0;
+    uint64 nTranscriptFsyncs = pTranscript ? pTranscript->GetFsyncCount() : 0;
+    const PayloadPool::Stats& serverPoolStats = pPayloadPool->GetStats();
+    uint64 nPoolHits = serverPoolStats.nHits, nPoolMisses = serverPoolStats.nMisses;
+    uint64 nPoolReleasedToHeap = serverPoolStats.nReleasedToHeap;
+    LatencyHistogram fanoutWidth, pollIncomingUsec;
+    for (auto& pShard : shards)
+    {
+        const LoopStats& shardStats = pShard->GetStats();
+        nMessagesIn += shardStats.nMessagesIn;
+        nBytesIn += shardStats.nBytesIn;
+        nMessagesOut += shardStats.nMessagesOut;
+        nBytesOut += shardStats.nBytesOut;
+        nFanouts += shardStats.nFanouts;
+        nRelayedMessages += shardStats.nRelayedMessages;
+        nRelayAllocations += shardStats.nRelayAllocations;
+        nSendBudgetHits += shardStats.nSendBudgetHits;
+        nSendBudgetSkips += shardStats.nSendBudgetSkips;
+        nSlowConsumerEvictions += shardStats.nSlowConsumerEvictions;
+        nSendFailures += shardStats.nSendFailures;
+        nBatchFrames += shardStats.nBatchFrames;
+        nBatchedLines += shardStats.nBatchedLines;
+        nMalformedMessages += shardStats.nMalformedMessages;
+        nEphemeralRelayed += shardStats.nEphemeralRelayed;
+        nHistoryReplays += shardStats.nHistoryReplays;
+        nHistoryLinesReplayed += shardStats.nHistoryLinesReplayed;
+        nFloodDrops += shardStats.nFloodDrops;
+        nFloodEvictions += shardStats.nFloodEvictions;
+        const PayloadPool::Stats& poolStats = pShard->GetPayloadPoolStats();
+        nPoolHits += poolStats.nHits;
+        nPoolMisses += poolStats.nMisses;
+        nPoolReleasedToHeap += poolStats.nReleasedToHeap;
+        fanoutWidth.Merge(shardStats.fanoutWidth);
+        pollIncomingUsec.Merge(shardStats.pollIncomingUsec);
+    }
+
+    ConnectionStatusSummary connectionStatus;
+    for (auto& [hConn, client] : directory)
+    {
+        SteamNetConnectionRealTimeStatus_t status;
+        if (pInterface->GetConnectionRealTimeStatus(hConn, &status, 0, nullptr) == k_EResultOK)
+            connectionStatus.Add(status);
+    }
+
+    auto perSec = [flWindowSec](uint64 nNow, uint64& nPrevious)
+    {
+        double flRate = (double)(nNow - nPrevious) / flWindowSec;
+        nPrevious = nNow;
+        return flRate;
+    };
+    std::string statsJson = MY_FMT(
+        R"({{"ts_ms":{},"uptime_s":{:.3f},"clients":{},"shards":{},)"
+        R"("messages_in":{},"messages_in_per_s":{:.1f},"bytes_in":{},"bytes_in_per_s":{:.1f},)"
+        R"("messages_out":{},"messages_out_per_s":{:.1f},"bytes_out":{},"bytes_out_per_s":{:.1f},)"
+        R"("fanouts":{},"relayed":{},"relay_allocations":{},"ephemeral_relayed":{},"malformed":{},"fanout_width":{},)",
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count(),
+        flUptimeSec, directory.Size(), shards.size(), nMessagesIn, perSec(nMessagesIn, window.nMessagesIn), nBytesIn,
+        perSec(nBytesIn, window.nBytesIn), nMessagesOut, perSec(nMessagesOut, window.nMessagesOut), nBytesOut,
+        perSec(nBytesOut, window.nBytesOut), nFanouts, nRelayedMessages, nRelayAllocations,
+        nEphemeralRelayed, nMalformedMessages, HistogramToJson(fanoutWidth));
+    statsJson += MY_FMT(
+        R"("send_budget":{{"hits":{},"skipped":{},"evictions":{},"send_failures":{}}},)"
+        R"("batching":{{"frames":{},"lines":{}}},"payload_pool":{{"hits":{},"misses":{},"released_to_heap":{}}},)"
+        R"("history":{{"replays":{},"lines":{}}},"transcript":{{"lines":{},"dropped":{},"fsyncs":{}}},)"
+        R"("flood":{{"dropped":{},"evictions":{}}},"admission":{{"admitted":{},"rejected":{},"waiting":{}}},)"
+        R"("sessions":{{"resumed":{},"resumable":{},"detached":{},"expired":{}}},)"
+        R"("phase_us":{{"poll_incoming":{},"callbacks":{},"admission":{},"console":{}}},"connections":{}}})",
+        nSendBudgetHits, nSendBudgetSkips, nSlowConsumerEvictions, nSendFailures, nBatchFrames, nBatchedLines,
+        nPoolHits, nPoolMisses, nPoolReleasedToHeap, nHistoryReplays, nHistoryLinesReplayed, nTranscriptLines,
+        nTranscriptDropped, nTranscriptFsyncs, nFloodDrops, nFloodEvictions, nConnectionsAdmitted,
+        nConnectionsRejected, admissionQueue.size(), stats.nSessionsResumed.load(), resumableSessions.size(),
+        stats.nSessionsDetached.load(), stats.nSessionsExpired.load(),
+        HistogramToJson(pollIncomingUsec),
+        HistogramToJson(stats.callbacksUsec), HistogramToJson(stats.admissionUsec), HistogramToJson(stats.consoleUsec),
+        ConnectionStatusToJson(connectionStatus));
+    return statsJson;
+}
+
+ChatShard& ChatServer::PickLeastLoadedShard()
+{
+    auto itLeast = std::min_element(shardLoad.begin(), shardLoad.end());
+    return *shards[itLeast - shardLoad.begin()];
+}
+
+void ChatServer::ReclaimEmptyRooms()
+{
+    // Whoever is in a room counts as its member, but those resumed into one are not yet, and sessions
+    // waiting to be resumed are not at all.  The directory knows of both.
+    heldRooms.assign(rooms.Size(), false);
+    for (auto& [hConn, client] : directory)
+        heldRooms[client.m_nRoom] = true;
+    for (auto& [sToken, session] : resumableSessions)
+        heldRooms[session.nRoom] = true;
+    rooms.ReclaimEmptyRooms(heldRooms);
 }
 
 void ChatServer::SendStringToClient(HSteamNetConnection conn, const char* str)
 {
-    pInterface->SendMessageToConnection(conn, str, (uint32)strlen(str), k_nSteamNetworkingSend_Reliable, nullptr);
+    std::string notice;
+    Wire::Append<WireType::Notice>(notice, 0, str);
+    pInterface->SendMessageToConnection(
+        conn, notice.data(), (uint32)notice.size(), k_nSteamNetworkingSend_Reliable, nullptr);
+    stats.RecordSend(1, notice.size());
+}
+
+void ChatServer::SendStringToRoom(uint32 nRoom, const char* str, HSteamNetConnection except)
+{
+    std::string notice;
+    Wire::Append<WireType::Notice>(notice, 0, str);
+    SharedPayload* pPayload = SharedPayload::Create(notice.data(), (uint32)notice.size(), pPayloadPool.get());
+    PostBroadcast(pPayload, except, nRoom, nullptr);
+    pPayload->Release();
+}
+
+void ChatServer::BuildRosterPayloads(std::vector<SharedPayload*>& payloads)
+{
+    // Keep messages well under the library's limits, even with many thousands of clients.
+    static constexpr size_t k_cbMaxMessage = 64 * 1024;
+    // A storm of newcomers should not each get a list of thousands.
+    static constexpr size_t k_nMaxRosterNames = 50;
+
+    std::string buffer;
+    auto flush = [&]()
+    {
+        if (buffer.empty())
+            return;
+        payloads.push_back(SharedPayload::Create(buffer.data(), (uint32)buffer.size(), pPayloadPool.get()));
+        buffer.clear();
+    };
+    for (auto& [hOther, client] : directory)
+    {
+        if (!client.m_bIntroduced)
+            continue;
+        Wire::Append<WireType::NickMap>(buffer, client.m_nId, client.m_nick.View());
+        if (buffer.size() >= k_cbMaxMessage)
+            flush();
+    }
+    flush();
+
+    std::string roster;
+    size_t nInLobby = 0;
+    for (auto& [hOther, client] : directory)
+    {
+        if (!client.m_bIntroduced || client.m_nRoom != RoomDirectory::k_nLobby)
+            continue;
+        if (++nInLobby <= k_nMaxRosterNames)
+            roster.append(roster.empty() ? "In the lobby: " : ", ").append(client.m_nick.View());
+    }
+    if (nInLobby > k_nMaxRosterNames)
+        roster += MY_FMT(" and {} more", nInLobby - k_nMaxRosterNames);
+    Wire::Append<WireType::Notice>(buffer, 0, roster.empty() ? "You are alone in the chat." : roster);
+    flush();
+}
+
+void ChatServer::AdoptConnection(HSteamNetConnection hConn)
+{
+    // Connections made with CreateSocketPair get no callbacks unless they ask for them.
+    void* pfnCallback = (void*)SteamNetConnectionStatusChangedCallback;
+    SteamNetworkingUtils()->SetConfigValue(
+        k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, k_ESteamNetworkingConfig_Connection, hConn,
+        k_ESteamNetworkingConfig_Ptr, &pfnCallback);
+    QueueForAdmission(hConn, true, "an adopted connection");
 }
 
-void ChatServer::SendStringToAllClients(const char* str, HSteamNetConnection except)
+void ChatServer::QueueForAdmission(HSteamNetConnection hConn, bool bConnected, const char* szDescription)
 {
-    for (auto& c : mapClients)
+    // Turn them away now rather than after they waited.  Those waiting count against the cap too.
+    size_t nWaiting = admissionQueue.size();
+    bool bFull = directory.Size() + nWaiting >= (size_t)std::max(0, options.nMaxClients);
+    if (bFull || nWaiting >= (size_t)std::max(0, options.nMaxPendingAccepts))
     {
-        if (c.first != except)
-            SendStringToClient(c.first, str);
+        pInterface->CloseConnection(
+            hConn, bFull ? k_nEndReasonServerFull : k_nEndReasonServerBusy, bFull ? "Server full" : "Server busy",
+            false);
+        AddRelaxed(stats.nConnectionsRejected, 1);
+        logSink.Write(
+            AsyncLogSink::Level::Warn,
+            bFull ? "[ChatServer] Server full, rejected " : "[ChatServer] Too many waiting, rejected ", szDescription);
+        return;
     }
+    admissionQueue.push_back(PendingAccept_t{hConn, bConnected});
 }
 
-void ChatServer::PollIncomingMessages()
+int ChatServer::AdmitPendingConnections()
 {
-    while (!quitFlag)
+    SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+    ExpireResumableSessions(usecNow);
+
+    // Those who did not say Hello in time are introduced without it.
+    while (!awaitingHello.empty() && awaitingHello.front().usecDeadline <= usecNow)
+    {
+        const ClientInfo_t* pClient = directory.Find(awaitingHello.front().hConn);
+        if (pClient && !pClient->m_bIntroduced)
+            introduceThisTick.push_back(awaitingHello.front().hConn);
+        awaitingHello.pop_front();
+    }
+
+    bool bCanAccept = !admissionQueue.empty() && acceptBucket.GetTokens(usecNow) >= 1.0;
+    if (!bCanAccept && introduceThisTick.empty())
+        return 0;
+
+    ScopedPhaseTimer phaseTimer(stats.admissionUsec);
+    int nWork = 0;
+    while (!admissionQueue.empty() && acceptBucket.TryTake(usecNow))
     {
-        ISteamNetworkingMessage* pIncomingMsg = nullptr;
-        int numMsgs = pInterface->ReceiveMessagesOnPollGroup(hPollGroup, &pIncomingMsg, 1);
-        if (numMsgs == 0)
+        PendingAccept_t pending = admissionQueue.front();
+        admissionQueue.pop_front();
+        nWork += AcceptClient(pending, usecNow) ? 1 : 0;
+    }
+    if (!introduceThisTick.empty())
+    {
+        nWork += (int)introduceThisTick.size();
+        IntroduceClients();
+    }
+    return nWork;
+}
+
+bool ChatServer::AcceptClient(const PendingAccept_t& pending, SteamNetworkingMicroseconds usecNow)
+{
+    // Try to accept the connection.
+    HSteamNetConnection hConn = pending.hConn;
+    if (!pending.bConnected && pInterface->AcceptConnection(hConn) != k_EResultOK)
+    {
+        // This could fail.  If the remote host tried to connect, but then
+        // disconnected, the connection may already be half closed.  Just
+        // destroy whatever we have on our side.
+        pInterface->CloseConnection(hConn, 0, nullptr, false);
+        logSink.Write(AsyncLogSink::Level::Warn, "[ChatServer] Failed to accept (already closed?) a connection");
+        return false;
+    }
+
+    // Typing indicators and heartbeats get a lane of their own, so they never wait behind chat.
+    // Without it they would still arrive, only on the chat lane.
+    EResult eLaneResult = pInterface->ConfigureConnectionLanes(
+        hConn, WireLane::k_nCount, options.lanePriorities.data(), options.laneWeights.data());
+    if (eLaneResult != k_EResultOK)
+        logSink.Write(AsyncLogSink::Level::Warn, "[ChatServer] Failed to configure lanes");
+
+    // Generate a random nick.  A random temporary nick
+    // is really dumb and not how you would write a real chat server.
+    // You would want them to have some sort of signon message,
+    // and you would keep their client in a state of limbo (connected,
+    // but not logged on) until them.  I'm trying to keep this example
+    // code really simple.
+    // Nicks are unique, so keep drawing until one is free.  Those who resume give theirs back.
+    uint32 nClientId = nNextClientId++;
+    char nick[64];
+    for (int nTry = 0;; ++nTry)
+    {
+        if (nTry < 8)
+            sprintf(nick, "BraveWarrior%d", 10000 + (rand() % 100000));
+        else
+            sprintf(nick, "BraveWarrior%u-%d", nClientId, nTry);
+        if (nicks.Claim(nClientId, nick) == NickRegistry::Result::Ok)
             break;
-        if (numMsgs < 0)
-            MY_LOG(error, "[ChatServer] Error checking for messages");
-        assert(numMsgs == 1 && pIncomingMsg);
-        auto itClient = mapClients.find(pIncomingMsg->m_conn);
-        assert(itClient != mapClients.end());
-
-        // '\0'-terminate it to make it easier to parse
-        std::string incommingMessage;
-        incommingMessage.assign((const char*)pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-        const char* incommingMessageCStyle = incommingMessage.c_str();
-
-        // We don't need this anymore.
-        pIncomingMsg->Release();
-
-        // Check for known commands.  None of this example code is secure or robust.
-        // Don't write a real server like this, please.
-        if (strncmp(incommingMessageCStyle, "/nick", 5) == 0)
-        {
-            const char* nick = incommingMessageCStyle + 5;
-            while (isspace(*nick))
-                ++nick;
+    }
 
-            // Let everybody else know they changed their name
-            std::string changeNickNoticeToOthers =
-                MY_FMT("{} shall henceforth be known as {}", itClient->second.m_sNick, nick);
-            SendStringToAllClients(changeNickNoticeToOthers.c_str(), itClient->first);
+    // Hand them to the least loaded shard.  The shard must know them before
+    // their messages can show up in its poll group, so post first.
+    ChatShard& shard = PickLeastLoadedShard();
+    shard.Post(ChatMail{ChatMail::Type::AddClient, hConn, nick, nullptr, RoomDirectory::k_nAllRooms, nClientId});
+    if (!pInterface->SetConnectionPollGroup(hConn, shard.GetPollGroup()))
+    {
+        shard.Post(ChatMail{ChatMail::Type::RemoveClient, hConn, {}});
+        pInterface->CloseConnection(hConn, 0, nullptr, false);
+        logSink.Write(AsyncLogSink::Level::Warn, "[ChatServer] Failed to set poll group?");
+        return false;
+    }
+    // Count them right away, so the rest of this tick's newcomers spread over the shards.
+    ++shardLoad[shard.GetIndex()];
 
-            // Respond to client itself
-            std::string changeNickNoticeToItself = MY_FMT("Thou shalt henceforth be known as {}", nick);
-            SendStringToClient(itClient->first, changeNickNoticeToItself.c_str());
+    // Add them to the client list.  Nobody hears of them until they are introduced, which waits for their
+    // Hello in case it resumes an earlier session.
+    ClientInfo_t& client = directory.Insert(hConn);
+    client.m_nick.Assign(nick);
+    client.m_nId = nClientId;
+    client.m_nShard = shard.GetIndex();
+    client.m_token = ServerSnapshot::NewToken();
+    SteamNetworkingMicroseconds usecHelloWait = (SteamNetworkingMicroseconds)options.nHelloWaitMs * 1000;
+    if (usecHelloWait > 0)
+        awaitingHello.push_back(AwaitingHello_t{hConn, usecNow + usecHelloWait});
+    else
+        introduceThisTick.push_back(hConn);
+    AddRelaxed(stats.nConnectionsAdmitted, 1);
+    return true;
+}
 
-            // Actually change their name
-            SetClientNick(itClient->first, nick);
+void ChatServer::IntroduceClients()
+{
+    // A Hello and the deadline may both have queued the same client, and some have left or resumed since.
+    std::sort(introduceThisTick.begin(), introduceThisTick.end());
+    introduceThisTick.erase(std::unique(introduceThisTick.begin(), introduceThisTick.end()), introduceThisTick.end());
+    std::vector<ClientInfo_t*> newcomers;
+    std::vector<HSteamNetConnection> newcomerConns;
+    std::string nickMaps;
+    for (HSteamNetConnection hConn : introduceThisTick)
+    {
+        ClientInfo_t* pClient = directory.Find(hConn);
+        if (!pClient || pClient->m_bIntroduced)
             continue;
+        newcomers.push_back(pClient);
+        newcomerConns.push_back(hConn);
+        Wire::Append<WireType::NickMap>(nickMaps, pClient->m_nId, pClient->m_nick.View());
+    }
+    introduceThisTick.clear();
+    if (newcomers.empty())
+        return;
+
+    // Everybody learns the newcomers' ids before they can say anything, in one broadcast for all of them.
+    SharedPayload* pNickMaps = SharedPayload::Create(nickMaps.data(), (uint32)nickMaps.size(), pPayloadPool.get());
+    PostBroadcast(pNickMaps, k_HSteamNetConnection_Invalid, RoomDirectory::k_nAllRooms, nullptr);
+    pNickMaps->Release();
+    if (!resumableSessions.empty())
+        nickMapLog += nickMaps;
+
+    // They need everybody's nick to show their lines, a list of who is already in the lobby, and what was
+    // said there before they came.  That is the same for all of them, so it is encoded once and only
+    // referenced per newcomer.  The roster is built before they count as introduced, so it leaves them out.
+    std::vector<SharedPayload*> rosterPayloads;
+    BuildRosterPayloads(rosterPayloads);
+    std::string history;
+    size_t nHistoryLines = rooms.Get(RoomDirectory::k_nLobby).m_history.CopyTo(history);
+    if (nHistoryLines > 0)
+    {
+        rosterPayloads.push_back(SharedPayload::Create(history.data(), (uint32)history.size(), pPayloadPool.get()));
+        AddRelaxed(stats.nHistoryReplays, newcomers.size());
+        AddRelaxed(stats.nHistoryLinesReplayed, nHistoryLines * newcomers.size());
+    }
+
+    for (size_t i = 0; i < newcomers.size(); ++i)
+    {
+        ClientInfo_t& client = *newcomers[i];
+        HSteamNetConnection hConn = newcomerConns[i];
+
+        // Send them a welcome message
+        std::string welcomeMsg = MY_FMT(
+            "Welcome, stranger. Thou art known to us for now as '{}'; upon thine command '/nick' we shall know thee otherwise. Wander the halls with '/join ROOM', '/leave' and '/rooms'.",
+            client.m_nick.View());
+        SendStringToClient(hConn, welcomeMsg.c_str());
+
+        // And what to come back with, should they lose us.
+        size_t cbSession = Wire::EncodedSize(client.m_token.size());
+        SteamNetworkingMessage_t* pSession = SteamNetworkingUtils()->AllocateMessage((int)cbSession);
+        Wire::Encode<WireType::Session>(
+            (char*)pSession->m_pData, client.m_nId, std::string_view(client.m_token.data(), client.m_token.size()));
+        pSession->m_conn = hConn;
+        pSession->m_nFlags = k_nSteamNetworkingSend_Reliable;
+        outgoingMessages.push_back(pSession);
+        stats.RecordSend(1, cbSession);
+
+        for (SharedPayload* pPayload : rosterPayloads)
+        {
+            SteamNetworkingMessage_t* pMsg = SteamNetworkingUtils()->AllocateMessage(0);
+            pPayload->AttachTo(pMsg);
+            pMsg->m_conn = hConn;
+            pMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+            outgoingMessages.push_back(pMsg);
+            stats.RecordSend(1, pPayload->Size());
+        }
+        client.m_bIntroduced = true;
+        introducedByToken.emplace(std::string(client.m_token.data(), client.m_token.size()), hConn);
+    }
+    if (!outgoingMessages.empty())
+        pInterface->SendMessages((int)outgoingMessages.size(), outgoingMessages.data(), nullptr);
+    outgoingMessages.clear();
+    for (SharedPayload* pPayload : rosterPayloads)
+        pPayload->Release();
+
+    // Only now may they hear the lobby and speak in it, after all of the above and the NickMap broadcast.
+    for (size_t i = 0; i < newcomers.size(); ++i)
+        shards[newcomers[i]->m_nShard]->Post(ChatMail{ChatMail::Type::IntroduceClient, newcomerConns[i], {}});
+
+    // Let everybody else in the lobby know who they are for now.  However many came this tick, that is
+    // one notice.
+    if (newcomers.size() == 1)
+    {
+        std::string greetingFromClient = MY_FMT(
+            "Hark! A stranger hath joined this merry host. For now we shall call them '{}'",
+            newcomers[0]->m_nick.View());
+        SendStringToRoom(RoomDirectory::k_nLobby, greetingFromClient.c_str(), newcomerConns[0]);
+    }
+    else
+    {
+        static constexpr size_t k_nMaxGreetedNames = 20;
+        std::string greeting = MY_FMT("Hark! {} strangers have joined this merry host: ", newcomers.size());
+        for (size_t i = 0; i < std::min(newcomers.size(), k_nMaxGreetedNames); ++i)
+            greeting.append(i == 0 ? "" : ", ").append(newcomers[i]->m_nick.View());
+        if (newcomers.size() > k_nMaxGreetedNames)
+            greeting += MY_FMT(" and {} more", newcomers.size() - k_nMaxGreetedNames);
+        SendStringToRoom(RoomDirectory::k_nLobby, greeting.c_str());
+    }
+}
+
+bool ChatServer::ResumeSession(HSteamNetConnection hConn, ClientInfo_t& client, std::string_view sToken)
+{
+    auto itSession = resumableSessions.find(std::string(sToken));
+    if (itSession == resumableSessions.end())
+        return false;
+    Resumable_t session = itSession->second;
+    resumableSessions.erase(itSession);
+
+    // Their nick waited for them under their old id, so the one they were given is free again.
+    nicks.Release(client.m_nId, client.m_nick.View());
+    ChatMail resume{
+        ChatMail::Type::ResumeClient, hConn, std::string(session.nick.View()), nullptr, session.nRoom,
+        session.nClientId};
+    resume.nHistoryLine = session.nHistoryLine;
+    shards[client.m_nShard]->Post(std::move(resume));
+    client.m_nick = session.nick;
+    client.m_nId = session.nClientId;
+    client.m_nRoom = session.nRoom;
+    sToken.copy(client.m_token.data(), client.m_token.size());
+    client.m_bIntroduced = true;
+    introducedByToken.emplace(std::string(sToken), hConn);
+
+    // They know everybody they knew before, only not who came or changed their nick since.
+    SendMissedNickMaps(hConn, session.cbNickMapsHeard);
+    TrimNickMapLog();
+
+    AddRelaxed(stats.nSessionsResumed, 1);
+    logSink.Write(AsyncLogSink::Level::Info, "[ChatServer] Session resumed by ", client.m_nick.View());
+    return true;
+}
+
+void ChatServer::HoldSession(const std::string& sToken, Resumable_t session, SteamNetworkingMicroseconds usecNow)
+{
+    session.usecDeadline = usecNow + (SteamNetworkingMicroseconds)options.nResumeWindowSec * 1000000;
+    resumeDeadlines.push_back(ResumeDeadline_t{session.usecDeadline, sToken});
+    resumableSessions.insert_or_assign(sToken, session);
+}
+
+void ChatServer::TrimNickMapLog()
+{
+    // The deadlines of sessions resumed since, or held again with a later one, would be skipped anyway.
+    auto itOldest = resumableSessions.end();
+    while (!resumeDeadlines.empty() && itOldest == resumableSessions.end())
+    {
+        const ResumeDeadline_t& deadline = resumeDeadlines.front();
+        itOldest = resumableSessions.find(deadline.sToken);
+        if (itOldest != resumableSessions.end() && itOldest->second.usecDeadline != deadline.usecDeadline)
+            itOldest = resumableSessions.end();
+        if (itOldest == resumableSessions.end())
+            resumeDeadlines.pop_front();
+    }
+    if (itOldest == resumableSessions.end())
+    {
+        std::string().swap(nickMapLog);
+        cbNickMapLogTrimmed = 0;
+        return;
+    }
+
+    // Only once it is half the log, so a mass resume does not move the rest over and over.
+    size_t cbHeardByAll = itOldest->second.cbNickMapsHeard - cbNickMapLogTrimmed;
+    if (cbHeardByAll < nickMapLog.size() / 2)
+        return;
+    nickMapLog.erase(0, cbHeardByAll);
+    cbNickMapLogTrimmed += cbHeardByAll;
+}
+
+void ChatServer::SendMissedNickMaps(HSteamNetConnection hConn, size_t cbFrom)
+{
+    // Keep messages well under the library's limits, like the roster.
+    static constexpr size_t k_cbMaxMessage = 64 * 1024;
+
+    std::string_view sMissed = std::string_view(nickMapLog).substr(cbFrom - cbNickMapLogTrimmed);
+    while (!sMissed.empty())
+    {
+        // NickMaps are small, so whole ones fill a message almost to the limit.
+        size_t cbChunk = 0;
+        while (cbChunk < sMissed.size())
+        {
+            WireMessage msg;
+            size_t cbMsg = Wire::Decode(sMissed.data() + cbChunk, sMissed.size() - cbChunk, msg);
+            if (cbMsg == 0 || cbChunk + cbMsg > k_cbMaxMessage)
+                break;
+            cbChunk += cbMsg;
+        }
+        if (cbChunk == 0)
+            break;
+        EResult eResult = pInterface->SendMessageToConnection(
+            hConn, sMissed.data(), (uint32)cbChunk, k_nSteamNetworkingSend_Reliable, nullptr);
+        if (eResult != k_EResultOK)
+        {
+            MY_LOG_FMT(warn, "[ChatServer] Failed to send a resumed session the nicks it missed: {}", (int)eResult);
+            return;
+        }
+        stats.RecordSend(1, cbChunk);
+        sMissed.remove_prefix(cbChunk);
+    }
+}
+
+void ChatServer::ExpireResumableSessions(SteamNetworkingMicroseconds usecNow)
+{
+    std::vector<std::pair<uint32, CompactNick>> expired; // Their room and nick.
+    while (!resumeDeadlines.empty() && resumeDeadlines.front().usecDeadline <= usecNow)
+    {
+        // Resumed since, perhaps lost again with a later deadline.
+        const ResumeDeadline_t& deadline = resumeDeadlines.front();
+        auto itSession = resumableSessions.find(deadline.sToken);
+        if (itSession != resumableSessions.end() && itSession->second.usecDeadline == deadline.usecDeadline)
+        {
+            const Resumable_t& session = itSession->second;
+            nicks.Release(session.nClientId, session.nick.View());
+            expired.emplace_back(session.nRoom, session.nick);
+            resumableSessions.erase(itSession);
+        }
+        resumeDeadlines.pop_front();
+    }
+    if (expired.empty())
+        return;
+    TrimNickMapLog();
+    AddRelaxed(stats.nSessionsExpired, expired.size());
+    MY_LOG_FMT(info, "[ChatServer] {} session(s) were not resumed in time, their nicks are free again", expired.size());
+
+    // Only now do their rooms hear they are gone, in one notice per room however many they are.
+    static constexpr size_t k_nMaxGoneNames = 20;
+    std::stable_sort(
+        expired.begin(), expired.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t nFirst = 0, nEnd = 0; nFirst < expired.size(); nFirst = nEnd)
+    {
+        uint32 nRoom = expired[nFirst].first;
+        while (nEnd < expired.size() && expired[nEnd].first == nRoom)
+            ++nEnd;
+        size_t nGone = nEnd - nFirst;
+        std::string notice;
+        if (nGone == 1)
+            notice = MY_FMT("{} hath not returned.", expired[nFirst].second.View());
+        else
+        {
+            notice = MY_FMT("{} souls have not returned: ", nGone);
+            for (size_t i = 0; i < std::min(nGone, k_nMaxGoneNames); ++i)
+                notice.append(i == 0 ? "" : ", ").append(expired[nFirst + i].second.View());
+            if (nGone > k_nMaxGoneNames)
+                notice += MY_FMT(" and {} more", nGone - k_nMaxGoneNames);
         }
+        SendStringToRoom(nRoom, notice.c_str());
+    }
+}
 
-        // Assume it's just a ordinary chat message, dispatch to everybody else
-        std::string ordinaryChatMessage = MY_FMT("{}: {}", itClient->second.m_sNick, incommingMessage);
-        SendStringToAllClients(ordinaryChatMessage.c_str(), itClient->first);
+void ChatServer::LoadSnapshot()
+{
+    ServerSnapshot snapshot;
+    if (!snapshot.Load(options.sSnapshotFile))
+        return;
+    // It is for this process only.  A later start without a handoff must not bring these sessions back.
+    std::error_code ec;
+    std::filesystem::remove(options.sSnapshotFile, ec);
+
+    // With a transcript the history is back already, and more of it.
+    for (const ServerSnapshot::Room_t& snapshotRoom : snapshot.rooms)
+    {
+        RoomDirectory::Room_t* pRoom = rooms.FindOrCreate(snapshotRoom.sName);
+        if (!pRoom || pTranscript)
+            continue;
+        Wire::ForEachMessage(
+            snapshotRoom.history.data(), snapshotRoom.history.size(),
+            [&](const WireMessage& msg)
+            {
+                const char* pEnvelope = msg.sBody.data() - Wire::k_cbHeader;
+                pRoom->m_history.Append(pEnvelope, (uint32)Wire::EncodedSize(msg.sBody.size()));
+            });
+    }
+
+    // Ids are never reused, not even across a restart.
+    nNextClientId = std::max(nNextClientId, snapshot.nNextClientId);
+    // Where they were in their room's history is lost with the old process, they get all of it.
+    SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+    for (const ServerSnapshot::Session_t& session : snapshot.sessions)
+    {
+        if (nicks.Claim(session.nClientId, session.nick.View()) != NickRegistry::Result::Ok)
+            continue;
+        RoomDirectory::Room_t* pRoom = rooms.FindOrCreate(session.sRoom);
+        uint32 nRoom = pRoom ? pRoom->m_nId : RoomDirectory::k_nLobby;
+        HoldSession(
+            std::string(session.token.data(), session.token.size()),
+            Resumable_t{session.nClientId, session.nick, nRoom, 0, 0, 0}, usecNow);
     }
 }
 
-void ChatServer::PollLocalUserInput()
+void ChatServer::SaveSnapshot()
 {
-    std::string cmd;
-    while (!quitFlag && nonBlockingConsoleUserInput.GetNext(cmd))
+    ServerSnapshot snapshot;
+    snapshot.nNextClientId = nNextClientId;
+    for (uint32 nRoom = 0; nRoom < rooms.Size(); ++nRoom)
     {
+        RoomDirectory::Room_t& room = rooms.Get(nRoom);
+        if (room.m_sName.empty())
+            continue;
+        snapshot.rooms.push_back(ServerSnapshot::Room_t{room.m_sName, {}});
+        room.m_history.CopyTo(snapshot.rooms.back().history);
+    }
+    for (auto& [hConn, client] : directory)
+    {
+        if (!client.m_bIntroduced)
+            continue;
+        snapshot.sessions.push_back(
+            ServerSnapshot::Session_t{client.m_token, client.m_nId, client.m_nick, rooms.Get(client.m_nRoom).m_sName});
+    }
+    // Those who had not come back yet get another chance with the next process.
+    for (auto& [sToken, session] : resumableSessions)
+    {
+        ServerSnapshot::Session_t& saved = snapshot.sessions.emplace_back();
+        sToken.copy(saved.token.data(), saved.token.size());
+        saved.nClientId = session.nClientId;
+        saved.nick = session.nick;
+        saved.sRoom = rooms.Get(session.nRoom).m_sName;
+    }
+    snapshot.Save(options.sSnapshotFile);
+}
+
+int ChatServer::PollLocalUserInput()
+{
+    ScopedPhaseTimer phaseTimer(stats.consoleUsec);
+    int nCommands = 0;
+    std::string cmd; // Keeps its capacity, so reading a command does not allocate.
+    uint32 nSource = NonBlockingConsoleUserInput::k_nConsole;
+    while (!quitFlag && nonBlockingConsoleUserInput.GetNext(cmd, &nSource))
+    {
+        ++nCommands;
         if (strcmp(cmd.c_str(), "/quit") == 0)
         {
             quitFlag = true;
-            MY_LOG(info, "[ChatServer] Shutting down server");
+            ReplyToCommand(nSource, "Shutting down server");
             break;
         }
 
-        // That's the only command we support
-        MY_LOG_FMT(info, "[ChatServer] Unknown command: `{}`. The server only knows one command: '/quit'.", cmd);
+        if (strcmp(cmd.c_str(), "/stats") == 0)
+        {
+            std::string statsJson = BuildStatsJson();
+            if (nSource == NonBlockingConsoleUserInput::k_nConsole)
+            {
+                printf("%s\n", statsJson.c_str());
+                fflush(stdout);
+            }
+            ReplyToCommand(nSource, statsJson);
+            continue;
+        }
+
+        if (strncmp(cmd.c_str(), "/loglevel ", 10) == 0)
+        {
+            ESteamNetworkingSocketsDebugOutputType debugSeverity;
+            if (SteamNetworkingInitRAII::ParseDebugSeverity(cmd.c_str() + 10, debugSeverity))
+            {
+                SteamNetworkingInitRAII::SetDebugSeverity(debugSeverity);
+                ReplyToCommand(nSource, MY_FMT("Networking debug severity is now {}", cmd.c_str() + 10));
+            }
+            else
+                ReplyToCommand(nSource, MY_FMT("Unknown debug severity `{}`", cmd.c_str() + 10));
+            continue;
+        }
+
+        if (strncmp(cmd.c_str(), "/kick ", 6) == 0)
+        {
+            KickClient(nSource, std::string_view(cmd).substr(6));
+            continue;
+        }
+
+        if (strncmp(cmd.c_str(), "/broadcast ", 11) == 0)
+        {
+            SendStringToRoom(RoomDirectory::k_nAllRooms, MY_FMT("[Server] {}", cmd.c_str() + 11).c_str());
+            ReplyToCommand(nSource, "Broadcast sent");
+            continue;
+        }
+
+        ReplyToCommand(
+            nSource, MY_FMT(
+                         "Unknown command: `{}`. The server knows '/quit', '/stats', '/loglevel LEVEL', '/kick NICK' "
+                         "and '/broadcast TEXT'.",
+                         cmd));
     }
+    return nCommands;
+}
+
+void ChatServer::ReplyToCommand(uint32 nSource, const std::string& sText)
+{
+    if (nSource == NonBlockingConsoleUserInput::k_nConsole)
+        MY_LOG_FMT(info, "[ChatServer] {}", sText);
+    else
+        MY_LOG_FMT(info, "[ChatServer] To admin connection {}: {}", nSource, sText);
+    nonBlockingConsoleUserInput.Reply(nSource, sText);
 }
 
-void ChatServer::SetClientNick(HSteamNetConnection hConn, const char* nick)
+void ChatServer::KickClient(uint32 nSource, std::string_view sNick)
 {
-    // Remember their nick
-    mapClients[hConn].m_sNick = nick;
+    auto itClient = std::find_if(
+        directory.begin(), directory.end(), [&](const auto& entry) { return entry.value.m_nick.View() == sNick; });
+    if (itClient == directory.end())
+    {
+        ReplyToCommand(nSource, MY_FMT("No client is called `{}`", sNick));
+        return;
+    }
 
-    // Set the connection name, too, which is useful for debugging
-    pInterface->SetConnectionName(hConn, nick);
+    HSteamNetConnection hConn = itClient->hConn;
+    std::string whatHappened = MY_FMT("[ChatServer] Client {}: Kicked by the server.", sNick);
+    SendStringToClient(hConn, "Thou hast been cast out of this hall.");
+    RemoveClient(hConn, whatHappened);
+    // Linger, so the notice above gets there.
+    pInterface->CloseConnection(hConn, k_nEndReasonKicked, "Kicked", true);
+    ReplyToCommand(nSource, MY_FMT("Kicked `{}`", sNick));
 }
 
 void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo)
@@ -183,8 +1136,8 @@ void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
                 // Locate the client.  Note that it should have been found, because this
                 // is the only codepath where we remove clients (except on shutdown),
                 // and connection change callbacks are dispatched in queue order.
-                auto itClient = mapClients.find(pInfo->m_hConn);
-                assert(itClient != mapClients.end());
+                ClientInfo_t* pClient = directory.Find(pInfo->m_hConn);
+                assert(pClient);
 
                 // Select appropriate log messages
                 std::string whatHappened;
@@ -192,7 +1145,7 @@ void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
                 {
                     whatHappened = MY_FMT(
                         "[ChatServer] Client {}: Problem detected locally. Desc={}. EndReason={}. EndDebug={}",
-                        itClient->second.m_sNick, pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason,
+                        pClient->m_nick.View(), pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason,
                         pInfo->m_info.m_szEndDebug);
                 }
                 else
@@ -201,18 +1154,38 @@ void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
                     // it was a "usual" connection or an "unusual" one.
                     whatHappened = MY_FMT(
                         "[ChatServer] Client {}: Closed by peer. Desc={}. EndReason={}. EndDebug={}",
-                        itClient->second.m_sNick, pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason,
+                        pClient->m_nick.View(), pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason,
                         pInfo->m_info.m_szEndDebug);
                 }
 
-                mapClients.erase(itClient);
-
-                // Send a message so everybody else knows what happened
-                SendStringToAllClients(whatHappened.c_str());
+                // Unless they closed it themselves, they may well be back, see Options::nResumeWindowSec.
+                int nEndReason = pInfo->m_info.m_eEndReason;
+                bool bTimedOut = pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally;
+                bool bLeft = !bTimedOut && nEndReason >= k_ESteamNetConnectionEnd_App_Min &&
+                             nEndReason <= k_ESteamNetConnectionEnd_App_Max;
+                if (pClient->m_bIntroduced && !bLeft && options.nResumeWindowSec > 0)
+                    DetachClient(pInfo->m_hConn, whatHappened, bTimedOut);
+                else
+                    RemoveClient(pInfo->m_hConn, whatHappened);
             }
             else
             {
                 assert(pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting);
+                if (directory.Contains(pInfo->m_hConn))
+                {
+                    // Admitted, but gone before the Connected callback.
+                    std::string_view sNick = directory.Find(pInfo->m_hConn)->m_nick.View();
+                    RemoveClient(pInfo->m_hConn, MY_FMT("[ChatServer] Client {} left while connecting", sNick));
+                }
+                else
+                {
+                    // Still waiting for admission.
+                    auto itWaiting = std::find_if(
+                        admissionQueue.begin(), admissionQueue.end(),
+                        [&](const PendingAccept_t& pending) { return pending.hConn == pInfo->m_hConn; });
+                    if (itWaiting != admissionQueue.end())
+                        admissionQueue.erase(itWaiting);
+                }
             }
 
             // Clean up the connection.  This is important!
@@ -228,66 +1201,15 @@ void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
     case k_ESteamNetworkingConnectionState_Connecting:
         {
             // This must be a new connection
-            assert(mapClients.find(pInfo->m_hConn) == mapClients.end());
-
-            MY_LOG_FMT(info, "[ChatServer] Connection request from {}", pInfo->m_info.m_szConnectionDescription);
-
-            // A client is attempting to connect
-            // Try to accept the connection.
-            if (pInterface->AcceptConnection(pInfo->m_hConn) != k_EResultOK)
-            {
-                // This could fail.  If the remote host tried to connect, but then
-                // disconnected, the connection may already be half closed.  Just
-                // destroy whatever we have on our side.
-                pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
-                MY_LOG_FMT(
-                    warn, "[ChatServer] Failed to accept connection from {}. (It was already closed?)",
-                    pInfo->m_info.m_szConnectionDescription);
-                break;
-            }
-
-            // Assign the poll group
-            if (!pInterface->SetConnectionPollGroup(pInfo->m_hConn, hPollGroup))
-            {
-                pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
-                MY_LOG_FMT(warn, "[ChatServer] Failed to set poll group?");
-                break;
-            }
-
-            // Generate a random nick.  A random temporary nick
-            // is really dumb and not how you would write a real chat server.
-            // You would want them to have some sort of signon message,
-            // and you would keep their client in a state of limbo (connected,
-            // but not logged on) until them.  I'm trying to keep this example
-            // code really simple.
-            char nick[64];
-            sprintf(nick, "BraveWarrior%d", 10000 + (rand() % 100000));
-
-            // Send them a welcome message
-            std::string welcomeMsg = MY_FMT(
-                "Welcome, stranger. Thou art known to us for now as '{}'; upon thine command '/nick' we shall know thee otherwise.",
-                nick);
-            SendStringToClient(pInfo->m_hConn, welcomeMsg.c_str());
-
-            // Also send them a list of everybody who is already connected
-            if (mapClients.empty())
-            {
-                SendStringToClient(pInfo->m_hConn, "You are alone in the chat.");
-            }
-            else
-            {
-                for (auto& c : mapClients)
-                    SendStringToClient(pInfo->m_hConn, c.second.m_sNick.c_str());
-            }
+            assert(!directory.Contains(pInfo->m_hConn));
 
-            // Let everybody else know who they are for now
-            std::string greetingFromClient =
-                MY_FMT("Hark! A stranger hath joined this merry host. For now we shall call them '{}'", nick);
-            SendStringToAllClients(greetingFromClient.c_str(), pInfo->m_hConn);
+            logSink.Write(
+                AsyncLogSink::Level::Info, "[ChatServer] Connection request from ",
+                pInfo->m_info.m_szConnectionDescription);
 
-            // Add them to the client list, using std::map wacky syntax
-            mapClients[pInfo->m_hConn];
-            SetClientNick(pInfo->m_hConn, nick);
+            // A client is attempting to connect.  They are accepted once the accept rate allows,
+            // see AdmitPendingConnections.
+            QueueForAdmission(pInfo->m_hConn, false, pInfo->m_info.m_szConnectionDescription);
             break;
         }
 
@@ -304,11 +1226,15 @@ void ChatServer::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChang
 
 void ChatServer::SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo)
 {
+    ++s_pCallbackInstance->nCallbacksThisTick;
     s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
 }
 
-void ChatServer::PollConnectionStateChanges()
+int ChatServer::PollConnectionStateChanges()
 {
+    ScopedPhaseTimer phaseTimer(stats.callbacksUsec);
     s_pCallbackInstance = this;
+    nCallbacksThisTick = 0;
     pInterface->RunCallbacks();
+    return nCallbacksThisTick;
 }
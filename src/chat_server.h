@@ -1,33 +1,258 @@
 #pragma once
-#include <map>
+#include <array>
+#include <async_log_sink.h>
+#include <chat_mail.h>
+#include <chat_shard.h>
+#include <connection_table.h>
+#include <deque>
+#include <loop_waiter.h>
+#include <memory>
+#include <mutex>
+#include <nick_registry.h>
 #include <non_blocking_console_user_input.h>
+#include <payload_pool.h>
+#include <room_directory.h>
+#include <room_history.h>
+#include <server_snapshot.h>
+#include <server_stats.h>
+#include <stdio.h>
+#include <string>
 #include <steam/isteamnetworkingsockets.h>
 #include <steam/steamnetworkingtypes.h>
+#include <thread>
+#include <token_bucket.h>
+#include <transcript_log.h>
+#include <unordered_map>
+#include <vector>
+#include <wire_protocol.h>
 
+// Accepts connections, runs the connection-status callbacks and the console on
+// the calling thread, and spreads the clients over one or more ChatShards.
+// With a single worker the shard is ticked inline on the same thread.
 class ChatServer
 {
+public:
+    struct Options
+    {
+        int nWorkers = 1; // Number of shards, each with its own poll group and thread.
+        int nStatsIntervalSec = 0; // Append a JSON stats line to `sStatsFile` this often.  0 disables it.
+        std::string sStatsFile = "chat_server_stats.jsonl";
+        ChatShard::Options shardOptions; // Per-client send budgets.
+        RoomDirectory::Options roomOptions; // How many rooms there may be, and when empty ones go.
+        RoomHistory::Options historyOptions; // Lines kept per room for those who join later.
+        TranscriptLog::Options transcriptOptions; // Durable log of every line, off unless given a directory.
+        // Lane setup of every connection, indexed by WireLane.
+        std::array<int, WireLane::k_nCount> lanePriorities = WireLane::k_defaultPriorities;
+        std::array<uint16, WireLane::k_nCount> laneWeights = WireLane::k_defaultWeights;
+        // Admission control.  New connections wait, not yet accepted, and are let in at `flAcceptsPerSec`
+        // in bursts of up to `nAcceptBurst`.  Those admitted in the same tick share one NickMap broadcast,
+        // one roster and one greeting.  Anybody beyond `nMaxClients`, or `nMaxPendingAccepts` waiting, is
+        // turned away.  Keep the queue short enough to drain before the clients' connect timeout.
+        int nMaxClients = 10000;
+        double flAcceptsPerSec = 500;
+        int nAcceptBurst = 200;
+        int nMaxPendingAccepts = 5000;
+        // How long shutdown waits for the goodbye, and everything queued before it, to be acknowledged.
+        int nShutdownTimeoutMs = 2000;
+        // Handoff between the process being replaced and the new one: the old one writes its rooms and every
+        // client's session here on shutdown, the new one reads it back on startup.  Empty turns it off.
+        std::string sSnapshotFile;
+        // How long a session waits to be resumed, its nick reserved and nobody told it left: those from the
+        // snapshot, and those of clients whose connection dropped rather than closed.  0 turns the latter off.
+        int nResumeWindowSec = 60;
+        // How long a newcomer's introduction waits for their Hello, which may resume an earlier session.
+        // Clients that never say Hello are introduced after this.  0 introduces everybody right away.
+        int nHelloWaitMs = 250;
+    };
+    static constexpr int k_nEndReasonServerFull = k_ESteamNetConnectionEnd_App_Min + 2;
+    static constexpr int k_nEndReasonServerBusy = k_ESteamNetConnectionEnd_App_Min + 3;
+    static constexpr int k_nEndReasonKicked = k_ESteamNetConnectionEnd_App_Min + 5;
+private:
     NonBlockingConsoleUserInput& nonBlockingConsoleUserInput;
     std::atomic<bool>& quitFlag;
-    HSteamListenSocket hListenSock;
-    HSteamNetPollGroup hPollGroup;
+    LoopWaiter& loopWaiter;
+    AsyncLogSink& logSink; // For everything logged from the callbacks.
+    Options options;
+    HSteamListenSocket hListenSock = k_HSteamListenSocket_Invalid; // None when started without a port.
     ISteamNetworkingSockets* pInterface;
-    struct Client_t
+    // Everything the server thread needs to know about a client, owned by the server thread.
+    struct ClientInfo_t
+    {
+        CompactNick m_nick; // Follows the shard's, which has the final word.
+        uint32 m_nId = 0;   // Sender id on the wire.  Never reused.
+        int m_nShard = 0;
+        uint32 m_nRoom = RoomDirectory::k_nLobby;
+        SessionToken m_token = {}; // What they resume with, see WireType::Session.
+        bool m_bIntroduced = false; // Welcomed, and everybody else has their nick.
+    };
+    ConnectionTable<ClientInfo_t> directory;
+    std::unordered_map<std::string, HSteamNetConnection> introducedByToken; // The introduced in `directory`.
+    uint32 nNextClientId = 1; // 0 is the server.
+    // Connections waiting to be accepted, oldest first.
+    struct PendingAccept_t
+    {
+        HSteamNetConnection hConn;
+        bool bConnected; // Adopted, there is nothing to accept.
+    };
+    std::deque<PendingAccept_t> admissionQueue;
+    TokenBucket acceptBucket;
+    // Accepted, with a shard, and waiting for their Hello until `usecDeadline` before being introduced.
+    struct AwaitingHello_t
+    {
+        HSteamNetConnection hConn;
+        SteamNetworkingMicroseconds usecDeadline;
+    };
+    std::deque<AwaitingHello_t> awaitingHello;
+    std::vector<HSteamNetConnection> introduceThisTick; // See IntroduceClients.
+    // Sessions nobody has resumed yet, by token, from the snapshot or detached from a lost connection.
+    // Their nicks stay reserved under their old ids until `usecDeadline`.
+    struct Resumable_t
+    {
+        uint32 nClientId;
+        CompactNick nick;
+        uint32 nRoom;
+        uint64 nHistoryLine;    // First line of their room's history they did not get.
+        size_t cbNickMapsHeard; // How much of nickMapLog they had heard, counting what was trimmed off since.
+        SteamNetworkingMicroseconds usecDeadline;
+    };
+    std::unordered_map<std::string, Resumable_t> resumableSessions;
+    // Every session's deadline, in the order they were made, which is the order they expire in.  Those
+    // resumed since are skipped when they come up.
+    struct ResumeDeadline_t
+    {
+        SteamNetworkingMicroseconds usecDeadline;
+        std::string sToken;
+    };
+    std::deque<ResumeDeadline_t> resumeDeadlines;
+    // The NickMaps of everybody introduced or renamed while there were sessions to resume, which is all
+    // those who resume may have missed.  What every session has heard is trimmed off the front, and
+    // counted in `cbNickMapLogTrimmed`.
+    std::string nickMapLog;
+    size_t cbNickMapLogTrimmed = 0;
+    std::vector<SteamNetworkingMessage_t*> outgoingMessages; // Reused for the batched SendMessages calls.
+    RoomDirectory rooms;
+    std::vector<bool> heldRooms; // Reused by ReclaimEmptyRooms.
+    NickRegistry nicks;
+    std::unique_ptr<TranscriptLog> pTranscript; // Outlives the shards, which write to it.
+    std::vector<std::unique_ptr<ChatShard>> shards;
+    std::vector<std::unique_ptr<LoopWaiter>> workerWaiters;
+    std::vector<std::thread> workerThreads;
+    std::vector<int> shardLoad; // Clients per shard, as assigned by the server thread.
+    static constexpr size_t k_nMailboxCapacity = 1 << 12;
+    ChatMailbox mailbox{k_nMailboxCapacity};
+    // Mail that did not fit in the mailbox.  While there is any, all mail goes here, so each shard's mail
+    // stays in order.  `overflowBatch` is what the server thread took out of it and has not handled yet.
+    std::mutex mutexOverflow;
+    std::deque<ChatMail> overflowMail;
+    std::atomic<bool> bOverflow = false;
+    std::deque<ChatMail> overflowBatch;
+    LoopStats stats; // The server thread's own phases and sends.
+    PayloadPool::Ptr pPayloadPool; // For the notices the server thread broadcasts.
+    // Totals at the last report, for the per-second rates.
+    struct RateWindow_t
+    {
+        std::chrono::steady_clock::time_point lastReportTime;
+        uint64 nMessagesIn = 0;
+        uint64 nBytesIn = 0;
+        uint64 nMessagesOut = 0;
+        uint64 nBytesOut = 0;
+    };
+    struct StatsReportState
     {
-        std::string m_sNick;
+        std::chrono::steady_clock::time_point startTime;
+        std::chrono::steady_clock::time_point nextDumpTime;
+        RateWindow_t dumpWindow;    // The periodic dump's, one interval each.
+        RateWindow_t commandWindow; // /stats's, since the last one, so asking does not skew the dump.
+        FILE* pFile = nullptr;
     };
-    std::map<HSteamNetConnection, Client_t> mapClients;
+    StatsReportState statsReport;
 public:
-    ChatServer(NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag);
+    ChatServer(
+        NonBlockingConsoleUserInput& nonBlockingConsoleUserInput, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter,
+        AsyncLogSink& logSink, const Options& options);
+    // Start(), Tick() until the quit flag is set, Stop().
     void Run(uint16 nPort);
+    // For driving the server from somewhere else, e.g. a benchmark.  With `nPort` 0 there is no listen
+    // socket, and the only clients are adopted ones.  Stop() expects the quit flag to be set.
+    void Start(uint16 nPort);
+    // One iteration of the loop.  Returns the amount of work done.
+    int Tick();
+    void Stop();
+    // Serve a connection that is connected already, e.g. one end of CreateSocketPair.  It goes through
+    // admission like any other.
+    void AdoptConnection(HSteamNetConnection hConn);
+    // Counters, phase timings and connection status as one JSON object.  Rates are since the last call, the
+    // periodic dump keeps its own.
+    std::string BuildStatsJson() { return BuildStatsJson(statsReport.commandWindow); }
+public: // Thread-safe, used by the shards.
+    // Queue work for the server thread.  Never blocks, the server may be waiting on the caller's mailbox.
+    void Post(ChatMail&& mail);
+    // Hand `pPayload` to every shard except `pSkipShard`.  Each mail takes its own reference.
+    void PostBroadcast(
+        SharedPayload* pPayload, HSteamNetConnection except, uint32 nRoom, const ChatShard* pSkipShard,
+        uint16 nLane = WireLane::k_nChat);
+    RoomDirectory& GetRooms() { return rooms; }
+    NickRegistry& GetNicks() { return nicks; }
+    TranscriptLog* GetTranscript() { return pTranscript.get(); } // nullptr when there is no transcript.
 private:
+    void StartShards();
+    void StopShards();
+    int TickShardsInline();
+    int DrainMailbox();
+    // The next mail in the order it was posted, from the mailbox or the overflow.
+    bool PopMail(ChatMail& mail);
+    // Forget a connected client and tell their room `whatHappened`.  Closing the connection is up to the caller.
+    void RemoveClient(HSteamNetConnection hConn, const std::string& whatHappened);
+    // Forget a connected client, but keep their session for them to resume, and only log `whatHappened`.
+    // Their room hears of it only if the session expires.
+    // `bTimedOut` if the connection may have been dead for a while before we noticed.
+    void DetachClient(HSteamNetConnection hConn, const std::string& whatHappened, bool bTimedOut);
+    // Both send a Notice.
     void SendStringToClient(HSteamNetConnection conn, const char* str);
-    void SendStringToAllClients(const char* str, HSteamNetConnection except = k_HSteamNetConnection_Invalid);
-    void PollIncomingMessages();
-    void PollLocalUserInput();
-    void SetClientNick(HSteamNetConnection hConn, const char* nick);
+    void SendStringToRoom(uint32 nRoom, const char* str, HSteamNetConnection except = k_HSteamNetConnection_Invalid);
+    // Let in as many waiting connections as the accept rate allows, and introduce those whose Hello came or
+    // whose wait for it is over.
+    int AdmitPendingConnections();
+    // Queue a connection for AdmitPendingConnections, unless the server is full.
+    void QueueForAdmission(HSteamNetConnection hConn, bool bConnected, const char* szDescription);
+    // Accept one connection and hand it to a shard.  Returns false if it was gone.
+    bool AcceptClient(const PendingAccept_t& pending, SteamNetworkingMicroseconds usecNow);
+    // Welcome everybody in `introduceThisTick`, give them the roster and the lobby's history, and tell the
+    // lobby.  All of it is encoded once for all of them.
+    void IntroduceClients();
+    // Put them back as the session of `sToken` had them, instead of introducing them, and send them only
+    // what they missed.  Returns false if there is no such session.
+    bool ResumeSession(HSteamNetConnection hConn, ClientInfo_t& client, std::string_view sToken);
+    // Keep `session` until Options::nResumeWindowSec from `usecNow`.
+    void HoldSession(const std::string& sToken, Resumable_t session, SteamNetworkingMicroseconds usecNow);
+    // Free the nicks of the sessions past their deadline, and tell their rooms they are gone.
+    void ExpireResumableSessions(SteamNetworkingMicroseconds usecNow);
+    // Drop what every session left has heard from nickMapLog.  Sessions are held in the order they heard
+    // more of it, so the oldest one still held has heard the least.
+    void TrimNickMapLog();
+    // Send them nickMapLog from `cbFrom` on, counting what was trimmed off, in messages of whole NickMaps.
+    void SendMissedNickMaps(HSteamNetConnection hConn, size_t cbFrom);
+    // See Options::sSnapshotFile.
+    void LoadSnapshot();
+    void SaveSnapshot();
+    // The NickMap of every client, packed into as few messages as possible, then who is in the lobby.
+    // Built once per tick and attached to every newcomer's messages.  Each payload holds one reference.
+    void BuildRosterPayloads(std::vector<SharedPayload*>& payloads);
+    // Commands from the console and the admin socket: /quit, /stats, /loglevel, /kick and /broadcast.
+    int PollLocalUserInput();
+    // Answer a command where it came from.  Everything is logged, which is the console's answer.
+    void ReplyToCommand(uint32 nSource, const std::string& sText);
+    void KickClient(uint32 nSource, std::string_view sNick);
+    ChatShard& PickLeastLoadedShard();
+    // Once a second, after the rooms' rates: let the directory reclaim the rooms nobody is in, nor headed for.
+    void ReclaimEmptyRooms();
+    void DumpStatsIfDue();
+    // Rates over `window`, which starts over.
+    std::string BuildStatsJson(RateWindow_t& window);
 private: // OnSteamNetConnectionStatusChanged stuff.
     void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo);
     static ChatServer* s_pCallbackInstance;
     static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo);
-    void PollConnectionStateChanges();
+    int PollConnectionStateChanges();
+    int nCallbacksThisTick = 0;
 };
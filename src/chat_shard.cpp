@@ -0,0 +1,840 @@
+#include "chat_shard.h"
+#include <algorithm>
+#include <allocation_counter.h>
+#include <cassert>
+#include <charconv>
+#include <chat_server.h>
+#include <my_cpp_utils/logger.h>
+#include <steam/steamnetworkingsockets.h>
+#include <thread>
+
+namespace
+{
+
+std::string_view TrimWhitespace(std::string_view s)
+{
+    const char* k_szWhitespace = " \t\r\n";
+    size_t nBegin = s.find_first_not_of(k_szWhitespace);
+    if (nBegin == std::string_view::npos)
+        return {};
+    size_t nEnd = s.find_last_not_of(k_szWhitespace);
+    return s.substr(nBegin, nEnd - nBegin + 1);
+}
+
+} // namespace
+
+const ChatShard::Command_t ChatShard::k_commands[] = {
+    {WireType::SetNick, &ChatShard::OnNickCommand},
+    {WireType::Join, &ChatShard::OnJoinCommand},
+    {WireType::Leave, &ChatShard::OnLeaveCommand},
+    {WireType::ListRooms, &ChatShard::OnRoomsCommand},
+};
+
+ChatShard::ChatShard(
+    ChatServer& server, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter, int nShardIndex, const Options& options)
+  : server(server), quitFlag(quitFlag), loopWaiter(loopWaiter), nShardIndex(nShardIndex), options(options),
+    pPayloadPool(PayloadPool::Create(options.payloadPoolOptions))
+{
+    pInterface = SteamNetworkingSockets();
+    pUtils = SteamNetworkingUtils();
+
+    hPollGroup = pInterface->CreatePollGroup();
+    if (hPollGroup == k_HSteamNetPollGroup_Invalid)
+        MY_LOG_FMT(error, "[ChatShard {}] Failed to create poll group", nShardIndex);
+}
+
+ChatShard::~ChatShard()
+{
+    // Drop the payload references still sitting in the mailbox.
+    ChatMail mail;
+    while (PopMail(mail))
+    {
+        if (mail.pPayload)
+            mail.pPayload->Release();
+    }
+
+    pInterface->DestroyPollGroup(hPollGroup);
+    hPollGroup = k_HSteamNetPollGroup_Invalid;
+}
+
+int ChatShard::Tick()
+{
+    int nWork = PollIncomingMessages();
+    SteamNetworkingMicroseconds usecNow = pUtils->GetLocalTimestamp();
+    if (usecNow >= usecNextSendBudgetCheck)
+    {
+        usecNextSendBudgetCheck = usecNow + (SteamNetworkingMicroseconds)options.nSendBudgetCheckMs * 1000;
+        CheckSendBudgets();
+    }
+    nWork += FlushFrames();
+    return nWork;
+}
+
+void ChatShard::RunWorker()
+{
+    while (!quitFlag)
+        loopWaiter.Wait(Tick() > 0);
+}
+
+void ChatShard::Post(ChatMail&& mail)
+{
+    if (bOverflow.load(std::memory_order_acquire) || !mailbox.TryPush(std::move(mail)))
+    {
+        // Chat lines and ephemeral messages may be lost under extreme overload, but membership changes may not.
+        if (mail.eType == ChatMail::Type::Broadcast)
+        {
+            mail.pPayload->Release();
+            ++nDroppedBroadcasts;
+            return;
+        }
+        std::lock_guard<std::mutex> lock{mutexOverflow};
+        overflowMail.push_back(std::move(mail));
+        bOverflow.store(true, std::memory_order_release);
+    }
+    loopWaiter.Notify();
+}
+
+bool ChatShard::PopMail(ChatMail& mail)
+{
+    if (!overflowBatch.empty())
+    {
+        mail = std::move(overflowBatch.front());
+        overflowBatch.pop_front();
+        return true;
+    }
+    if (mailbox.TryPop(mail))
+        return true;
+    if (!bOverflow.load(std::memory_order_acquire))
+        return false;
+    {
+        std::lock_guard<std::mutex> lock{mutexOverflow};
+        overflowBatch.swap(overflowMail);
+        bOverflow.store(false, std::memory_order_release);
+    }
+    return PopMail(mail);
+}
+
+void ChatShard::LogCounters() const
+{
+    MY_LOG_FMT(
+        info,
+        "[ChatShard {}] Ticks: {}. Max messages per tick: {}. Ticks with saturated batches: {}. Dropped broadcasts: {}. "
+        "Relayed lines: {}. Allocations per relayed line: {:.2f}. Send budget hits: {}. Lines skipped: {}. "
+        "Slow consumers evicted: {}. Flood drops: {}. Flooders evicted: {}.",
+        nShardIndex, stats.nTicks.load(), stats.nMaxMessagesPerTick.load(), stats.nSaturatedTicks.load(),
+        nDroppedBroadcasts.load(), stats.nRelayedMessages.load(),
+        stats.nRelayedMessages ? (double)stats.nRelayAllocations / (double)stats.nRelayedMessages : 0.0,
+        stats.nSendBudgetHits.load(), stats.nSendBudgetSkips.load(), stats.nSlowConsumerEvictions.load(),
+        stats.nFloodDrops.load(), stats.nFloodEvictions.load());
+}
+
+int ChatShard::DrainMailbox()
+{
+    int nMails = 0;
+    ChatMail mail;
+    while (PopMail(mail))
+    {
+        HandleMail(mail);
+        ++nMails;
+    }
+    return nMails;
+}
+
+void ChatShard::HandleMail(ChatMail& mail)
+{
+    switch (mail.eType)
+    {
+    case ChatMail::Type::AddClient:
+        {
+            Client_t& client = clients.Insert(mail.hConn);
+            client.m_nId = mail.nClientId;
+            SteamNetworkingMicroseconds usecNow = pUtils->GetLocalTimestamp();
+            client.m_messageBucket = TokenBucket(options.flMessagesPerSec, options.nMessageBurst, usecNow);
+            client.m_byteBucket = TokenBucket(options.flBytesPerSec, options.cbByteBurst, usecNow);
+            SetClientNick(mail.hConn, client, mail.sNick);
+            break;
+        }
+
+    case ChatMail::Type::IntroduceClient:
+        // The server sent them the lobby's history along with the roster.
+        if (Client_t* pClient = clients.Find(mail.hConn))
+            EnterRoom(mail.hConn, *pClient, server.GetRooms().Enter(RoomDirectory::k_nLobby));
+        break;
+
+    case ChatMail::Type::ResumeClient:
+        if (Client_t* pClient = clients.Find(mail.hConn))
+        {
+            // Nobody hears of it, to everybody else they never left.  They only get what they missed.
+            Client_t& client = *pClient;
+            RoomDirectory::Room_t& room = server.GetRooms().Enter(mail.nRoom);
+            client.m_nId = mail.nClientId;
+            SetClientNick(mail.hConn, client, mail.sNick);
+            EnterRoom(mail.hConn, client, room);
+            SendWelcome(mail.hConn, client, client.m_bBatchFrames ? WireHello::k_nFlagBatch : 0);
+            std::string welcomeBack = MY_FMT("Welcome back, {}. Thou art in '{}' once more.", mail.sNick, room.m_sName);
+            SendStringToClient(mail.hConn, welcomeBack.c_str());
+            ReplayHistory(mail.hConn, room, mail.nHistoryLine);
+        }
+        break;
+
+    case ChatMail::Type::RemoveClient:
+    case ChatMail::Type::DetachClient:
+        if (Client_t* pClient = clients.Find(mail.hConn))
+        {
+            if (pClient->m_bOverBudget || pClient->m_bEvicting)
+                --nClientsHeldBack;
+            if (pClient->m_bBatchFrames)
+                --nBatchingClients;
+            if (mail.eType == ChatMail::Type::RemoveClient)
+                server.GetNicks().Release(pClient->m_nId, pClient->m_nick.View());
+            if (pClient->m_pRoom)
+                ExitRoom(*pClient);
+            clients.Erase(mail.hConn);
+        }
+        break;
+
+    case ChatMail::Type::Broadcast:
+        SendPayloadToLocalClients(mail.pPayload, mail.nRoom, mail.hConn, mail.nLane);
+        mail.pPayload->Release();
+        mail.pPayload = nullptr;
+        break;
+
+    default:
+        assert(!"Unexpected mail for a shard");
+        break;
+    }
+}
+
+int ChatShard::PollIncomingMessages()
+{
+    ScopedPhaseTimer phaseTimer(stats.pollIncomingUsec);
+    int nMessagesThisTick = 0;
+    int nBatchesThisTick = 0;
+    int nMails = 0;
+    while (!quitFlag)
+    {
+        // Drain up to a full batch with a single library call.
+        int numMsgs = pInterface->ReceiveMessagesOnPollGroup(hPollGroup, incomingBatch.data(), k_nIncomingBatchSize);
+
+        // The server posts AddClient before it moves a connection into our poll group,
+        // so draining the mailbox after receiving guarantees that every sender is known.
+        nMails += DrainMailbox();
+
+        if (numMsgs == 0)
+            break;
+        if (numMsgs < 0)
+        {
+            MY_LOG_FMT(error, "[ChatShard {}] Error checking for messages", nShardIndex);
+            break;
+        }
+        ++nBatchesThisTick;
+        nMessagesThisTick += numMsgs;
+
+        for (int i = 0; i < numMsgs; ++i)
+            HandleIncomingMessage(incomingBatch[i]);
+
+        // We don't need them anymore.  Release the whole batch together.
+        for (int i = 0; i < numMsgs; ++i)
+        {
+            incomingBatch[i]->Release();
+            incomingBatch[i] = nullptr;
+        }
+
+        // A partial batch means the poll group is empty now.
+        if (numMsgs < k_nIncomingBatchSize)
+            break;
+    }
+
+    AddRelaxed(stats.nTicks, 1);
+    AddRelaxed(stats.nMessagesIn, (uint64)nMessagesThisTick);
+    if ((uint64)nMessagesThisTick > stats.nMaxMessagesPerTick.load(std::memory_order_relaxed))
+        stats.nMaxMessagesPerTick.store((uint64)nMessagesThisTick, std::memory_order_relaxed);
+    if (nBatchesThisTick > 1)
+        AddRelaxed(stats.nSaturatedTicks, 1);
+    return nMessagesThisTick + nMails;
+}
+
+void ChatShard::HandleIncomingMessage(const ISteamNetworkingMessage* pIncomingMsg)
+{
+    assert(pIncomingMsg);
+    AddRelaxed(stats.nBytesIn, (uint64)pIncomingMsg->m_cbSize);
+    HSteamNetConnection hConn = pIncomingMsg->m_conn;
+    Client_t* pClient = clients.Find(hConn);
+
+    // The server may have removed the client between receiving the batch and handling it.
+    if (!pClient)
+        return;
+    // Flooders cost us no more than this.
+    if (!ChargeFloodLimits(hConn, *pClient, pIncomingMsg))
+        return;
+
+    // Every client message is exactly one envelope.  Decode it straight out of the received
+    // buffer, which stays valid until the batch is released.
+    WireMessage msg;
+    size_t cbMsg = (size_t)pIncomingMsg->m_cbSize;
+    if (Wire::Decode(pIncomingMsg->m_pData, cbMsg, msg) != cbMsg)
+    {
+        AddRelaxed(stats.nMalformedMessages, 1);
+        return;
+    }
+
+    // Until the server introduces them they are in no room, and only their Hello counts.
+    if (!pClient->m_pRoom && msg.eType != WireType::Hello)
+        return;
+    if (WireLane::Of(msg.eType) == WireLane::k_nPresence)
+    {
+        RelayEphemeral(hConn, *pClient, msg);
+        return;
+    }
+    if (msg.eType != WireType::Say)
+    {
+        DispatchCommand(hConn, *pClient, msg);
+        return;
+    }
+
+    // An ordinary chat message, dispatch to everybody else in the room.  It goes out with the
+    // sender's id instead of their nick, encoded in a buffer that keeps its capacity between messages.
+    uint64 nAllocationsBefore = AllocationCounter::GetThreadAllocations();
+    pClient->m_pRoom->m_nMessages.fetch_add(1, std::memory_order_relaxed);
+    relayBuffer.clear();
+    Wire::Append<WireType::Chat>(relayBuffer, pClient->m_nId, msg.sBody);
+    SendBufferToRoom(pClient->m_pRoom->m_nId, relayBuffer.data(), (uint32)relayBuffer.size(), hConn);
+
+    // Keep it for those who join later, along with the nick it was said under, and in the transcript.
+    RoomHistory& history = pClient->m_pRoom->m_history;
+    TranscriptLog* pTranscript = server.GetTranscript();
+    if (history.IsEnabled() || pTranscript)
+    {
+        relayBuffer.clear();
+        Wire::AppendReplay(relayBuffer, pClient->m_nId, pClient->m_nick.GetWireField(), msg.sBody);
+        history.Append(relayBuffer.data(), (uint32)relayBuffer.size());
+        if (pTranscript)
+        {
+            pTranscript->Append(
+                pClient->m_pRoom->m_sName,
+                SharedPayload::Create(relayBuffer.data(), (uint32)relayBuffer.size(), pPayloadPool.get()));
+        }
+    }
+    AddRelaxed(stats.nRelayedMessages, 1);
+    AddRelaxed(stats.nRelayAllocations, AllocationCounter::GetThreadAllocations() - nAllocationsBefore);
+}
+
+bool ChatShard::ChargeFloodLimits(
+    HSteamNetConnection hConn, Client_t& client, const ISteamNetworkingMessage* pIncomingMsg)
+{
+    // Whatever is still in flight from somebody being disconnected is not worth relaying.
+    if (client.m_bEvicting)
+        return false;
+
+    // Both limits or neither, so a dropped message is not charged to one of them.  A message bigger than
+    // the whole byte burst costs the whole burst.
+    SteamNetworkingMicroseconds usecNow = pIncomingMsg->m_usecTimeReceived;
+    double flBytes = std::min((double)pIncomingMsg->m_cbSize, (double)options.cbByteBurst);
+    bool bMessagesOk = options.flMessagesPerSec <= 0 || client.m_messageBucket.GetTokens(usecNow) >= 1.0;
+    bool bBytesOk = options.flBytesPerSec <= 0 || client.m_byteBucket.GetTokens(usecNow) >= flBytes;
+    if (bMessagesOk && bBytesOk)
+    {
+        if (options.flMessagesPerSec > 0)
+            client.m_messageBucket.TryTake(usecNow);
+        if (options.flBytesPerSec > 0)
+            client.m_byteBucket.TryTake(usecNow, flBytes);
+        return true;
+    }
+
+    AddRelaxed(stats.nFloodDrops, 1);
+    ++client.m_nFloodDrops;
+    if (usecNow < client.m_usecFloodStrikeEnd)
+        return false;
+
+    // A new strike.  Only strikes in a row count, so a burst now and then is forgiven.
+    static constexpr SteamNetworkingMicroseconds k_usecStrike = 1000000;
+    if (usecNow >= client.m_usecFloodStrikeEnd + k_usecStrike)
+        client.m_nFloodStrikes = 0;
+    client.m_usecFloodStrikeEnd = usecNow + k_usecStrike;
+    ++client.m_nFloodStrikes;
+    if (options.nFloodStrikesToDisconnect > 0 && client.m_nFloodStrikes >= options.nFloodStrikesToDisconnect)
+    {
+        Evict(hConn, client, ChatMail::Type::EvictFlooder);
+        return false;
+    }
+    std::string floodNotice = MY_FMT(
+        "Thou speakest too fast; {} of thy messages went unheard. Slow down, lest thou be shown the door.",
+        client.m_nFloodDrops);
+    SendStringToClient(hConn, floodNotice.c_str());
+    client.m_nFloodDrops = 0;
+    return false;
+}
+
+void ChatShard::DispatchCommand(HSteamNetConnection hConn, Client_t& client, const WireMessage& msg)
+{
+    if (msg.eType == WireType::Hello)
+    {
+        OnHello(hConn, client, msg.nFlags, msg.sBody);
+        return;
+    }
+
+    for (const Command_t& command : k_commands)
+    {
+        if (command.eType == msg.eType)
+        {
+            (this->*command.pfnHandler)(hConn, client, TrimWhitespace(msg.sBody));
+            return;
+        }
+    }
+
+    SendStringToClient(hConn, MY_FMT("Unknown request type {}.", (int)msg.eType).c_str());
+}
+
+void ChatShard::RelayEphemeral(HSteamNetConnection hConn, Client_t& client, const WireMessage& msg)
+{
+    relayBuffer.clear();
+    switch (msg.eType)
+    {
+    case WireType::Typing:
+        Wire::Append<WireType::Typing>(relayBuffer, client.m_nId, {}, msg.nFlags & WireTyping::k_nFlagTyping);
+        break;
+
+    case WireType::Presence:
+        if (msg.nFlags > WirePresence::k_nMaxState)
+        {
+            AddRelaxed(stats.nMalformedMessages, 1);
+            return;
+        }
+        Wire::Append<WireType::Presence>(relayBuffer, client.m_nId, {}, msg.nFlags);
+        break;
+
+    case WireType::ReadMarker:
+        Wire::Append<WireType::ReadMarker>(relayBuffer, client.m_nId, msg.sBody);
+        break;
+
+    default:
+        assert(!"Not an ephemeral message");
+        return;
+    }
+    SendBufferToRoom(
+        client.m_pRoom->m_nId, relayBuffer.data(), (uint32)relayBuffer.size(), hConn, WireLane::k_nPresence);
+    AddRelaxed(stats.nEphemeralRelayed, 1);
+}
+
+void ChatShard::OnHello(HSteamNetConnection hConn, Client_t& client, uint8 nCapabilities, std::string_view sToken)
+{
+    uint8 nAgreed = 0;
+    if (options.cbMaxBatchFrame > 0)
+        nAgreed |= nCapabilities & WireHello::k_nFlagBatch;
+
+    // Tell them their id and what we agreed to, before any of it takes effect.
+    SendWelcome(hConn, client, nAgreed);
+
+    bool bBatchFrames = (nAgreed & WireHello::k_nFlagBatch) != 0;
+    if (bBatchFrames != client.m_bBatchFrames)
+    {
+        client.m_bBatchFrames = bBatchFrames;
+        nBatchingClients += bBatchFrames ? 1 : -1;
+    }
+
+    // The server introduces them once it knows whether they are resuming.  A token of the wrong size
+    // cannot be one of ours.
+    if (sToken.size() != WireHello::k_cbResumeToken)
+        sToken = {};
+    server.Post(ChatMail{ChatMail::Type::Hello, hConn, std::string(sToken)});
+}
+
+void ChatShard::SendWelcome(HSteamNetConnection hConn, const Client_t& client, uint8 nAgreed)
+{
+    char welcome[Wire::EncodedSize(0)];
+    uint32 cbWelcome = (uint32)Wire::Encode<WireType::Welcome>(welcome, client.m_nId, {}, nAgreed);
+    SendBufferToClient(hConn, welcome, cbWelcome);
+}
+
+void ChatShard::OnNickCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sNick)
+{
+    if (sNick.empty())
+    {
+        SendStringToClient(hConn, "Thou must be known by some name.");
+        return;
+    }
+    if (sNick == client.m_nick.View())
+    {
+        SendStringToClient(hConn, MY_FMT("Thou art already known as {}.", sNick).c_str());
+        return;
+    }
+
+    // No two may share a name.  The registry hands it over and frees the old one in one step.
+    switch (server.GetNicks().Claim(client.m_nId, sNick, client.m_nick.View()))
+    {
+    case NickRegistry::Result::Ok:
+        break;
+    case NickRegistry::Result::Invalid:
+        SendStringToClient(hConn, "A name is at most 32 characters, none of them control characters.");
+        return;
+    case NickRegistry::Result::Taken:
+        SendStringToClient(hConn, MY_FMT("Another already goes by the name {}.", sNick).c_str());
+        return;
+    }
+
+    // Let everybody else in the room know they changed their name
+    std::string changeNickNoticeToOthers = MY_FMT("{} shall henceforth be known as {}", client.m_nick.View(), sNick);
+    SendStringToRoom(client.m_pRoom->m_nId, changeNickNoticeToOthers.c_str(), hConn);
+
+    // Everybody, themselves included, needs the new name to show their lines.
+    relayBuffer.clear();
+    Wire::Append<WireType::NickMap>(relayBuffer, client.m_nId, sNick);
+    SendBufferToRoom(RoomDirectory::k_nAllRooms, relayBuffer.data(), (uint32)relayBuffer.size());
+
+    // Respond to client itself
+    std::string changeNickNoticeToItself = MY_FMT("Thou shalt henceforth be known as {}", sNick);
+    SendStringToClient(hConn, changeNickNoticeToItself.c_str());
+
+    // Actually change their name, and let the server update its directory.
+    SetClientNick(hConn, client, sNick);
+    server.Post(ChatMail{ChatMail::Type::NickChanged, hConn, std::string(sNick)});
+}
+
+void ChatShard::OnJoinCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sRoomName)
+{
+    if (!RoomDirectory::IsValidName(sRoomName))
+    {
+        SendStringToClient(hConn, "Room names are 1 to 32 letters, digits, '_' or '-'.");
+        return;
+    }
+    if (sRoomName == client.m_pRoom->m_sName)
+    {
+        SendStringToClient(hConn, MY_FMT("Thou art already in '{}'", sRoomName).c_str());
+        return;
+    }
+    RoomDirectory::Room_t* pRoom = server.GetRooms().Enter(sRoomName);
+    if (!pRoom)
+    {
+        SendStringToClient(hConn, "There are rooms enough; thou canst not found another. See '/rooms' for them.");
+        return;
+    }
+    MoveClientToRoom(hConn, client, *pRoom);
+}
+
+void ChatShard::OnLeaveCommand(HSteamNetConnection hConn, Client_t& client, std::string_view)
+{
+    if (client.m_pRoom->m_nId == RoomDirectory::k_nLobby)
+    {
+        SendStringToClient(hConn, "Thou art already in the lobby; there is nowhere to leave to.");
+        return;
+    }
+    MoveClientToRoom(hConn, client, server.GetRooms().Enter(RoomDirectory::k_nLobby));
+}
+
+void ChatShard::OnRoomsCommand(HSteamNetConnection hConn, Client_t&, std::string_view sPage)
+{
+    uint32 nPage = 1;
+    std::from_chars(sPage.data(), sPage.data() + sPage.size(), nPage);
+    SendStringToClient(hConn, server.GetRooms().Describe(nPage).c_str());
+}
+
+void ChatShard::SendStringToClient(HSteamNetConnection conn, const char* str)
+{
+    noticeBuffer.clear();
+    Wire::Append<WireType::Notice>(noticeBuffer, 0, str);
+    SendBufferToClient(conn, noticeBuffer.data(), (uint32)noticeBuffer.size());
+}
+
+void ChatShard::SendBufferToClient(HSteamNetConnection hConn, const void* pData, uint32 cbData)
+{
+    if (Client_t* pClient = clients.Find(hConn); pClient && pClient->m_bBatchFrames)
+    {
+        AppendToFrame(hConn, *pClient, pData, cbData);
+        return;
+    }
+    QueueMessage(hConn, pData, cbData);
+}
+
+void ChatShard::SendStringToRoom(uint32 nRoom, const char* str, HSteamNetConnection except)
+{
+    noticeBuffer.clear();
+    Wire::Append<WireType::Notice>(noticeBuffer, 0, str);
+    SendBufferToRoom(nRoom, noticeBuffer.data(), (uint32)noticeBuffer.size(), except);
+}
+
+void ChatShard::SendBufferToRoom(
+    uint32 nRoom, const void* pData, uint32 cbData, HSteamNetConnection except, uint16 nLane)
+{
+    // Encode the line once.  Local clients get it right away, other shards through their mailboxes.
+    SharedPayload* pPayload = SharedPayload::Create(pData, cbData, pPayloadPool.get());
+    SendPayloadToLocalClients(pPayload, nRoom, except, nLane);
+    server.PostBroadcast(pPayload, except, nRoom, this, nLane);
+    pPayload->Release();
+}
+
+void ChatShard::SendPayloadToLocalClients(
+    SharedPayload* pPayload, uint32 nRoom, HSteamNetConnection except, uint16 nLane)
+{
+    // Batch frames are reliable, and an ephemeral message a slow client never gets is no loss to them.
+    bool bEphemeral = nLane != WireLane::k_nChat;
+    int nSendFlags = WireLane::SendFlagsOf(nLane);
+    size_t nRecipients = 0;
+    auto addRecipient = [&](HSteamNetConnection hConn)
+    {
+        if (hConn == except)
+            return;
+        ++nRecipients;
+        if (nClientsHeldBack > 0 || nBatchingClients > 0)
+        {
+            Client_t* pClient = clients.Find(hConn);
+            if (pClient->m_bEvicting)
+                return;
+            if (pClient->m_bOverBudget)
+            {
+                if (!bEphemeral)
+                {
+                    ++pClient->m_nSkippedLines;
+                    AddRelaxed(stats.nSendBudgetSkips, 1);
+                }
+                return;
+            }
+            if (pClient->m_bBatchFrames && !bEphemeral)
+            {
+                AppendToFrame(hConn, *pClient, pPayload->Data(), pPayload->Size());
+                return;
+            }
+        }
+        SteamNetworkingMessage_t* pMsg = pUtils->AllocateMessage(0);
+        pPayload->AttachTo(pMsg);
+        pMsg->m_conn = hConn;
+        pMsg->m_nFlags = nSendFlags;
+        pMsg->m_idxLane = nLane;
+        outgoingBatch.push_back(pMsg);
+    };
+
+    outgoingBatch.clear();
+    if (nRoom == RoomDirectory::k_nAllRooms)
+    {
+        for (auto& [hConn, client] : clients)
+            addRecipient(hConn);
+    }
+    else if (nRoom < roomMembers.size())
+    {
+        for (HSteamNetConnection hConn : roomMembers[nRoom])
+            addRecipient(hConn);
+    }
+
+    // Submit the whole fan-out in one call.  The library takes ownership of the messages.  What was queued
+    // for single clients goes first, or a client that does not batch would get this line before a notice,
+    // welcome or replay that came before it.
+    size_t nSent = outgoingBatch.size();
+    if (!outgoingBatch.empty())
+    {
+        if (!frameBatch.empty())
+            SendMessageBatch(frameBatch);
+        SendMessageBatch(outgoingBatch);
+    }
+    AddRelaxed(stats.nFanouts, 1);
+    stats.fanoutWidth.Record(nRecipients);
+    stats.RecordSend(nSent, pPayload->Size());
+}
+
+void ChatShard::SendMessageBatch(std::vector<SteamNetworkingMessage_t*>& batch)
+{
+    // The library may free the messages as soon as they are submitted, so note the recipients first.
+    outgoingConns.clear();
+    for (SteamNetworkingMessage_t* pMsg : batch)
+        outgoingConns.push_back(pMsg->m_conn);
+    outgoingResults.resize(batch.size());
+    pInterface->SendMessages((int)batch.size(), batch.data(), outgoingResults.data());
+    batch.clear();
+
+    // The library refuses messages once its own send buffer for a connection is full.
+    // Such a client is over any sensible budget, don't wait for the next check.
+    for (size_t i = 0; i < outgoingConns.size(); ++i)
+    {
+        if (outgoingResults[i] != -k_EResultLimitExceeded)
+            continue;
+        AddRelaxed(stats.nSendFailures, 1);
+        Client_t* pClient = clients.Find(outgoingConns[i]);
+        if (pClient && !pClient->m_bOverBudget && !pClient->m_bEvicting)
+            SetOverBudget(outgoingConns[i], *pClient, true);
+    }
+}
+
+void ChatShard::AppendToFrame(HSteamNetConnection hConn, Client_t& client, const void* pData, uint32 cbData)
+{
+    size_t cbMaxFrame = (size_t)options.cbMaxBatchFrame;
+    if (!client.m_batchFrame.empty() && client.m_batchFrame.size() + cbData > cbMaxFrame)
+        QueueFrame(hConn, client);
+
+    // Envelopes are self-delimiting, so the frame is just their concatenation.
+    if (client.m_batchFrame.empty())
+        pendingFrames.push_back(hConn);
+    client.m_batchFrame.append((const char*)pData, cbData);
+    AddRelaxed(stats.nBatchedLines, 1);
+
+    // An envelope bigger than a frame goes out on its own.
+    if (client.m_batchFrame.size() >= cbMaxFrame)
+        QueueFrame(hConn, client);
+}
+
+void ChatShard::QueueFrame(HSteamNetConnection hConn, Client_t& client)
+{
+    // Idle clients should not hold on to a big buffer.
+    static constexpr size_t k_cbRetainedFrameCapacity = 2048;
+
+    QueueMessage(hConn, client.m_batchFrame.data(), (uint32)client.m_batchFrame.size());
+    AddRelaxed(stats.nBatchFrames, 1);
+
+    client.m_batchFrame.clear();
+    if (client.m_batchFrame.capacity() > k_cbRetainedFrameCapacity)
+        std::string().swap(client.m_batchFrame);
+}
+
+void ChatShard::QueueMessage(HSteamNetConnection hConn, const void* pData, uint32 cbData)
+{
+    // Copy into a pooled block instead of letting the library allocate one, and hand it over
+    // with a message that only points at it.
+    SharedPayload* pPayload = SharedPayload::Create(pData, cbData, pPayloadPool.get());
+    SteamNetworkingMessage_t* pMsg = pUtils->AllocateMessage(0);
+    pPayload->AttachTo(pMsg);
+    pPayload->Release();
+    pMsg->m_conn = hConn;
+    pMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+    frameBatch.push_back(pMsg);
+    stats.RecordSend(1, cbData);
+}
+
+int ChatShard::FlushFrames()
+{
+    for (HSteamNetConnection hConn : pendingFrames)
+    {
+        // Skip clients that went away, or whose frame already filled up and was queued.
+        Client_t* pClient = clients.Find(hConn);
+        if (pClient && !pClient->m_batchFrame.empty())
+            QueueFrame(hConn, *pClient);
+    }
+    pendingFrames.clear();
+
+    int nFrames = (int)frameBatch.size();
+    if (!frameBatch.empty())
+        SendMessageBatch(frameBatch);
+    return nFrames;
+}
+
+void ChatShard::CheckSendBudgets()
+{
+    SteamNetworkingMicroseconds usecMaxQueueTime = (SteamNetworkingMicroseconds)options.nMaxQueueTimeMs * 1000;
+    for (auto& [hConn, client] : clients)
+    {
+        if (client.m_bEvicting)
+            continue;
+        SteamNetConnectionRealTimeStatus_t status;
+        if (pInterface->GetConnectionRealTimeStatus(hConn, &status, 0, nullptr) != k_EResultOK)
+            continue;
+
+        int cbBacklog = status.m_cbPendingReliable + status.m_cbSentUnackedReliable;
+        if (cbBacklog > options.cbSendHardLimit || status.m_usecQueueTime > usecMaxQueueTime)
+            Evict(hConn, client, ChatMail::Type::EvictClient);
+        else if (cbBacklog > options.cbSendBudget)
+        {
+            if (options.slowConsumerPolicy == SlowConsumerPolicy::Disconnect)
+                Evict(hConn, client, ChatMail::Type::EvictClient);
+            else if (!client.m_bOverBudget)
+                SetOverBudget(hConn, client, true);
+        }
+        else if (client.m_bOverBudget)
+            SetOverBudget(hConn, client, false);
+    }
+}
+
+void ChatShard::SetOverBudget(HSteamNetConnection hConn, Client_t& client, bool bOverBudget)
+{
+    assert(client.m_bOverBudget != bOverBudget && !client.m_bEvicting);
+    client.m_bOverBudget = bOverBudget;
+    if (bOverBudget)
+    {
+        ++nClientsHeldBack;
+        AddRelaxed(stats.nSendBudgetHits, 1);
+        return;
+    }
+
+    --nClientsHeldBack;
+    if (options.slowConsumerPolicy == SlowConsumerPolicy::Coalesce && client.m_nSkippedLines > 0)
+    {
+        std::string missedNotice = MY_FMT(
+            "Thy connection fell behind; {} line(s) were not delivered to thee.", client.m_nSkippedLines);
+        SendStringToClient(hConn, missedNotice.c_str());
+    }
+    client.m_nSkippedLines = 0;
+}
+
+void ChatShard::Evict(HSteamNetConnection hConn, Client_t& client, ChatMail::Type eMailType)
+{
+    assert(!client.m_bEvicting);
+    if (!client.m_bOverBudget)
+        ++nClientsHeldBack;
+    client.m_bEvicting = true;
+    AddRelaxed(eMailType == ChatMail::Type::EvictFlooder ? stats.nFloodEvictions : stats.nSlowConsumerEvictions, 1);
+
+    // The server owns the connection.  Until it sends RemoveClient back, we just stop sending to them.
+    server.Post(ChatMail{eMailType, hConn, {}});
+}
+
+void ChatShard::SetClientNick(HSteamNetConnection hConn, Client_t& client, std::string_view sNick)
+{
+    // Remember their nick
+    client.m_nick.Assign(sNick);
+
+    // Set the connection name, too, which is useful for debugging
+    pInterface->SetConnectionName(hConn, client.m_nick.c_str());
+}
+
+void ChatShard::MoveClientToRoom(HSteamNetConnection hConn, Client_t& client, RoomDirectory::Room_t& room)
+{
+    RoomDirectory::Room_t& oldRoom = *client.m_pRoom;
+    ExitRoom(client);
+    std::string departureNotice = MY_FMT("{} hath departed to '{}'", client.m_nick.View(), room.m_sName);
+    SendStringToRoom(oldRoom.m_nId, departureNotice.c_str());
+
+    std::string arrivalNotice = MY_FMT("{} hath entered '{}'", client.m_nick.View(), room.m_sName);
+    SendStringToRoom(room.m_nId, arrivalNotice.c_str());
+    EnterRoom(hConn, client, room);
+
+    std::string noticeToItself =
+        MY_FMT("Thou hast entered '{}'. {} soul(s) dwell here.", room.m_sName, room.m_nMembers.load());
+    SendStringToClient(hConn, noticeToItself.c_str());
+    ReplayHistory(hConn, room);
+
+    // Let the server know, so that disconnect notices and rosters go to the right room.
+    server.Post(ChatMail{ChatMail::Type::RoomChanged, hConn, {}, nullptr, room.m_nId});
+}
+
+void ChatShard::ReplayHistory(HSteamNetConnection hConn, const RoomDirectory::Room_t& room, uint64 nFromLine)
+{
+    replayBuffer.clear();
+    size_t nLines = room.m_history.CopySince(nFromLine, replayBuffer);
+    if (nLines == 0)
+        return;
+    SendBufferToClient(hConn, replayBuffer.data(), (uint32)replayBuffer.size());
+    AddRelaxed(stats.nHistoryReplays, 1);
+    AddRelaxed(stats.nHistoryLinesReplayed, nLines);
+}
+
+void ChatShard::EnterRoom(HSteamNetConnection hConn, Client_t& client, RoomDirectory::Room_t& room)
+{
+    assert(!client.m_pRoom);
+    if (room.m_nId >= roomMembers.size())
+        roomMembers.resize(room.m_nId + 1);
+    auto& members = roomMembers[room.m_nId];
+    client.m_pRoom = &room;
+    client.m_nRoomSlot = (uint32)members.size();
+    members.push_back(hConn);
+}
+
+void ChatShard::ExitRoom(Client_t& client)
+{
+    assert(client.m_pRoom);
+    auto& members = roomMembers[client.m_pRoom->m_nId];
+
+    // Swap-remove, and tell the member that moved about its new position.
+    HSteamNetConnection hMoved = members.back();
+    members[client.m_nRoomSlot] = hMoved;
+    members.pop_back();
+    if (Client_t* pMoved = clients.Find(hMoved); pMoved != &client)
+        pMoved->m_nRoomSlot = client.m_nRoomSlot;
+
+    --client.m_pRoom->m_nMembers;
+    client.m_pRoom = nullptr;
+}
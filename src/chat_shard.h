@@ -0,0 +1,200 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chat_mail.h>
+#include <connection_table.h>
+#include <deque>
+#include <loop_waiter.h>
+#include <mutex>
+#include <nick_registry.h>
+#include <payload_pool.h>
+#include <room_directory.h>
+#include <server_stats.h>
+#include <steam/isteamnetworkingsockets.h>
+#include <steam/isteamnetworkingutils.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <token_bucket.h>
+#include <vector>
+#include <wire_protocol.h>
+
+class ChatServer;
+
+// One slice of the server's connections. A shard owns a poll group and the
+// records of the clients assigned to it, and is driven by exactly one thread,
+// so none of its state needs locking. Everything else reaches it through the mailbox.
+class ChatShard
+{
+public:
+    // What happens to a client whose outbound backlog is over `Options::cbSendBudget`.
+    enum class SlowConsumerPolicy
+    {
+        Drop,       // Room traffic to them is skipped until they catch up.  Direct replies still go out.
+        Coalesce,   // Like Drop, and once they catch up they get a single line saying how much they missed.
+        Disconnect, // They are disconnected with k_nEndReasonSlowConsumer.
+    };
+    struct Options
+    {
+        // Outbound backlog (pending plus unacknowledged reliable bytes) at which the policy kicks in.
+        int cbSendBudget = 256 * 1024;
+        // Backlog, or estimated queue time, at which the client is disconnected whatever the policy.
+        int cbSendHardLimit = 1024 * 1024;
+        int nMaxQueueTimeMs = 5000;
+        SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::Coalesce;
+        int nSendBudgetCheckMs = 100; // How often every client's backlog is looked at.
+        // Clients that said Hello with WireHello::k_nFlagBatch get all their envelopes of a tick in one
+        // message, flushed at the end of the tick or when it reaches this size.  0 turns batching off.
+        int cbMaxBatchFrame = 16 * 1024;
+        PayloadPool::Options payloadPoolOptions; // Every outgoing buffer of a shard comes from its pool.
+        // Flood limits per client, checked before a message is even decoded.  Messages over either are
+        // dropped.  A rate of 0 turns that limit off.
+        double flMessagesPerSec = 20;
+        int nMessageBurst = 40;
+        double flBytesPerSec = 32 * 1024;
+        int cbByteBurst = 64 * 1024;
+        // Each second in which some of a client's messages were dropped is a strike; a second without any
+        // clears them.  At this many in a row the client is disconnected.  0 never disconnects.
+        int nFloodStrikesToDisconnect = 5;
+    };
+    static constexpr int k_nEndReasonSlowConsumer = k_ESteamNetConnectionEnd_App_Min + 1;
+    static constexpr int k_nEndReasonFlooding = k_ESteamNetConnectionEnd_App_Min + 4;
+private:
+    ChatServer& server;
+    std::atomic<bool>& quitFlag;
+    LoopWaiter& loopWaiter;
+    const int nShardIndex;
+    Options options;
+    ISteamNetworkingSockets* pInterface;
+    ISteamNetworkingUtils* pUtils;
+    HSteamNetPollGroup hPollGroup;
+    struct Client_t
+    {
+        CompactNick m_nick;
+        uint32 m_nId = 0; // Sender id on the wire.
+        RoomDirectory::Room_t* m_pRoom = nullptr; // None until the server has introduced them.
+        uint32 m_nRoomSlot = 0; // Position in roomMembers[m_pRoom->m_nId].
+        bool m_bOverBudget = false;
+        bool m_bEvicting = false; // The server has been asked to disconnect them.
+        uint32 m_nSkippedLines = 0; // Room lines they did not get while over budget.
+        bool m_bBatchFrames = false;
+        std::string m_batchFrame; // Envelopes waiting for the end of the tick.
+        TokenBucket m_messageBucket;
+        TokenBucket m_byteBucket;
+        SteamNetworkingMicroseconds m_usecFloodStrikeEnd = 0; // End of the second of the last strike.
+        int m_nFloodStrikes = 0;
+        uint32 m_nFloodDrops = 0; // Dropped in the current strike, told to them at the next one.
+    };
+    ConnectionTable<Client_t> clients;
+    // Local members of each room, indexed by room id, so a room line only touches its own members.
+    std::vector<std::vector<HSteamNetConnection>> roomMembers;
+    static constexpr size_t k_nMailboxCapacity = 1 << 16;
+    ChatMailbox mailbox{k_nMailboxCapacity};
+    // Membership mail that did not fit in the mailbox, as in ChatServer.  With one worker the server thread
+    // ticks this shard itself, so it must never wait for the mailbox to drain.
+    std::mutex mutexOverflow;
+    std::deque<ChatMail> overflowMail;
+    std::atomic<bool> bOverflow = false;
+    std::deque<ChatMail> overflowBatch;
+    std::atomic<uint64> nDroppedBroadcasts = 0;
+    // Incoming messages are drained from the poll group in batches of this size.
+    static constexpr int k_nIncomingBatchSize = 256;
+    std::array<ISteamNetworkingMessage*, k_nIncomingBatchSize> incomingBatch = {};
+    LoopStats stats;
+    PayloadPool::Ptr pPayloadPool;
+    // Reused for every fan-out so that broadcasting does not allocate a new array each time.
+    std::vector<SteamNetworkingMessage_t*> outgoingBatch;
+    std::vector<int64> outgoingResults;
+    std::vector<HSteamNetConnection> outgoingConns;
+    // Clients with lines in their m_batchFrame, and the messages ready to go out at the end of the tick:
+    // their frames, and whatever was sent to a single client that does not batch.  A fan-out sends the
+    // latter ahead of itself, to keep the order.
+    std::vector<HSteamNetConnection> pendingFrames;
+    std::vector<SteamNetworkingMessage_t*> frameBatch;
+    int nBatchingClients = 0;
+    // Clients that are over budget or being evicted.  While there are none, fan-outs skip the per-recipient check.
+    int nClientsHeldBack = 0;
+    SteamNetworkingMicroseconds usecNextSendBudgetCheck = 0;
+    // Outgoing envelopes are encoded here.  It keeps its capacity, so relaying does not allocate.
+    std::string relayBuffer;
+    std::string noticeBuffer;
+    std::string replayBuffer; // Room history for a newcomer, up to RoomHistory::Options::cbMaxBytes.
+public:
+    ChatShard(
+        ChatServer& server, std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter, int nShardIndex,
+        const Options& options);
+    ~ChatShard();
+    // Run one iteration: apply pending mail and handle incoming messages. Returns the amount of work done.
+    int Tick();
+    // Thread body used when the shard runs on its own worker thread.
+    void RunWorker();
+public: // Thread-safe.
+    HSteamNetPollGroup GetPollGroup() const { return hPollGroup; }
+    int GetIndex() const { return nShardIndex; }
+    const LoopStats& GetStats() const { return stats; }
+    const PayloadPool::Stats& GetPayloadPoolStats() const { return pPayloadPool->GetStats(); }
+    // Queue work for this shard and wake its thread.  Never blocks; broadcasts are dropped when it is full.
+    void Post(ChatMail&& mail);
+    void LogCounters() const;
+private:
+    int DrainMailbox();
+    // The next mail in the order it was posted, from the mailbox or the overflow.
+    bool PopMail(ChatMail& mail);
+    void HandleMail(ChatMail& mail);
+    int PollIncomingMessages();
+    void HandleIncomingMessage(const ISteamNetworkingMessage* pIncomingMsg);
+    // Charge a message to the client's flood limits.  Returns false if it must be dropped.
+    bool ChargeFloodLimits(HSteamNetConnection hConn, Client_t& client, const ISteamNetworkingMessage* pIncomingMsg);
+    void DispatchCommand(HSteamNetConnection hConn, Client_t& client, const WireMessage& msg);
+    // Pass a Typing, Presence or ReadMarker on to the client's room, stamped with their id.
+    void RelayEphemeral(HSteamNetConnection hConn, Client_t& client, const WireMessage& msg);
+    void SendStringToClient(HSteamNetConnection conn, const char* str);
+    // Send a Notice to the members of a room (or RoomDirectory::k_nAllRooms) on all shards.
+    void SendStringToRoom(uint32 nRoom, const char* str, HSteamNetConnection except = k_HSteamNetConnection_Invalid);
+    // Send encoded envelopes to the members of a room on all shards.
+    void SendBufferToRoom(
+        uint32 nRoom, const void* pData, uint32 cbData, HSteamNetConnection except = k_HSteamNetConnection_Invalid,
+        uint16 nLane = WireLane::k_nChat);
+    // Send to the clients of this shard only.  Ephemeral lanes bypass batch frames, and skip clients over budget
+    // without counting it against them.
+    void SendPayloadToLocalClients(
+        SharedPayload* pPayload, uint32 nRoom, HSteamNetConnection except, uint16 nLane = WireLane::k_nChat);
+    // Send encoded envelopes to one client, inside its batch if it has one.  Goes out at the end of the tick.
+    void SendBufferToClient(HSteamNetConnection hConn, const void* pData, uint32 cbData);
+    // Submit `batch` with one library call and check the results.  Leaves `batch` empty.
+    void SendMessageBatch(std::vector<SteamNetworkingMessage_t*>& batch);
+    void AppendToFrame(HSteamNetConnection hConn, Client_t& client, const void* pData, uint32 cbData);
+    // Turn the client's frame into a message in frameBatch.
+    void QueueFrame(HSteamNetConnection hConn, Client_t& client);
+    void QueueMessage(HSteamNetConnection hConn, const void* pData, uint32 cbData);
+    int FlushFrames();
+    // Queries every client's backlog and applies the slow consumer policy.
+    void CheckSendBudgets();
+    void SetOverBudget(HSteamNetConnection hConn, Client_t& client, bool bOverBudget);
+    // Ask the server to disconnect them, with ChatMail::Type::EvictClient or EvictFlooder.
+    void Evict(HSteamNetConnection hConn, Client_t& client, ChatMail::Type eMailType);
+    // `sNick` must already be theirs in the server's NickRegistry.
+    void SetClientNick(HSteamNetConnection hConn, Client_t& client, std::string_view sNick);
+    // Send them what was said in the room before they came, from line `nFromLine` on, in one message.
+    void ReplayHistory(HSteamNetConnection hConn, const RoomDirectory::Room_t& room, uint64 nFromLine = 0);
+    // Both expect `room` to count them as a member already, see RoomDirectory::Enter.
+    void MoveClientToRoom(HSteamNetConnection hConn, Client_t& client, RoomDirectory::Room_t& room);
+    void EnterRoom(HSteamNetConnection hConn, Client_t& client, RoomDirectory::Room_t& room);
+    void ExitRoom(Client_t& client);
+private: // Client requests, e.g. WireType::SetNick.  Handlers get the body with whitespace trimmed.
+    using CommandHandler = void (ChatShard::*)(HSteamNetConnection hConn, Client_t& client, std::string_view sArgs);
+    struct Command_t
+    {
+        WireType eType;
+        CommandHandler pfnHandler;
+    };
+    static const Command_t k_commands[];
+    void OnNickCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sNick);
+    void OnJoinCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sRoomName);
+    void OnLeaveCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sArgs);
+    void OnRoomsCommand(HSteamNetConnection hConn, Client_t& client, std::string_view sArgs);
+    // Agree on capabilities and pass the session token, if any, on to the server.
+    void OnHello(HSteamNetConnection hConn, Client_t& client, uint8 nCapabilities, std::string_view sToken);
+    // Their id and the capabilities in `nAgreed`, see WireType::Welcome.
+    void SendWelcome(HSteamNetConnection hConn, const Client_t& client, uint8 nAgreed);
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <steam/steamnetworkingtypes.h>
+#include <vector>
+
+// Dense per-connection storage keyed by HSteamNetConnection.
+// Values live contiguously in a vector, so iterating (e.g. for a broadcast) is a
+// linear scan. A small open-addressing index maps a handle to its position.
+// Iteration order is insertion order, except that Erase() moves the last entry
+// into the freed position (swap-remove), so erasing never shifts other entries.
+// Pointers returned by Find()/Insert() are invalidated by Insert() and Erase().
+template <typename T>
+class ConnectionTable
+{
+public:
+    struct Entry
+    {
+        HSteamNetConnection hConn;
+        T value;
+    };
+    using iterator = typename std::vector<Entry>::iterator;
+    using const_iterator = typename std::vector<Entry>::const_iterator;
+public:
+    T* Find(HSteamNetConnection hConn)
+    {
+        size_t nSlot = FindSlot(hConn);
+        return nSlot == k_nNotFound ? nullptr : &entries[index[nSlot].nEntry].value;
+    }
+    const T* Find(HSteamNetConnection hConn) const { return const_cast<ConnectionTable*>(this)->Find(hConn); }
+    bool Contains(HSteamNetConnection hConn) const { return FindSlot(hConn) != k_nNotFound; }
+
+    // Add a default-constructed value for a connection that is not in the table yet.
+    T& Insert(HSteamNetConnection hConn)
+    {
+        assert(hConn != k_HSteamNetConnection_Invalid);
+        assert(!Contains(hConn));
+        if ((entries.size() + 1) * 2 > index.size())
+            Rehash(index.empty() ? 16 : index.size() * 2);
+        entries.push_back(Entry{hConn, T{}});
+        size_t nSlot = HomeSlot(hConn);
+        while (index[nSlot].hConn != k_HSteamNetConnection_Invalid)
+            nSlot = (nSlot + 1) & (index.size() - 1);
+        index[nSlot] = Slot{hConn, (uint32)(entries.size() - 1)};
+        return entries.back().value;
+    }
+
+    bool Erase(HSteamNetConnection hConn)
+    {
+        size_t nSlot = FindSlot(hConn);
+        if (nSlot == k_nNotFound)
+            return false;
+
+        // Swap-remove the value and repoint the index slot of the entry that moved.
+        uint32 nEntry = index[nSlot].nEntry;
+        if (nEntry != entries.size() - 1)
+        {
+            entries[nEntry] = std::move(entries.back());
+            index[FindSlot(entries[nEntry].hConn)].nEntry = nEntry;
+        }
+        entries.pop_back();
+
+        // Backward-shift deletion keeps probe sequences intact without tombstones.
+        size_t nMask = index.size() - 1;
+        size_t nHole = nSlot;
+        for (size_t nNext = (nHole + 1) & nMask; index[nNext].hConn != k_HSteamNetConnection_Invalid;
+             nNext = (nNext + 1) & nMask)
+        {
+            size_t nHome = HomeSlot(index[nNext].hConn);
+            // Move the slot into the hole only if its home is not within (nHole, nNext].
+            if (((nNext - nHome) & nMask) >= ((nNext - nHole) & nMask))
+            {
+                index[nHole] = index[nNext];
+                nHole = nNext;
+            }
+        }
+        index[nHole] = Slot{};
+        return true;
+    }
+
+    void Clear()
+    {
+        entries.clear();
+        index.assign(index.size(), Slot{});
+    }
+    size_t Size() const { return entries.size(); }
+    bool Empty() const { return entries.empty(); }
+public:
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+private:
+    struct Slot
+    {
+        HSteamNetConnection hConn = k_HSteamNetConnection_Invalid;
+        uint32 nEntry = 0;
+    };
+    static constexpr size_t k_nNotFound = ~size_t(0);
+
+    size_t HomeSlot(HSteamNetConnection hConn) const
+    {
+        // Fibonacci hashing spreads the mostly sequential handles over the table.
+        return (size_t)(((uint64)hConn * 0x9E3779B97F4A7C15ull) >> 32) & (index.size() - 1);
+    }
+    size_t FindSlot(HSteamNetConnection hConn) const
+    {
+        if (index.empty())
+            return k_nNotFound;
+        for (size_t nSlot = HomeSlot(hConn);; nSlot = (nSlot + 1) & (index.size() - 1))
+        {
+            if (index[nSlot].hConn == hConn)
+                return nSlot;
+            if (index[nSlot].hConn == k_HSteamNetConnection_Invalid)
+                return k_nNotFound;
+        }
+    }
+    void Rehash(size_t nNewSize)
+    {
+        index.assign(nNewSize, Slot{});
+        for (uint32 nEntry = 0; nEntry < entries.size(); ++nEntry)
+        {
+            size_t nSlot = HomeSlot(entries[nEntry].hConn);
+            while (index[nSlot].hConn != k_HSteamNetConnection_Invalid)
+                nSlot = (nSlot + 1) & (index.size() - 1);
+            index[nSlot] = Slot{entries[nEntry].hConn, nEntry};
+        }
+    }
+private:
+    std::vector<Entry> entries;
+    std::vector<Slot> index; // Power-of-two sized, at most half full.
+};
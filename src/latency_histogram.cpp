@@ -0,0 +1,78 @@
+#include "latency_histogram.h"
+#include <algorithm>
+#include <bit>
+
+int LatencyHistogram::BucketIndex(uint64 nValue)
+{
+    if (nValue < k_nSubBuckets)
+        return (int)nValue;
+    int nExponent = std::bit_width(nValue) - 1; // >= k_nSubBucketBits
+    int nSubBucket = (int)((nValue >> (nExponent - k_nSubBucketBits)) & (k_nSubBuckets - 1));
+    return (nExponent - k_nSubBucketBits + 1) * k_nSubBuckets + nSubBucket;
+}
+
+uint64 LatencyHistogram::BucketMidpoint(int nIndex)
+{
+    if (nIndex < k_nSubBuckets)
+        return (uint64)nIndex;
+    int nExponent = nIndex / k_nSubBuckets + k_nSubBucketBits - 1;
+    int nShift = nExponent - k_nSubBucketBits;
+    uint64 nLower = (uint64)(k_nSubBuckets + nIndex % k_nSubBuckets) << nShift;
+    return nLower + (((uint64)1 << nShift) >> 1);
+}
+
+void LatencyHistogram::Add(int nIndex, uint64 nCount)
+{
+    // Single writer, so a relaxed load/store pair is enough and avoids a locked instruction.
+    auto& bucket = buckets[nIndex];
+    bucket.store(bucket.load(std::memory_order_relaxed) + nCount, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Record(uint64 nValue)
+{
+    Add(BucketIndex(nValue), 1);
+    if (nValue > nMax.load(std::memory_order_relaxed))
+        nMax.store(nValue, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (int i = 0; i < k_nBuckets; ++i)
+    {
+        uint64 nCount = other.buckets[i].load(std::memory_order_relaxed);
+        if (nCount)
+            Add(i, nCount);
+    }
+    nMax.store(std::max(GetMax(), other.GetMax()), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto& bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    nMax.store(0, std::memory_order_relaxed);
+}
+
+uint64 LatencyHistogram::GetCount() const
+{
+    uint64 nCount = 0;
+    for (auto& bucket : buckets)
+        nCount += bucket.load(std::memory_order_relaxed);
+    return nCount;
+}
+
+uint64 LatencyHistogram::GetPercentile(double flPercentile) const
+{
+    uint64 nCount = GetCount();
+    if (nCount == 0)
+        return 0;
+    uint64 nRank = std::max<uint64>(1, (uint64)(flPercentile / 100.0 * (double)nCount + 0.5));
+    uint64 nSeen = 0;
+    for (int i = 0; i < k_nBuckets; ++i)
+    {
+        nSeen += buckets[i].load(std::memory_order_relaxed);
+        if (nSeen >= nRank)
+            return std::min(BucketMidpoint(i), GetMax());
+    }
+    return GetMax();
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <steam/steamnetworkingtypes.h>
+
+// HDR-style log-linear histogram of non-negative values (e.g. microseconds).
+// Every power-of-two range is split into 16 linear sub-buckets, which keeps the
+// relative error of reported percentiles below ~6% with a fixed 8 KB footprint.
+// Record() must be called from a single thread; readers may run on any thread.
+class LatencyHistogram
+{
+public:
+    void Record(uint64 nValue);
+    // Add the counts of `other` to this histogram.  Same threading rules as Record().
+    void Merge(const LatencyHistogram& other);
+    void Reset();
+    uint64 GetCount() const;
+    uint64 GetMax() const { return nMax.load(std::memory_order_relaxed); }
+    // `flPercentile` in [0, 100].  Returns 0 for an empty histogram.
+    uint64 GetPercentile(double flPercentile) const;
+private:
+    static constexpr int k_nSubBucketBits = 4;
+    static constexpr int k_nSubBuckets = 1 << k_nSubBucketBits;
+    static constexpr int k_nBuckets = (64 - k_nSubBucketBits + 1) * k_nSubBuckets;
+    static int BucketIndex(uint64 nValue);
+    static uint64 BucketMidpoint(int nIndex);
+    void Add(int nIndex, uint64 nCount);
+private:
+    std::array<std::atomic<uint64>, k_nBuckets> buckets = {};
+    std::atomic<uint64> nMax = 0;
+};
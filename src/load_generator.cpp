@@ -0,0 +1,309 @@
+#include "load_generator.h"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <my_cpp_utils/logger.h>
+#include <stdio.h>
+#include <steam/steamnetworkingsockets.h>
+#include <string_view>
+
+namespace
+{
+
+// Every generated line starts with this tag followed by the send timestamp in microseconds.
+constexpr std::string_view k_sLineTag = "LG ";
+// How long we keep listening for deliveries after we stopped sending.
+constexpr SteamNetworkingMicroseconds k_usecDrainTime = 1'000'000;
+
+} // namespace
+
+LoadGenerator* LoadGenerator::s_pCallbackInstance = nullptr;
+
+LoadGenerator::LoadGenerator(std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter, const Options& options)
+  : quitFlag(quitFlag), loopWaiter(loopWaiter), options(options)
+{
+    incomingBatch.resize(k_nIncomingBatchSize);
+    lineBuffer.resize(std::max<size_t>(options.nMessageSize, 32));
+    sendBuffer.resize(Wire::EncodedSize(lineBuffer.size()));
+}
+
+void LoadGenerator::Run(const SteamNetworkingIPAddr& serverAddr)
+{
+    pInterface = SteamNetworkingSockets();
+    pUtils = SteamNetworkingUtils();
+
+    hPollGroup = pInterface->CreatePollGroup();
+    if (hPollGroup == k_HSteamNetPollGroup_Invalid)
+        MY_LOG(error, "[LoadGenerator] Failed to create poll group");
+
+    char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+    serverAddr.ToString(szAddr, sizeof(szAddr), true);
+    MY_LOG_FMT(
+        info,
+        "[LoadGenerator] Opening {} connections to {}. Rate {} lines/s per client, {} bytes per line, {} s, "
+        "{} typing indicators/s per client.",
+        options.nClients, szAddr, options.flRatePerClient, options.nMessageSize, options.nDurationSec,
+        options.flTypingRatePerClient);
+
+    SteamNetworkingConfigValue_t opt;
+    opt.SetPtr(
+        k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+    for (int i = 0; i < options.nClients; ++i)
+    {
+        HSteamNetConnection hConn = pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
+        if (hConn == k_HSteamNetConnection_Invalid)
+        {
+            ++totals.nFailedConnections;
+            continue;
+        }
+        // All simulated clients share one poll group, so receiving is one call per batch.
+        pInterface->SetConnectionPollGroup(hConn, hPollGroup);
+        connections.push_back(hConn);
+    }
+
+    SteamNetworkingMicroseconds usecStart = pUtils->GetLocalTimestamp();
+    SteamNetworkingMicroseconds usecStopSending =
+        usecStart + (SteamNetworkingMicroseconds)options.nDurationSec * 1'000'000;
+    usecLastSend = usecStart;
+    usecLastTyping = usecStart;
+    while (!quitFlag)
+    {
+        SteamNetworkingMicroseconds usecNow = pUtils->GetLocalTimestamp();
+        if (usecNow >= usecStopSending + k_usecDrainTime)
+            break;
+
+        int nWork = PollIncomingMessages();
+        nWork += PollConnectionStateChanges();
+        if (usecNow < usecStopSending)
+        {
+            nWork += SendDueLines(usecNow);
+            nWork += SendDueTyping(usecNow);
+        }
+        loopWaiter.Wait(nWork > 0);
+    }
+
+    for (HSteamNetConnection hConn : connections)
+        pInterface->CloseConnection(hConn, 0, "Load test finished", false);
+    connections.clear();
+    connectedClients.Clear();
+
+    pInterface->DestroyPollGroup(hPollGroup);
+    hPollGroup = k_HSteamNetPollGroup_Invalid;
+
+    PrintReport(std::min<double>(options.nDurationSec, (double)(pUtils->GetLocalTimestamp() - usecStart) / 1e6));
+}
+
+int LoadGenerator::PollIncomingMessages()
+{
+    int nMessages = 0;
+    while (!quitFlag)
+    {
+        int numMsgs = pInterface->ReceiveMessagesOnPollGroup(hPollGroup, incomingBatch.data(), k_nIncomingBatchSize);
+        if (numMsgs <= 0)
+        {
+            if (numMsgs < 0)
+                MY_LOG(error, "[LoadGenerator] Error checking for messages");
+            break;
+        }
+        nMessages += numMsgs;
+
+        SteamNetworkingMicroseconds usecNow = pUtils->GetLocalTimestamp();
+        for (int i = 0; i < numMsgs; ++i)
+        {
+            HandleIncomingMessage(incomingBatch[i], usecNow);
+            incomingBatch[i]->Release();
+        }
+
+        if (numMsgs < k_nIncomingBatchSize)
+            break;
+    }
+    return nMessages;
+}
+
+void LoadGenerator::HandleIncomingMessage(
+    const ISteamNetworkingMessage* pIncomingMsg, SteamNetworkingMicroseconds usecNow)
+{
+    totals.nBytesReceived += pIncomingMsg->m_cbSize;
+
+    // Relayed lines are Chat envelopes with a body of "LG <usec> xxx...".  Everything else is
+    // welcome text, nick maps and join notices.
+    auto handleMessage = [&](const WireMessage& msg)
+    {
+        if (msg.eType == WireType::Welcome && !connectedClients.Find(pIncomingMsg->m_conn))
+        {
+            connectedClients.Insert(pIncomingMsg->m_conn);
+            totals.nPeakConnected = std::max(totals.nPeakConnected, (int)connectedClients.Size());
+        }
+        if (WireLane::Of(msg.eType) == WireLane::k_nPresence)
+        {
+            ++totals.nEphemeralReceived;
+            return;
+        }
+        const std::string_view& sText = msg.sBody;
+        SteamNetworkingMicroseconds usecSent = 0;
+        if (msg.eType != WireType::Chat || !sText.starts_with(k_sLineTag) ||
+            std::from_chars(sText.data() + k_sLineTag.size(), sText.data() + sText.size(), usecSent).ec != std::errc())
+        {
+            ++totals.nOtherMessages;
+            return;
+        }
+
+        ++totals.nDeliveries;
+        deliveryLatency.Record((uint64)std::max<SteamNetworkingMicroseconds>(0, usecNow - usecSent));
+    };
+    if (!Wire::ForEachMessage(pIncomingMsg->m_pData, (size_t)pIncomingMsg->m_cbSize, handleMessage))
+        ++totals.nOtherMessages;
+}
+
+int LoadGenerator::SendDueLines(SteamNetworkingMicroseconds usecNow)
+{
+    // Accumulate a budget proportional to the number of connected clients, but never
+    // more than one second worth of lines, so a stall does not turn into a burst.
+    double flLinesPerSec = options.flRatePerClient * (double)connectedClients.Size();
+    flSendBudget += flLinesPerSec * (double)(usecNow - usecLastSend) / 1e6;
+    flSendBudget = std::min(flSendBudget, std::max(1.0, flLinesPerSec));
+    usecLastSend = usecNow;
+
+    int nSent = 0;
+    while (flSendBudget >= 1.0 && !connectedClients.Empty())
+    {
+        flSendBudget -= 1.0;
+
+        // Round-robin over the connected clients.
+        nNextSender %= connectedClients.Size();
+        auto& [hConn, client] = *(connectedClients.begin() + (ptrdiff_t)nNextSender);
+        ++nNextSender;
+
+        int cbHeader = snprintf(lineBuffer.data(), lineBuffer.size(), "%.*s%lld ", (int)k_sLineTag.size(),
+            k_sLineTag.data(), (long long)usecNow);
+        uint32 cbLine = (uint32)std::max(cbHeader, options.nMessageSize);
+        std::fill(lineBuffer.begin() + cbHeader, lineBuffer.begin() + cbLine, 'x');
+        uint32 cbMessage = (uint32)Wire::Encode<WireType::Say>(
+            sendBuffer.data(), 0, std::string_view(lineBuffer.data(), cbLine));
+
+        pInterface->SendMessageToConnection(
+            hConn, sendBuffer.data(), cbMessage, k_nSteamNetworkingSend_Reliable, nullptr);
+        ++client.m_nLinesSent;
+        ++totals.nLinesSent;
+        totals.nBytesSent += cbMessage;
+        ++nSent;
+    }
+    return nSent;
+}
+
+int LoadGenerator::SendDueTyping(SteamNetworkingMicroseconds usecNow)
+{
+    // Same pacing as the lines, but the indicators of one tick go out in one call.
+    double flPerSec = options.flTypingRatePerClient * (double)connectedClients.Size();
+    flTypingBudget += flPerSec * (double)(usecNow - usecLastTyping) / 1e6;
+    flTypingBudget = std::min(flTypingBudget, std::max(1.0, flPerSec));
+    usecLastTyping = usecNow;
+    if (flPerSec <= 0)
+        return 0;
+
+    typingBatch.clear();
+    while (flTypingBudget >= 1.0 && !connectedClients.Empty())
+    {
+        flTypingBudget -= 1.0;
+        nNextTypist %= connectedClients.Size();
+        HSteamNetConnection hConn = (connectedClients.begin() + (ptrdiff_t)nNextTypist)->hConn;
+        ++nNextTypist;
+
+        SteamNetworkingMessage_t* pMsg = pUtils->AllocateMessage((int)Wire::EncodedSize(0));
+        Wire::Encode<WireType::Typing>((char*)pMsg->m_pData, 0, {}, WireTyping::k_nFlagTyping);
+        pMsg->m_conn = hConn;
+        pMsg->m_nFlags = WireLane::k_nPresenceSendFlags;
+        pMsg->m_idxLane = WireLane::k_nPresence;
+        typingBatch.push_back(pMsg);
+    }
+    if (!typingBatch.empty())
+        pInterface->SendMessages((int)typingBatch.size(), typingBatch.data(), nullptr);
+    totals.nTypingSent += typingBatch.size();
+    return (int)typingBatch.size();
+}
+
+void LoadGenerator::PrintReport(double flSendSeconds) const
+{
+    flSendSeconds = std::max(flSendSeconds, 1e-3);
+    printf(
+        R"report(Load generator report
+  clients:        %d requested, %d peak welcomed, %d failed
+  lines sent:     %llu (%.1f lines/s, %.1f KB/s)
+  deliveries:     %llu (%.1f lines/s), other messages: %llu
+  typing:         %llu sent, %llu received
+  bytes received: %llu (%.1f KB/s)
+  latency us:     p50 %llu, p99 %llu, p999 %llu, max %llu
+)report",
+        options.nClients, totals.nPeakConnected, totals.nFailedConnections, (unsigned long long)totals.nLinesSent,
+        (double)totals.nLinesSent / flSendSeconds, (double)totals.nBytesSent / 1024.0 / flSendSeconds,
+        (unsigned long long)totals.nDeliveries, (double)totals.nDeliveries / flSendSeconds,
+        (unsigned long long)totals.nOtherMessages, (unsigned long long)totals.nTypingSent,
+        (unsigned long long)totals.nEphemeralReceived, (unsigned long long)totals.nBytesReceived,
+        (double)totals.nBytesReceived / 1024.0 / flSendSeconds,
+        (unsigned long long)deliveryLatency.GetPercentile(50.0), (unsigned long long)deliveryLatency.GetPercentile(99.0),
+        (unsigned long long)deliveryLatency.GetPercentile(99.9), (unsigned long long)deliveryLatency.GetMax());
+    fflush(stdout);
+
+    MY_LOG_FMT(
+        info, "[LoadGenerator] Sent {} lines, {} deliveries, p50 {} us, p99 {} us, p999 {} us", totals.nLinesSent,
+        totals.nDeliveries, deliveryLatency.GetPercentile(50.0), deliveryLatency.GetPercentile(99.0),
+        deliveryLatency.GetPercentile(99.9));
+}
+
+void LoadGenerator::OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo)
+{
+    switch (pInfo->m_info.m_eState)
+    {
+    case k_ESteamNetworkingConnectionState_None:
+        // NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
+        break;
+
+    case k_ESteamNetworkingConnectionState_ClosedByPeer:
+    case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+        {
+            MY_LOG_FMT(
+                warn, "[LoadGenerator] Connection {} lost. ({})", pInfo->m_info.m_szConnectionDescription,
+                pInfo->m_info.m_szEndDebug);
+            if (pInfo->m_eOldState != k_ESteamNetworkingConnectionState_Connected)
+                ++totals.nFailedConnections;
+            connectedClients.Erase(pInfo->m_hConn);
+            connections.erase(std::remove(connections.begin(), connections.end(), pInfo->m_hConn), connections.end());
+
+            // The connection is closed in the network sense, but we still have to destroy our end.
+            pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+            break;
+        }
+
+    case k_ESteamNetworkingConnectionState_Connected:
+        pInterface->ConfigureConnectionLanes(
+            pInfo->m_hConn, WireLane::k_nCount, WireLane::k_defaultPriorities.data(),
+            WireLane::k_defaultWeights.data());
+        {
+            // They count as connected once the server has welcomed them, see HandleIncomingMessage.
+            char hello[Wire::k_cbHeader];
+            uint32 cbHello = (uint32)Wire::Encode<WireType::Hello>(
+                hello, 0, {}, options.bBatchFrames ? WireHello::k_nFlagBatch : 0);
+            pInterface->SendMessageToConnection(
+                pInfo->m_hConn, hello, cbHello, k_nSteamNetworkingSend_Reliable, nullptr);
+        }
+        break;
+
+    default:
+        // Silences -Wswitch
+        break;
+    }
+}
+
+void LoadGenerator::SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo)
+{
+    ++s_pCallbackInstance->nCallbacksThisTick;
+    s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+}
+
+int LoadGenerator::PollConnectionStateChanges()
+{
+    s_pCallbackInstance = this;
+    nCallbacksThisTick = 0;
+    pInterface->RunCallbacks();
+    return nCallbacksThisTick;
+}
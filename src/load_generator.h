@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <connection_table.h>
+#include <latency_histogram.h>
+#include <loop_waiter.h>
+#include <steam/isteamnetworkingsockets.h>
+#include <steam/isteamnetworkingutils.h>
+#include <steam/steamnetworkingtypes.h>
+#include <vector>
+#include <wire_protocol.h>
+
+// Headless load generator: opens many client connections from one process,
+// sends timestamped lines at a fixed rate and measures how long the server
+// takes to relay them to the other simulated clients.  Each client says Hello
+// when it connects and only starts sending once it has its Welcome, since the
+// server ignores everything else until then.
+class LoadGenerator
+{
+public:
+    struct Options
+    {
+        int nClients = 100;
+        double flRatePerClient = 1.0; // Lines per second sent by each connected client.
+        int nMessageSize = 64;        // Bytes per line, including the timing header.
+        int nDurationSec = 10;
+        double flTypingRatePerClient = 0; // Typing indicators per second sent by each client, on the presence lane.
+        bool bBatchFrames = true;         // Ask for WireHello::k_nFlagBatch, like the chat client does.
+    };
+private:
+    std::atomic<bool>& quitFlag;
+    LoopWaiter& loopWaiter;
+    Options options;
+    ISteamNetworkingSockets* pInterface;
+    ISteamNetworkingUtils* pUtils;
+    HSteamNetPollGroup hPollGroup;
+    std::vector<HSteamNetConnection> connections; // Everything we opened, connected or not.
+    struct Client_t
+    {
+        uint64 m_nLinesSent = 0;
+    };
+    ConnectionTable<Client_t> connectedClients; // Welcomed, and sending.
+    static constexpr int k_nIncomingBatchSize = 256;
+    std::vector<ISteamNetworkingMessage*> incomingBatch;
+    std::vector<char> lineBuffer; // The generated line.
+    std::vector<char> sendBuffer; // The line wrapped in a Say envelope.
+    double flSendBudget = 0; // Lines we are allowed to send right now.
+    size_t nNextSender = 0;
+    SteamNetworkingMicroseconds usecLastSend = 0;
+    double flTypingBudget = 0;
+    size_t nNextTypist = 0;
+    SteamNetworkingMicroseconds usecLastTyping = 0;
+    std::vector<SteamNetworkingMessage_t*> typingBatch;
+    struct Totals
+    {
+        int nPeakConnected = 0;
+        int nFailedConnections = 0;
+        uint64 nLinesSent = 0;
+        uint64 nBytesSent = 0;
+        uint64 nDeliveries = 0; // Our own lines received back through the server.
+        uint64 nOtherMessages = 0;
+        uint64 nTypingSent = 0;
+        uint64 nEphemeralReceived = 0; // Typing indicators of the others, relayed by the server.
+        uint64 nBytesReceived = 0;
+    };
+    Totals totals;
+    LatencyHistogram deliveryLatency; // Microseconds from send to delivery.
+public:
+    LoadGenerator(std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter, const Options& options);
+    void Run(const SteamNetworkingIPAddr& serverAddr);
+private:
+    int PollIncomingMessages();
+    void HandleIncomingMessage(const ISteamNetworkingMessage* pIncomingMsg, SteamNetworkingMicroseconds usecNow);
+    int SendDueLines(SteamNetworkingMicroseconds usecNow);
+    int SendDueTyping(SteamNetworkingMicroseconds usecNow);
+    void PrintReport(double flSendSeconds) const;
+private: // OnSteamNetConnectionStatusChanged stuff.
+    void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t* pInfo);
+    static LoadGenerator* s_pCallbackInstance;
+    static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t* pInfo);
+    int PollConnectionStateChanges();
+    int nCallbacksThisTick = 0;
+};
@@ -0,0 +1,55 @@
+#include "loop_waiter.h"
+#include <algorithm>
+#include <thread>
+
+LoopWaiter::LoopWaiter(const Options& options) : options(options)
+{}
+
+void LoopWaiter::Notify()
+{
+    bNotified = true;
+    if (!bSleeping)
+        return;
+
+    // Taking the lock guarantees the sleeper is inside wait_for() or has not checked bNotified yet.
+    {
+        std::lock_guard<std::mutex> lock{mutexWakeup};
+    }
+    cvWakeup.notify_one();
+}
+
+void LoopWaiter::Wait(bool bDidWork)
+{
+    if (bDidWork)
+    {
+        // Something happened, so more is likely to follow. Poll again right away.
+        currentBackoff = std::chrono::microseconds{0};
+        return;
+    }
+
+    switch (options.mode)
+    {
+    case Mode::BusyPoll:
+        std::this_thread::yield();
+        break;
+
+    case Mode::Adaptive:
+        currentBackoff = std::min(std::max(currentBackoff * 2, k_minBackoff), options.idleTimeout);
+        WaitFor(currentBackoff);
+        break;
+
+    case Mode::Blocking:
+        WaitFor(options.idleTimeout);
+        break;
+    }
+}
+
+void LoopWaiter::WaitFor(std::chrono::microseconds timeout)
+{
+    std::unique_lock<std::mutex> lock{mutexWakeup};
+    bSleeping = true;
+    cvWakeup.wait_for(lock, timeout, [this]() { return bNotified.load(); });
+    bSleeping = false;
+    if (bNotified.exchange(false))
+        currentBackoff = std::chrono::microseconds{0};
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Decides how the server/client main loop waits between iterations.
+// GameNetworkingSockets has no waitable handle for incoming data, so network
+// activity is detected by polling; everything produced inside the process
+// (console input, mailboxes, ...) can wake the loop early through Notify().
+class LoopWaiter
+{
+public:
+    enum class Mode
+    {
+        BusyPoll, // Never sleep. Lowest latency, burns one core.
+        Adaptive, // Spin while busy, back off exponentially up to the idle timeout when idle.
+        Blocking, // Sleep for the idle timeout whenever an iteration did no work.
+    };
+
+    struct Options
+    {
+        Mode mode = Mode::Adaptive;
+        std::chrono::microseconds idleTimeout = std::chrono::milliseconds(10);
+    };
+
+    LoopWaiter(const Options& options);
+public:
+    // Wake the loop if it is waiting right now, or make the next Wait() return immediately.
+    // Safe to call from any thread.
+    void Notify();
+    // Call once per loop iteration. `bDidWork` tells whether the iteration processed anything.
+    void Wait(bool bDidWork);
+    const Options& GetOptions() const { return options; }
+private:
+    void WaitFor(std::chrono::microseconds timeout);
+private:
+    static constexpr std::chrono::microseconds k_minBackoff{50};
+    Options options;
+    std::chrono::microseconds currentBackoff{0};
+    std::mutex mutexWakeup;
+    std::condition_variable cvWakeup;
+    // Notify() only takes the mutex while the loop is actually sleeping, so that
+    // producers posting to a busy loop (e.g. shard mailboxes) stay cheap.
+    std::atomic<bool> bNotified = false;
+    std::atomic<bool> bSleeping = false;
+};
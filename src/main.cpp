@@ -5,47 +5,69 @@
 // Example client/server chat application using SteamNetworkingSockets
 
 #include <app_options.h>
+#include <async_log_sink.h>
 #include <atomic>
 #include <chat_client.h>
 #include <chat_server.h>
+#include <load_generator.h>
+#include <loop_waiter.h>
 #include <my_cpp_utils/logger.h>
 #include <non_blocking_console_user_input.h>
 #include <steam/isteamnetworkingutils.h>
 #include <steam/steamnetworkingsockets.h>
 #include <steam_networking_init_RAII.h>
+#include <transcript_log.h>
 
 int main(int argc, const char* argv[])
 {
     {
         AppOptions options = ReadAppOptions(argc, argv);
 
+        // Reading a transcript needs neither the logger nor the network.
+        if (options.bTranscript)
+            return TranscriptLog::DumpSegment(options.sTranscriptSegment);
+
         // Initialize the logger
 
-        std::string logName = options.bClient ? "chat_client.log" : "chat_server.log";
+        std::string logName = options.bClient ? "chat_client.log"
+                              : options.bLoadGen ? "chat_loadgen.log"
+                                                 : "chat_server.log";
         utils::Logger::Init(logName, spdlog::level::trace);
         MY_LOG(info, "Starting chat application");
 
+        // Log lines from the networking threads go through here, so they never wait for the disk.
+        // It must outlive the library, which may still print while shutting down.
+        AsyncLogSink logSink(options.logSinkOptions);
+
         // Initialize the SteamNetworkingSockets library.
-        SteamNetworkingInitRAII::Options steamNetworkingOptions;
-        steamNetworkingOptions.debugSeverity = k_ESteamNetworkingSocketsDebugOutputType_Msg;
-        MY_LOG_FMT(info, "[SteamNetworking] debugSeverity: {}", steamNetworkingOptions.debugSeverity);
-        SteamNetworkingInitRAII steamNetworkingInitRAII(steamNetworkingOptions);
+        MY_LOG_FMT(info, "[SteamNetworking] debugSeverity: {}", options.steamNetworkingOptions.debugSeverity);
+        SteamNetworkingInitRAII steamNetworkingInitRAII(options.steamNetworkingOptions);
         SteamNetworkingInitRAII::SetDebugCallback(
-            []([[maybe_unused]] ESteamNetworkingSocketsDebugOutputType eType, const char* pszMsg)
-            { MY_LOG_FMT(info, "[DebugOutput] {}", pszMsg); });
+            [&logSink](ESteamNetworkingSocketsDebugOutputType eType, const char* pszMsg)
+            { logSink.Write(AsyncLogSink::FromDebugOutputType(eType), "[DebugOutput] ", pszMsg); });
 
-        // Start the thread to read the user input.
         std::atomic<bool> appQuitFlag = {};
-        NonBlockingConsoleUserInput nonBlockingConsoleUserInput(appQuitFlag);
+        LoopWaiter loopWaiter(options.loopWaiterOptions);
+
+        // The load generator is not interactive, so it does not read the console.
+        if (options.bLoadGen)
+        {
+            LoadGenerator loadGenerator(appQuitFlag, loopWaiter, options.loadGeneratorOptions);
+            loadGenerator.Run(options.addrServer);
+            return 0;
+        }
+
+        // Start the thread to read the user input.
+        NonBlockingConsoleUserInput nonBlockingConsoleUserInput(appQuitFlag, loopWaiter, options.consoleInputOptions);
 
         if (options.bClient)
         {
-            ChatClient client(nonBlockingConsoleUserInput, appQuitFlag);
+            ChatClient client(nonBlockingConsoleUserInput, appQuitFlag, loopWaiter);
             client.Run(options.addrServer);
         }
         else
         {
-            ChatServer server(nonBlockingConsoleUserInput, appQuitFlag);
+            ChatServer server(nonBlockingConsoleUserInput, appQuitFlag, loopWaiter, logSink, options.serverOptions);
             server.Run((uint16)options.nPort);
         }
     }
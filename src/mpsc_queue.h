@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+// Bounded lock-free multi-producer/single-consumer queue (D. Vyukov's bounded
+// ring with per-cell sequence numbers). Any thread may push, only the owner pops.
+template <typename T>
+class MpscQueue
+{
+public:
+    // `nCapacity` must be a power of two.
+    explicit MpscQueue(size_t nCapacity) : cells(new Cell[nCapacity]), nMask(nCapacity - 1)
+    {
+        assert(nCapacity >= 2 && (nCapacity & nMask) == 0);
+        for (size_t i = 0; i < nCapacity; ++i)
+            cells[i].nSequence.store(i, std::memory_order_relaxed);
+    }
+public:
+    // Returns false if the queue is full. `value` is left untouched in that case.
+    bool TryPush(T&& value)
+    {
+        size_t nPos = nEnqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = cells[nPos & nMask];
+            size_t nSequence = cell.nSequence.load(std::memory_order_acquire);
+            ptrdiff_t nDiff = (ptrdiff_t)nSequence - (ptrdiff_t)nPos;
+            if (nDiff == 0)
+            {
+                if (nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = std::move(value);
+                    cell.nSequence.store(nPos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (nDiff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                nPos = nEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only.
+    bool TryPop(T& value)
+    {
+        Cell& cell = cells[nDequeuePos & nMask];
+        size_t nSequence = cell.nSequence.load(std::memory_order_acquire);
+        if ((ptrdiff_t)nSequence - (ptrdiff_t)(nDequeuePos + 1) < 0)
+            return false;
+        value = std::move(cell.value);
+        cell.nSequence.store(nDequeuePos + nMask + 1, std::memory_order_release);
+        ++nDequeuePos;
+        return true;
+    }
+private:
+    struct Cell
+    {
+        std::atomic<size_t> nSequence;
+        T value;
+    };
+    std::unique_ptr<Cell[]> cells;
+    const size_t nMask;
+    alignas(64) std::atomic<size_t> nEnqueuePos = 0;
+    alignas(64) size_t nDequeuePos = 0;
+};
@@ -0,0 +1,44 @@
+#include "nick_registry.h"
+
+bool NickRegistry::IsValid(std::string_view sNick)
+{
+    if (sNick.empty() || sNick.size() > CompactNick::k_cbMaxNick)
+        return false;
+    for (char c : sNick)
+    {
+        if ((unsigned char)c < 0x20 || c == 0x7F)
+            return false;
+    }
+    return true;
+}
+
+NickRegistry::Result NickRegistry::Claim(uint32 nClientId, std::string_view sNick, std::string_view sReleasedNick)
+{
+    if (!IsValid(sNick))
+        return Result::Invalid;
+
+    std::lock_guard<std::mutex> lock{mutexNicks};
+    auto itNick = clientIdsByNick.find(sNick);
+    if (itNick != clientIdsByNick.end())
+        return itNick->second == nClientId ? Result::Ok : Result::Taken;
+
+    auto itReleased = clientIdsByNick.find(sReleasedNick);
+    if (itReleased != clientIdsByNick.end() && itReleased->second == nClientId)
+        clientIdsByNick.erase(itReleased);
+    clientIdsByNick.emplace(sNick, nClientId);
+    return Result::Ok;
+}
+
+void NickRegistry::Release(uint32 nClientId, std::string_view sNick)
+{
+    std::lock_guard<std::mutex> lock{mutexNicks};
+    auto itNick = clientIdsByNick.find(sNick);
+    if (itNick != clientIdsByNick.end() && itNick->second == nClientId)
+        clientIdsByNick.erase(itNick);
+}
+
+size_t NickRegistry::Size() const
+{
+    std::lock_guard<std::mutex> lock{mutexNicks};
+    return clientIdsByNick.size();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <mutex>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A nick stored inline in the client record, as its size in one byte followed by the name: exactly the
+// field a Replay body starts with, so putting a nick on the wire is one memcpy.  Never allocates.
+class CompactNick
+{
+public:
+    static constexpr size_t k_cbMaxNick = 32;
+private:
+    std::array<char, 1 + k_cbMaxNick + 1> bytes = {}; // Size, name, and a terminator for c_str().
+public:
+    CompactNick() = default;
+    explicit CompactNick(std::string_view sNick) { Assign(sNick); }
+    // Longer names are cut to k_cbMaxNick.
+    void Assign(std::string_view sNick)
+    {
+        size_t cbNick = std::min(sNick.size(), k_cbMaxNick);
+        bytes[0] = (char)cbNick;
+        sNick.copy(bytes.data() + 1, cbNick);
+        bytes[1 + cbNick] = '\0';
+    }
+    size_t Size() const { return (uint8)bytes[0]; }
+    std::string_view View() const { return {bytes.data() + 1, Size()}; }
+    const char* c_str() const { return bytes.data() + 1; }
+    // The size byte and the name, see Wire::AppendReplay.
+    std::string_view GetWireField() const { return {bytes.data(), 1 + Size()}; }
+};
+
+// Server-wide index of the nicks in use, so that no two clients go by the same one.  Any shard may
+// rename its clients, hence the lock, held for one hash lookup and at most one insert and one erase.
+class NickRegistry
+{
+public:
+    enum class Result
+    {
+        Ok,      // The nick is theirs now, or already was.
+        Invalid, // Empty, longer than CompactNick::k_cbMaxNick, or with control characters.
+        Taken,   // Somebody else has it.
+    };
+public:
+    static bool IsValid(std::string_view sNick);
+    // Thread-safe.  Give `sNick` to `nClientId` if nobody else has it, and free `sReleasedNick` if that
+    // was theirs.
+    Result Claim(uint32 nClientId, std::string_view sNick, std::string_view sReleasedNick = {});
+    // Thread-safe.  Free `sNick` if it belongs to `nClientId`.
+    void Release(uint32 nClientId, std::string_view sNick);
+    size_t Size() const;
+private:
+    // Lets a string_view look up a std::string key without building one.
+    struct NickHash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view sNick) const { return std::hash<std::string_view>{}(sNick); }
+    };
+    mutable std::mutex mutexNicks;
+    std::unordered_map<std::string, uint32, NickHash, std::equal_to<>> clientIdsByNick;
+};
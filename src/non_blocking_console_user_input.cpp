@@ -1,56 +1,327 @@
 #include "non_blocking_console_user_input.h"
 #include "my_cpp_utils/logger.h"
 #include "my_cpp_utils/string_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <memory>
-#include <mutex>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <thread>
+#include <unistd.h>
 
-NonBlockingConsoleUserInput::NonBlockingConsoleUserInput(std::atomic<bool>& quitFlag_) : quitFlag(quitFlag_)
+NonBlockingConsoleUserInput::NonBlockingConsoleUserInput(
+    std::atomic<bool>& quitFlag_, LoopWaiter& loopWaiter_, const Options& options_)
+  : options(options_), quitFlag(quitFlag_), loopWaiter(loopWaiter_)
 {
-    pThreadUserInput = std::make_unique<std::thread>(
-        [this]()
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeFd < 0)
+        MY_LOG_FMT(error, "[Console] eventfd failed: {}", strerror(errno));
+    if (!options.sAdminSocketPath.empty())
+        OpenAdminSocket();
+
+    sources.push_back(Source_t{STDIN_FILENO, k_nConsole, false, false, false, {}, {}});
+    pThreadUserInput = std::make_unique<std::thread>([this]() { RunReader(); });
+}
+
+NonBlockingConsoleUserInput::~NonBlockingConsoleUserInput()
+{
+    quitFlag = true;
+
+    if (pThreadUserInput)
+    {
+        // Unlike a thread stuck in fgets(), the reader wakes up for this.
+        uint64 nOne = 1;
+        if (write(wakeFd, &nOne, sizeof(nOne)) < 0)
+            MY_LOG_FMT(warn, "[Console] Failed to wake the reader: {}", strerror(errno));
+        pThreadUserInput->join();
+    }
+
+    for (Source_t& source : sources)
+    {
+        if (source.nSource != k_nConsole)
+            close(source.fd);
+    }
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        unlink(options.sAdminSocketPath.c_str());
+    }
+    if (wakeFd >= 0)
+        close(wakeFd);
+}
+
+bool NonBlockingConsoleUserInput::GetNext(std::string& result, uint32* pnSource)
+{
+    while (Line_t* pLine = lines.Front())
+    {
+        if (pLine->bHangup)
+        {
+            // Replies are written in order, so this comes after the answers to all they sent.
+            QueueReply(pLine->nSource, {}, true);
+            lines.Pop();
+            continue;
+        }
+        result.assign(pLine->szLine, pLine->cbLine);
+        if (pnSource)
+            *pnSource = pLine->nSource;
+        lines.Pop();
+        return true;
+    }
+    return false;
+}
+
+void NonBlockingConsoleUserInput::Reply(uint32 nSource, std::string_view sText)
+{
+    if (nSource != k_nConsole)
+        QueueReply(nSource, sText, false);
+}
+
+void NonBlockingConsoleUserInput::QueueReply(uint32 nSource, std::string_view sText, bool bClose)
+{
+    Reply_t* pReply = replies.BeginPush();
+    if (!pReply)
+    {
+        MY_LOG_FMT(warn, "[Console] Too many replies queued, dropped one for admin connection {}", nSource);
+        return;
+    }
+    pReply->nSource = nSource;
+    pReply->bClose = bClose;
+    pReply->sText.assign(sText);
+    replies.CommitPush();
+
+    uint64 nOne = 1;
+    if (write(wakeFd, &nOne, sizeof(nOne)) < 0 && errno != EAGAIN)
+        MY_LOG_FMT(warn, "[Console] Failed to wake the reader: {}", strerror(errno));
+}
+
+void NonBlockingConsoleUserInput::OpenAdminSocket()
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (options.sAdminSocketPath.size() >= sizeof(addr.sun_path))
+    {
+        MY_LOG_FMT(error, "[Console] Admin socket path '{}' is too long", options.sAdminSocketPath);
+        return;
+    }
+    options.sAdminSocketPath.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        MY_LOG_FMT(error, "[Console] Failed to create the admin socket: {}", strerror(errno));
+        return;
+    }
+    // A stale socket file from a previous run would make bind() fail.
+    unlink(options.sAdminSocketPath.c_str());
+    // Whoever can connect can kick anybody, so only our own user.  The file must never exist with looser
+    // permissions, not even between bind() and a chmod().  The mask is process-wide, but nothing else creates
+    // files this early, before the server starts.
+    mode_t oldMask = umask(S_IRWXG | S_IRWXO);
+    int nBindResult = bind(listenFd, (const sockaddr*)&addr, sizeof(addr));
+    umask(oldMask);
+    if (nBindResult < 0 || listen(listenFd, 16) < 0)
+    {
+        MY_LOG_FMT(
+            error, "[Console] Failed to listen on admin socket '{}': {}", options.sAdminSocketPath, strerror(errno));
+        close(listenFd);
+        listenFd = -1;
+        return;
+    }
+    MY_LOG_FMT(info, "[Console] Admin commands accepted on '{}'", options.sAdminSocketPath);
+}
+
+void NonBlockingConsoleUserInput::RunReader()
+{
+    std::vector<pollfd> pollFds;
+    std::vector<uint32> polledSources; // Which source each entry after the fixed ones is.
+    while (!quitFlag)
+    {
+        pollFds.clear();
+        polledSources.clear();
+        pollFds.push_back(pollfd{wakeFd, POLLIN, 0});
+        pollFds.push_back(pollfd{listenFd, POLLIN, 0}); // Ignored by poll() while it is -1.
+        for (Source_t& source : sources)
+        {
+            short nEvents = (source.bReadClosed ? 0 : POLLIN) | (source.pendingOutput.empty() ? 0 : POLLOUT);
+            if (!nEvents)
+                continue;
+            pollFds.push_back(pollfd{source.fd, nEvents, 0});
+            polledSources.push_back(source.nSource);
+        }
+
+        if (poll(pollFds.data(), (nfds_t)pollFds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            MY_LOG_FMT(error, "[Console] poll failed: {}", strerror(errno));
+            break;
+        }
+        if (pollFds[0].revents)
         {
-            while (!quitFlag)
+            uint64 nCount;
+            while (read(wakeFd, &nCount, sizeof(nCount)) > 0)
+                ;
+            WriteReplies();
+        }
+        if (quitFlag)
+            break;
+        if (pollFds[1].revents)
+            AcceptAdminConnection();
+
+        for (size_t i = 0; i < polledSources.size(); ++i)
+        {
+            if (!pollFds[2 + i].revents)
+                continue;
+            auto itSource = std::find_if(
+                sources.begin(), sources.end(), [&](const Source_t& s) { return s.nSource == polledSources[i]; });
+            if (itSource == sources.end())
+                continue;
+            if (!itSource->pendingOutput.empty() && (pollFds[2 + i].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+                !FlushOutput(*itSource))
+            {
+                close(itSource->fd);
+                sources.erase(itSource);
+                continue;
+            }
+            if (itSource->bReadClosed || !(pollFds[2 + i].revents & (POLLIN | POLLERR | POLLHUP)) ||
+                ReadFrom(*itSource))
+                continue;
+
+            itSource->bReadClosed = true;
+            if (itSource->nSource != k_nConsole)
             {
-                char szLine[4000];
-                if (!fgets(szLine, sizeof(szLine), stdin))
-                {
-                    // Well, you would hope that you could close the handle
-                    // from the other thread to trigger this.  Nope.
-                    if (quitFlag)
-                        return;
-                    quitFlag = true;
-                    MY_LOG(warn, "Failed to read on stdin, quitting");
-                    break;
-                }
-
-                mutexUserInputQueue.lock();
-                queueUserInput.push(std::string(szLine));
-                mutexUserInputQueue.unlock();
+                // Their connection stays open for the replies, see GetNext().
+                PushLine(*itSource, true);
             }
-        });
+            else if (listenFd < 0)
+            {
+                // Nothing else could ever give us a command.
+                quitFlag = true;
+                loopWaiter.Notify();
+                MY_LOG(warn, "Failed to read on stdin, quitting");
+                return;
+            }
+        }
+    }
 }
 
-NonBlockingConsoleUserInput::~NonBlockingConsoleUserInput()
+void NonBlockingConsoleUserInput::AcceptAdminConnection()
 {
-    quitFlag = true;
+    int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+    {
+        MY_LOG_FMT(warn, "[Console] Failed to accept an admin connection: {}", strerror(errno));
+        return;
+    }
+    sources.push_back(Source_t{fd, nNextSource++, false, false, false, {}, {}});
+}
+
+bool NonBlockingConsoleUserInput::ReadFrom(Source_t& source)
+{
+    char buffer[4096];
+    ssize_t cbRead = read(source.fd, buffer, sizeof(buffer));
+    if (cbRead < 0 && (errno == EINTR || errno == EAGAIN))
+        return true;
+    if (cbRead <= 0)
+    {
+        // A last line without its newline still counts.
+        if (!source.partialLine.empty())
+            PushLine(source);
+        return false;
+    }
 
-    if (!pThreadUserInput)
+    for (std::string_view sData(buffer, (size_t)cbRead); !sData.empty();)
+    {
+        size_t nEnd = sData.find('\n');
+        std::string_view sPart = sData.substr(0, nEnd);
+        if (!source.bDiscarding)
+        {
+            size_t cbRoom = k_cbMaxLine - source.partialLine.size();
+            source.partialLine.append(sPart.substr(0, cbRoom));
+            source.bDiscarding = sPart.size() > cbRoom;
+        }
+        if (nEnd == std::string_view::npos)
+            break;
+        PushLine(source);
+        source.bDiscarding = false;
+        sData.remove_prefix(nEnd + 1);
+    }
+    return true;
+}
+
+void NonBlockingConsoleUserInput::PushLine(Source_t& source, bool bHangup)
+{
+    // Trimmed here rather than on the main loop.  Blank lines are ignored.
+    utils::Trim(source.partialLine);
+    if (source.partialLine.empty() && !bHangup)
         return;
 
-    pThreadUserInput->join();
+    Line_t* pLine;
+    while (!(pLine = lines.BeginPush()))
+    {
+        // The main loop drains the ring every iteration, so this is a long batch arriving.
+        if (quitFlag)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pLine->nSource = source.nSource;
+    pLine->bHangup = bHangup;
+    pLine->cbLine = bHangup ? 0 : (uint32)source.partialLine.size();
+    memcpy(pLine->szLine, source.partialLine.data(), pLine->cbLine);
+    lines.CommitPush();
+    source.partialLine.clear();
+    loopWaiter.Notify();
+}
+
+void NonBlockingConsoleUserInput::WriteReplies()
+{
+    while (Reply_t* pReply = replies.Front())
+    {
+        auto itSource = std::find_if(
+            sources.begin(), sources.end(), [&](const Source_t& s) { return s.nSource == pReply->nSource; });
+        if (itSource != sources.end())
+        {
+            bool bKeep = true;
+            if (pReply->bClose)
+                itSource->bCloseWhenFlushed = true;
+            else if (itSource->pendingOutput.size() + pReply->sText.size() + 1 > k_cbMaxPendingOutput)
+            {
+                MY_LOG_FMT(
+                    warn, "[Console] Admin connection {} is not reading its replies, dropping it", pReply->nSource);
+                bKeep = false;
+            }
+            else
+            {
+                itSource->pendingOutput += pReply->sText;
+                itSource->pendingOutput += '\n';
+            }
+            if (!bKeep || !FlushOutput(*itSource))
+            {
+                close(itSource->fd);
+                sources.erase(itSource);
+            }
+        }
+        replies.Pop();
+    }
 }
 
-bool NonBlockingConsoleUserInput::GetNext(std::string& result)
+bool NonBlockingConsoleUserInput::FlushOutput(Source_t& source)
 {
-    bool got_input = false;
-    std::lock_guard<std::mutex> lock{mutexUserInputQueue};
-    while (!queueUserInput.empty() && !got_input)
+    while (!source.pendingOutput.empty())
     {
-        result = queueUserInput.front();
-        queueUserInput.pop();
-        utils::Trim(result);
-        got_input = !result.empty(); // ignore blank lines
+        // MSG_NOSIGNAL: an admin who hung up early must not take the server down with SIGPIPE.
+        ssize_t cbSent = send(source.fd, source.pendingOutput.data(), source.pendingOutput.size(), MSG_NOSIGNAL);
+        if (cbSent < 0 && errno == EINTR)
+            continue;
+        if (cbSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true; // The rest goes when poll() says it can.
+        if (cbSent <= 0)
+            return false;
+        source.pendingOutput.erase(0, (size_t)cbSent);
     }
-    return got_input;
+    return !source.bCloseWhenFlushed;
 }
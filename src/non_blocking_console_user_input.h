@@ -1,17 +1,85 @@
 #pragma once
-#include <mutex>
-#include <queue>
+#include <atomic>
+#include <loop_waiter.h>
+#include <memory>
+#include <spsc_queue.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+// Reads command lines on a thread of its own: from stdin, and from the clients of a local admin socket
+// if there is one (a Unix domain socket, e.g. `printf '/stats\n/kick bob\n' | socat - UNIX-CONNECT:PATH`).
+// Lines reach the main loop already trimmed, through a lock-free ring of preallocated slots, and each one
+// wakes the loop through its LoopWaiter.  Replies to admin connections go back through a second ring;
+// the reader thread sleeps in poll() and an eventfd wakes it for them, and for shutdown.  It never blocks
+// on an admin connection: what they do not read yet waits in a buffer of their own, and a connection
+// that lets k_cbMaxPendingOutput pile up is dropped.
 class NonBlockingConsoleUserInput
 {
-    std::mutex mutexUserInputQueue;
-    std::queue<std::string> queueUserInput;
-    std::unique_ptr<std::thread> pThreadUserInput;
+public:
+    struct Options
+    {
+        std::string sAdminSocketPath; // Empty means no admin socket.
+    };
+    static constexpr uint32 k_nConsole = 0; // Where the lines typed on stdin come from.
+private:
+    static constexpr size_t k_cbMaxLine = 4000; // Longer lines are cut.
+    static constexpr size_t k_cbMaxPendingOutput = 256 * 1024; // Unread replies per admin connection.
+    struct Line_t
+    {
+        uint32 nSource = k_nConsole;
+        bool bHangup = false; // Admin connection `nSource` sent all it will send.
+        uint32 cbLine = 0;
+        char szLine[k_cbMaxLine];
+    };
+    struct Reply_t
+    {
+        uint32 nSource = k_nConsole;
+        bool bClose = false; // Close the connection, everything before has been answered.
+        std::string sText;   // Keeps its capacity from one round of the ring to the next.
+    };
+    // Stdin or one admin connection.  Reader thread only.
+    struct Source_t
+    {
+        int fd = -1;
+        uint32 nSource = k_nConsole;
+        bool bReadClosed = false;
+        bool bDiscarding = false; // The line is too long, skip to its end.
+        bool bCloseWhenFlushed = false;
+        std::string partialLine;
+        std::string pendingOutput; // Replies the socket would not take yet.
+    };
+    Options options;
     std::atomic<bool>& quitFlag;
+    LoopWaiter& loopWaiter;
+    SpscQueue<Line_t> lines{256};
+    SpscQueue<Reply_t> replies{1024};
+    int wakeFd = -1; // eventfd, written by the main loop.
+    int listenFd = -1;
+    std::vector<Source_t> sources;
+    uint32 nNextSource = k_nConsole + 1;
+    std::unique_ptr<std::thread> pThreadUserInput;
 public:
-    NonBlockingConsoleUserInput(std::atomic<bool>& quitFlag);
+    NonBlockingConsoleUserInput(std::atomic<bool>& quitFlag, LoopWaiter& loopWaiter, const Options& options = {});
     ~NonBlockingConsoleUserInput();
-public:
-    // Read the next line of input from stdin, if anything is available.
-    bool GetNext(std::string& result);
+public: // Main loop only.
+    // The next non-blank line, if anything is available.  `pnSource` tells where it came from,
+    // k_nConsole or an admin connection to Reply() to.
+    bool GetNext(std::string& result, uint32* pnSource = nullptr);
+    // Send one line back to an admin connection.  Nothing is sent to the console.
+    void Reply(uint32 nSource, std::string_view sText);
+private:
+    void QueueReply(uint32 nSource, std::string_view sText, bool bClose);
+    void OpenAdminSocket();
+    void RunReader();
+    void AcceptAdminConnection();
+    // Returns false once nothing more will come from the source.
+    bool ReadFrom(Source_t& source);
+    void PushLine(Source_t& source, bool bHangup = false);
+    void WriteReplies();
+    // Send as much of the source's pending output as it takes.  Returns false if it is done with, closed or
+    // failed, and should go.
+    bool FlushOutput(Source_t& source);
 };
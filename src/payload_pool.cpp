@@ -0,0 +1,73 @@
+#include "payload_pool.h"
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <server_stats.h>
+
+PayloadPool::PayloadPool(const Options& options)
+{
+    for (int i = 0; i < k_nSizeClasses; ++i)
+    {
+        size_t nBlocks = std::bit_floor(std::max<size_t>(16, options.cbMaxCachedPerClass / k_cbSizeClasses[i]));
+        freeLists[i] = std::make_unique<MpscQueue<void*>>(nBlocks);
+    }
+}
+
+PayloadPool::~PayloadPool()
+{
+    // Nobody else can touch the free lists any more.
+    for (auto& pFreeList : freeLists)
+    {
+        void* pBlock;
+        while (pFreeList->TryPop(pBlock))
+            ::operator delete(pBlock);
+    }
+}
+
+void* PayloadPool::Allocate(size_t cbBlock, int& nClass)
+{
+    nClass = SizeClassOf(cbBlock);
+    if (nClass == k_nNoClass)
+        return ::operator new(cbBlock);
+
+    nRefs.fetch_add(1, std::memory_order_relaxed);
+    void* pBlock;
+    if (freeLists[nClass]->TryPop(pBlock))
+    {
+        AddRelaxed(stats.nHits, 1);
+        return pBlock;
+    }
+    AddRelaxed(stats.nMisses, 1);
+    return ::operator new(k_cbSizeClasses[nClass]);
+}
+
+void PayloadPool::Free(void* pBlock, int nClass)
+{
+    if (nClass == k_nNoClass)
+    {
+        ::operator delete(pBlock);
+        return;
+    }
+    if (!freeLists[nClass]->TryPush(std::move(pBlock)))
+    {
+        ::operator delete(pBlock);
+        stats.nReleasedToHeap.fetch_add(1, std::memory_order_relaxed);
+    }
+    DropRef();
+}
+
+void PayloadPool::DropRef()
+{
+    if (nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+int PayloadPool::SizeClassOf(size_t cbBlock)
+{
+    for (int i = 0; i < k_nSizeClasses; ++i)
+    {
+        if (cbBlock <= k_cbSizeClasses[i])
+            return i;
+    }
+    return k_nNoClass;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mpsc_queue.h>
+#include <steam/steamnetworkingtypes.h>
+
+// Size-class free lists for SharedPayload blocks.  One thread (the owner) allocates;
+// any thread may give blocks back, because the library frees sent messages on its own
+// threads.  In steady state the send path therefore never calls the general allocator.
+//
+// Blocks can come back after the owner is gone (e.g. while the library lingers on
+// shutdown), so the pool is reference counted by its outstanding blocks: the owner's
+// PayloadPool::Ptr drops its reference, and the last returned block deletes the pool.
+class PayloadPool
+{
+public:
+    struct Options
+    {
+        size_t cbMaxCachedPerClass = 4 << 20; // Free bytes kept per size class, the rest goes back to the heap.
+    };
+    static constexpr size_t k_cbSizeClasses[] = {128, 512, 2048, 8192, 32768, 131072};
+    static constexpr int k_nSizeClasses = (int)std::size(k_cbSizeClasses);
+    static constexpr int k_nNoClass = -1; // Too big for any class, straight from the heap.
+    struct Stats
+    {
+        std::atomic<uint64> nHits = 0;   // Blocks handed out from a free list.
+        std::atomic<uint64> nMisses = 0; // Blocks that had to come from the heap.
+        std::atomic<uint64> nReleasedToHeap = 0; // Returned blocks that did not fit in the free list.
+    };
+    struct Releaser
+    {
+        void operator()(PayloadPool* pPool) const { pPool->DropRef(); }
+    };
+    using Ptr = std::unique_ptr<PayloadPool, Releaser>;
+private:
+    std::array<std::unique_ptr<MpscQueue<void*>>, k_nSizeClasses> freeLists;
+    std::atomic<int64> nRefs = 1; // The owner, plus one per outstanding block.
+    Stats stats;
+public:
+    static Ptr Create(const Options& options) { return Ptr(new PayloadPool(options)); }
+    // Owner thread only.  `nClass` receives what Free needs to know.
+    void* Allocate(size_t cbBlock, int& nClass);
+    // Any thread.
+    void Free(void* pBlock, int nClass);
+    const Stats& GetStats() const { return stats; }
+private:
+    PayloadPool(const Options& options);
+    ~PayloadPool();
+    void DropRef();
+    static int SizeClassOf(size_t cbBlock);
+};
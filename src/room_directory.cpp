@@ -0,0 +1,177 @@
+#include "room_directory.h"
+#include <algorithm>
+#include <cctype>
+#include <my_cpp_utils/logger.h>
+
+RoomDirectory::RoomDirectory(const Options& options, const RoomHistory::Options& historyOptions)
+  : options(options), historyOptions(historyOptions)
+{
+    FindOrCreate("lobby");
+    lastSample = std::chrono::steady_clock::now();
+}
+
+bool RoomDirectory::IsValidName(std::string_view sName)
+{
+    if (sName.empty() || sName.size() > k_nMaxRoomNameLength)
+        return false;
+    for (char c : sName)
+    {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-')
+            return false;
+    }
+    return true;
+}
+
+RoomDirectory::Room_t* RoomDirectory::FindOrCreate(std::string_view sName)
+{
+    if (!IsValidName(sName))
+        return nullptr;
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    return FindOrCreateLocked(sName);
+}
+
+RoomDirectory::Room_t* RoomDirectory::Enter(std::string_view sName)
+{
+    if (!IsValidName(sName))
+        return nullptr;
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    Room_t* pRoom = FindOrCreateLocked(sName);
+    if (pRoom)
+        ++pRoom->m_nMembers;
+    return pRoom;
+}
+
+RoomDirectory::Room_t& RoomDirectory::Enter(uint32 nId)
+{
+    Room_t& room = Get(nId);
+    ++room.m_nMembers;
+    return room;
+}
+
+RoomDirectory::Room_t* RoomDirectory::FindOrCreateLocked(std::string_view sName)
+{
+    auto itRoom = roomIdsByName.find(std::string(sName));
+    if (itRoom != roomIdsByName.end())
+        return rooms[itRoom->second].get();
+    if (rooms.size() - freeIds.size() >= options.nMaxRooms)
+        return nullptr;
+
+    Room_t* pRoom;
+    if (freeIds.empty())
+    {
+        rooms.push_back(std::make_unique<Room_t>(historyOptions));
+        pRoom = rooms.back().get();
+        pRoom->m_nId = (uint32)rooms.size() - 1;
+    }
+    else
+    {
+        pRoom = rooms[freeIds.back()].get();
+        freeIds.pop_back();
+    }
+    pRoom->m_sName = sName;
+    roomIdsByName.emplace(pRoom->m_sName, pRoom->m_nId);
+    return pRoom;
+}
+
+RoomDirectory::Room_t& RoomDirectory::Get(uint32 nId)
+{
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    return *rooms.at(nId);
+}
+
+uint32 RoomDirectory::Size() const
+{
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    return (uint32)rooms.size();
+}
+
+std::string RoomDirectory::Describe(uint32 nPage) const
+{
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    uint32 nRooms = (uint32)(rooms.size() - freeIds.size());
+    uint32 nPages = (nRooms + k_nRoomsPerPage - 1) / k_nRoomsPerPage;
+    nPage = std::clamp<uint32>(nPage, 1, nPages);
+    std::string description = MY_FMT("{} room(s), page {} of {}:", nRooms, nPage, nPages);
+    uint32 nSkip = (nPage - 1) * k_nRoomsPerPage;
+    uint32 nListed = 0;
+    for (auto& pRoom : rooms)
+    {
+        if (pRoom->m_sName.empty())
+            continue;
+        if (nSkip > 0)
+        {
+            --nSkip;
+            continue;
+        }
+        description += MY_FMT(
+            "\n  {}: {} member(s), {:.1f} msg/s", pRoom->m_sName, pRoom->m_nMembers.load(),
+            pRoom->m_flMessagesPerSec.load());
+        if (++nListed == k_nRoomsPerPage)
+            break;
+    }
+    if (nPage < nPages)
+        description += MY_FMT("\n'/rooms {}' for more.", nPage + 1);
+    return description;
+}
+
+bool RoomDirectory::UpdateRates()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<float> elapsed = now - lastSample;
+    if (elapsed < std::chrono::seconds(1))
+        return false;
+    lastSample = now;
+
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    for (auto& pRoom : rooms)
+    {
+        if (pRoom->m_sName.empty())
+            continue;
+        uint64 nMessages = pRoom->m_nMessages.load();
+        pRoom->m_flMessagesPerSec = (float)(nMessages - pRoom->m_nMessagesAtLastSample) / elapsed.count();
+        pRoom->m_nMessagesAtLastSample = nMessages;
+        pRoom->m_historyLineSamples[pRoom->m_nSamples++ % k_nHistorySamples] = pRoom->m_history.GetLineCount();
+        pRoom->m_nEmptySamples = pRoom->m_nMembers.load() == 0 ? pRoom->m_nEmptySamples + 1 : 0;
+    }
+    return true;
+}
+
+void RoomDirectory::ReclaimEmptyRooms(const std::vector<bool>& heldRooms)
+{
+    // At least two samples, so whatever was still addressed to the room when it emptied has been
+    // delivered before the id can mean another room.
+    int nLingerSamples = std::max(options.nEmptyRoomLingerSec, 2);
+    std::lock_guard<std::mutex> lock{mutexRooms};
+    for (auto& pRoom : rooms)
+    {
+        // Under the lock nobody can Enter it, and whoever is in it counts.
+        Room_t& room = *pRoom;
+        if (room.m_nId == k_nLobby || room.m_sName.empty() || room.m_nEmptySamples < nLingerSamples ||
+            room.m_nMembers.load() != 0 || (room.m_nId < heldRooms.size() && heldRooms[room.m_nId]))
+            continue;
+
+        MY_LOG_FMT(info, "[RoomDirectory] Reclaiming '{}', empty for {} s", room.m_sName, room.m_nEmptySamples);
+        roomIdsByName.erase(room.m_sName);
+        room.m_sName.clear();
+        room.m_nMessages = 0;
+        room.m_flMessagesPerSec = 0;
+        room.m_nMessagesAtLastSample = 0;
+        room.m_history.Clear();
+        room.m_historyLineSamples = {};
+        room.m_nSamples = 0;
+        room.m_nEmptySamples = 0;
+        freeIds.push_back(room.m_nId);
+    }
+}
+
+uint64 RoomDirectory::Room_t::GetHistoryLineSecondsAgo(int nSeconds) const
+{
+    if (nSeconds <= 0)
+        return m_history.GetLineCount();
+    // The newest sample may be up to a second old, so one more back is at least `nSeconds`.  Further back
+    // than the samples go, all of it.
+    uint64 nBack = (uint64)nSeconds + 1;
+    if (nBack > m_nSamples || nBack > (uint64)k_nHistorySamples)
+        return 0;
+    return m_historyLineSamples[(m_nSamples - nBack) % k_nHistorySamples];
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <room_history.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Server-wide list of chat rooms and their counters. Rooms are created on first
+// /join.  Once one has been empty for a while the server thread reclaims it, and its
+// id, Room_t and slot in the shards' member lists go to the next new room.  A Room_t is
+// never destroyed, so a pointer stays valid for the server's lifetime and the counters
+// can be updated from any shard without taking the lock; it stays the same room for as
+// long as its holder counts as a member (see Enter) or keeps a session in it.
+// Who is in which room is tracked per shard (see ChatShard), not here.
+class RoomDirectory
+{
+public:
+    struct Options
+    {
+        uint32 nMaxRooms = 1000;      // Including the lobby.  /join of a new room fails beyond this.
+        int nEmptyRoomLingerSec = 300; // How long a room nobody is in keeps its name and history.
+    };
+    static constexpr uint32 k_nLobby = 0;          // Every client starts here.
+    static constexpr uint32 k_nAllRooms = ~uint32(0); // Addresses every client regardless of room.
+    static constexpr size_t k_nMaxRoomNameLength = 32;
+    static constexpr int k_nHistorySamples = 64; // Seconds of RoomHistory::GetLineCount() kept per room.
+
+    struct Room_t
+    {
+        uint32 m_nId = 0;
+        std::string m_sName;
+        std::atomic<int> m_nMembers = 0;
+        std::atomic<uint64> m_nMessages = 0;
+        std::atomic<float> m_flMessagesPerSec = 0;
+        uint64 m_nMessagesAtLastSample = 0; // Server thread only.
+        RoomHistory m_history;
+        // Server thread only.  The history's line count at each of the last samples, the newest at
+        // m_nSamples - 1, wrapping around.
+        std::array<uint64, k_nHistorySamples> m_historyLineSamples = {};
+        uint64 m_nSamples = 0;
+        int m_nEmptySamples = 0; // Server thread only.  Samples in a row it had nobody in it.
+
+        explicit Room_t(const RoomHistory::Options& historyOptions) : m_history(historyOptions) {}
+        // Server thread only.  The history's line count at least `nSeconds` ago, or 0 if we do not know that far back.
+        uint64 GetHistoryLineSecondsAgo(int nSeconds) const;
+    };
+    static constexpr uint32 k_nRoomsPerPage = 50; // Lines of one Describe() page.
+public:
+    RoomDirectory(const Options& options, const RoomHistory::Options& historyOptions);
+    static bool IsValidName(std::string_view sName);
+    // Thread-safe.  Returns nullptr if `sName` is not a valid room name, or if there is no such room and
+    // Options::nMaxRooms are in use.
+    Room_t* FindOrCreate(std::string_view sName);
+    // Thread-safe.  The same, and count the caller as a member in the same breath, so the room cannot be
+    // reclaimed before they are in it.  They leave with --m_nMembers.
+    Room_t* Enter(std::string_view sName);
+    // Thread-safe.  The same for a room that cannot go away meanwhile: the lobby, or one a session holds.
+    Room_t& Enter(uint32 nId);
+    // Thread-safe.
+    Room_t& Get(uint32 nId);
+    // Thread-safe.  Ids run from 0 to Size() - 1, those reclaimed and not yet reused have no name.
+    uint32 Size() const;
+    // Thread-safe. One line per room with its member count and message rate, k_nRoomsPerPage of them from
+    // page `nPage`, counting from 1.
+    std::string Describe(uint32 nPage) const;
+    // Server thread only. Recomputes message rates and samples the history line counts about once per second.
+    // Returns whether it did.
+    bool UpdateRates();
+    // Server thread only.  Reclaim the rooms nobody has been in for Options::nEmptyRoomLingerSec, except
+    // those `heldRooms` marks, by id, as a client or a session is still headed for.
+    void ReclaimEmptyRooms(const std::vector<bool>& heldRooms);
+private:
+    Room_t* FindOrCreateLocked(std::string_view sName);
+    const Options options;
+    const RoomHistory::Options historyOptions;
+    mutable std::mutex mutexRooms;
+    std::vector<std::unique_ptr<Room_t>> rooms; // Indexed by id.
+    std::unordered_map<std::string, uint32> roomIdsByName;
+    std::vector<uint32> freeIds; // Reclaimed, for the next new rooms.
+    std::chrono::steady_clock::time_point lastSample;
+};
+
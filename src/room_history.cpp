@@ -0,0 +1,76 @@
+#include "room_history.h"
+#include <algorithm>
+#include <cstring>
+
+RoomHistory::RoomHistory(const Options& options) : options(options) {}
+
+void RoomHistory::Append(const void* pData, uint32 cbData)
+{
+    if (!IsEnabled() || cbData > options.cbMaxBytes)
+        return;
+
+    std::lock_guard<std::mutex> lock{mutexHistory};
+    if (ring.empty())
+    {
+        ring.resize(options.cbMaxBytes);
+        entrySizes.resize(options.nMaxLines);
+    }
+    while (nEntries == entrySizes.size() || cbUsed + cbData > ring.size())
+        DropOldest();
+
+    size_t nTail = (nHead + cbUsed) % ring.size();
+    size_t cbFirst = std::min<size_t>(cbData, ring.size() - nTail);
+    memcpy(ring.data() + nTail, pData, cbFirst);
+    memcpy(ring.data(), (const char*)pData + cbFirst, cbData - cbFirst);
+    cbUsed += cbData;
+    entrySizes[(nFirstEntry + nEntries) % entrySizes.size()] = cbData;
+    ++nEntries;
+    ++nLinesAppended;
+}
+
+size_t RoomHistory::CopySince(uint64 nLine, std::string& out) const
+{
+    std::lock_guard<std::mutex> lock{mutexHistory};
+    uint64 nOldestLine = nLinesAppended - nEntries;
+    size_t nSkipped = (size_t)std::min<uint64>(nLine > nOldestLine ? nLine - nOldestLine : 0, nEntries);
+    if (nSkipped == nEntries)
+        return 0;
+
+    // Walk past the entries they have, at most the line count of the ring.
+    size_t cbSkipped = 0;
+    for (size_t i = 0; i < nSkipped; ++i)
+        cbSkipped += entrySizes[(nFirstEntry + i) % entrySizes.size()];
+    size_t nStart = (nHead + cbSkipped) % ring.size();
+    size_t cbCopy = cbUsed - cbSkipped;
+    size_t cbFirst = std::min(cbCopy, ring.size() - nStart);
+    out.append(ring.data() + nStart, cbFirst);
+    out.append(ring.data(), cbCopy - cbFirst);
+    return nEntries - nSkipped;
+}
+
+uint64 RoomHistory::GetLineCount() const
+{
+    std::lock_guard<std::mutex> lock{mutexHistory};
+    return nLinesAppended;
+}
+
+void RoomHistory::Clear()
+{
+    std::lock_guard<std::mutex> lock{mutexHistory};
+    std::vector<char>().swap(ring);
+    std::vector<uint32>().swap(entrySizes);
+    nFirstEntry = 0;
+    nEntries = 0;
+    nHead = 0;
+    cbUsed = 0;
+    nLinesAppended = 0;
+}
+
+void RoomHistory::DropOldest()
+{
+    uint32 cbOldest = entrySizes[nFirstEntry];
+    nHead = (nHead + cbOldest) % ring.size();
+    cbUsed -= cbOldest;
+    nFirstEntry = (nFirstEntry + 1) % entrySizes.size();
+    --nEntries;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <mutex>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <vector>
+
+// The last lines said in one room, kept exactly as they go out to a newcomer, so a replay is one or
+// two memcpys and never a re-format.  Bounded by a line count and by a byte size; the bytes are allocated
+// with the room's first line and never grow.  Any shard may add a line, hence the lock, which is only
+// ever held for a copy.
+class RoomHistory
+{
+public:
+    struct Options
+    {
+        uint32 nMaxLines = 100;        // 0 turns history off.
+        uint32 cbMaxBytes = 32 * 1024; // Per room.
+    };
+private:
+    const Options options;
+    mutable std::mutex mutexHistory;
+    std::vector<char> ring;         // The entries back to back, wrapping around at the end.
+    std::vector<uint32> entrySizes; // Also a ring, of the entries' sizes, the oldest at nFirstEntry.
+    size_t nFirstEntry = 0;
+    size_t nEntries = 0;
+    size_t nHead = 0; // Where the oldest entry starts in `ring`.
+    size_t cbUsed = 0;
+    uint64 nLinesAppended = 0; // Ever, so the oldest kept entry is line nLinesAppended - nEntries.
+public:
+    explicit RoomHistory(const Options& options);
+    bool IsEnabled() const { return options.nMaxLines > 0 && options.cbMaxBytes > 0; }
+    // Thread-safe.  Store one entry, dropping the oldest ones to make room.  An entry bigger than the
+    // whole history is not stored.
+    void Append(const void* pData, uint32 cbData);
+    // Thread-safe.  Append every entry, oldest first, to `out`.  Returns how many there were.
+    size_t CopyTo(std::string& out) const { return CopySince(0, out); }
+    // Thread-safe.  The same for the entries from line `nLine` on, counting every line ever stored, e.g.
+    // those said since GetLineCount() returned `nLine`.  Those already dropped are not there.
+    size_t CopySince(uint64 nLine, std::string& out) const;
+    // Thread-safe.  Lines stored so far, whether or not they are still kept.
+    uint64 GetLineCount() const;
+    // Thread-safe.  Forget every line and give the memory back, as if new.
+    void Clear();
+private:
+    void DropOldest();
+};
@@ -0,0 +1,163 @@
+#include "server_snapshot.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <my_cpp_utils/logger.h>
+#include <random>
+#include <stdio.h>
+#include <string_view>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+void AppendLittleEndian(std::string& out, uint64 n, int cb)
+{
+    for (int i = 0; i < cb; ++i)
+        out.push_back((char)(n >> (8 * i)));
+}
+
+// Reads the fields of a snapshot in order.  Once something is out of bounds every read fails.
+class SnapshotReader
+{
+    std::string_view sLeft;
+    bool bOk = true;
+public:
+    explicit SnapshotReader(std::string_view sData) : sLeft(sData) {}
+    bool IsOk() const { return bOk; }
+    bool IsAtEnd() const { return sLeft.empty(); }
+    uint64 Number(int cb)
+    {
+        std::string_view sBytes = Bytes((size_t)cb);
+        uint64 n = 0;
+        for (size_t i = 0; i < sBytes.size(); ++i)
+            n |= (uint64)(uint8)sBytes[i] << (8 * i);
+        return n;
+    }
+    std::string_view Bytes(size_t cb)
+    {
+        if (!bOk || sLeft.size() < cb)
+        {
+            bOk = false;
+            return {};
+        }
+        std::string_view sBytes = sLeft.substr(0, cb);
+        sLeft.remove_prefix(cb);
+        return sBytes;
+    }
+};
+
+} // namespace
+
+SessionToken ServerSnapshot::NewToken()
+{
+    SessionToken token;
+    if (getrandom(token.data(), token.size(), 0) != (ssize_t)token.size())
+    {
+        std::random_device randomDevice;
+        for (char& c : token)
+            c = (char)randomDevice();
+    }
+    return token;
+}
+
+bool ServerSnapshot::Save(const std::string& sPath) const
+{
+    std::string data(k_szMagic, k_cbMagic);
+    AppendLittleEndian(data, nNextClientId, 4);
+    AppendLittleEndian(data, rooms.size(), 4);
+    for (const Room_t& room : rooms)
+    {
+        AppendLittleEndian(data, room.sName.size(), 1);
+        data += room.sName;
+        AppendLittleEndian(data, room.history.size(), 4);
+        data += room.history;
+    }
+    AppendLittleEndian(data, sessions.size(), 4);
+    for (const Session_t& session : sessions)
+    {
+        data.append(session.token.data(), session.token.size());
+        AppendLittleEndian(data, session.nClientId, 4);
+        AppendLittleEndian(data, session.nick.Size(), 1);
+        data += session.nick.View();
+        AppendLittleEndian(data, session.sRoom.size(), 1);
+        data += session.sRoom;
+    }
+
+    // Nothing but us may read it, the tokens are as good as passwords.
+    std::string sTempPath = sPath + ".tmp";
+    FILE* pFile = fopen(sTempPath.c_str(), "wb");
+    if (!pFile)
+    {
+        MY_LOG_FMT(error, "[ServerSnapshot] Cannot create {}: {}", sTempPath, strerror(errno));
+        return false;
+    }
+    fchmod(fileno(pFile), 0600);
+    bool bOk = fwrite(data.data(), 1, data.size(), pFile) == data.size() && fflush(pFile) == 0 &&
+               fsync(fileno(pFile)) == 0;
+    bOk = fclose(pFile) == 0 && bOk;
+    if (!bOk || rename(sTempPath.c_str(), sPath.c_str()) != 0)
+    {
+        MY_LOG_FMT(error, "[ServerSnapshot] Failed to write {}: {}", sPath, strerror(errno));
+        unlink(sTempPath.c_str());
+        return false;
+    }
+    MY_LOG_FMT(
+        info, "[ServerSnapshot] Saved {} session(s) and {} room(s), {} bytes, to {}", sessions.size(), rooms.size(),
+        data.size(), sPath);
+    return true;
+}
+
+bool ServerSnapshot::Load(const std::string& sPath)
+{
+    std::error_code ec;
+    if (!std::filesystem::exists(sPath, ec))
+        return false;
+
+    std::string data;
+    FILE* pFile = fopen(sPath.c_str(), "rb");
+    if (pFile)
+    {
+        char buffer[64 * 1024];
+        size_t cbRead;
+        while ((cbRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+            data.append(buffer, cbRead);
+        fclose(pFile);
+    }
+
+    SnapshotReader reader(data);
+    if (reader.Bytes(k_cbMagic) != std::string_view(k_szMagic, k_cbMagic))
+    {
+        MY_LOG_FMT(error, "[ServerSnapshot] {} is not a server snapshot", sPath);
+        return false;
+    }
+    nNextClientId = (uint32)reader.Number(4);
+    rooms.resize((size_t)std::min<uint64>(reader.Number(4), data.size()));
+    for (Room_t& room : rooms)
+    {
+        room.sName = reader.Bytes((size_t)reader.Number(1));
+        room.history = reader.Bytes((size_t)reader.Number(4));
+    }
+    sessions.resize((size_t)std::min<uint64>(reader.Number(4), data.size()));
+    for (Session_t& session : sessions)
+    {
+        std::string_view sToken = reader.Bytes(session.token.size());
+        sToken.copy(session.token.data(), sToken.size());
+        session.nClientId = (uint32)reader.Number(4);
+        session.nick.Assign(reader.Bytes((size_t)reader.Number(1)));
+        session.sRoom = reader.Bytes((size_t)reader.Number(1));
+    }
+    if (!reader.IsOk() || !reader.IsAtEnd())
+    {
+        MY_LOG_FMT(error, "[ServerSnapshot] {} is cut short or corrupt, ignoring it", sPath);
+        rooms.clear();
+        sessions.clear();
+        return false;
+    }
+    MY_LOG_FMT(
+        info, "[ServerSnapshot] Loaded {} session(s) and {} room(s) from {}", sessions.size(), rooms.size(), sPath);
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <array>
+#include <nick_registry.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <vector>
+#include <wire_protocol.h>
+
+// A secret handed to each client, with which they take back their identity when they reconnect.
+using SessionToken = std::array<char, WireHello::k_cbResumeToken>;
+
+// What a server hands over to the process that replaces it: its rooms with their history, and a session
+// for every client, so that clients coming back with their token are who they were and where they were.
+// Written on shutdown and read once on startup, see ChatServer::Options::sSnapshotFile.
+//
+// The file is "CHATSNP1" followed by, little-endian:
+//
+//   uint32 next client id | uint32 room count | rooms | uint32 session count | sessions
+//
+// A room is uint8 name size, name, uint32 history size and the history, Replay envelopes back to back.
+// A session is the token, uint32 client id, uint8 nick size, nick, uint8 room name size and room name.
+class ServerSnapshot
+{
+public:
+    struct Room_t
+    {
+        std::string sName;
+        std::string history;
+    };
+    struct Session_t
+    {
+        SessionToken token = {};
+        uint32 nClientId = 0;
+        CompactNick nick;
+        std::string sRoom;
+    };
+    static constexpr char k_szMagic[] = "CHATSNP1";
+    static constexpr size_t k_cbMagic = sizeof(k_szMagic) - 1;
+public:
+    uint32 nNextClientId = 1;
+    std::vector<Room_t> rooms;
+    std::vector<Session_t> sessions;
+public:
+    static SessionToken NewToken();
+    // Write to a temporary file next to `sPath` and rename it over `sPath`, so a reader never sees half of it.
+    bool Save(const std::string& sPath) const;
+    // Returns false if there is no such file or it is not a whole snapshot.  Only the former is quiet.
+    bool Load(const std::string& sPath);
+};
@@ -0,0 +1,30 @@
+#include "server_stats.h"
+#include <algorithm>
+#include <my_cpp_utils/logger.h>
+
+void ConnectionStatusSummary::Add(const SteamNetConnectionRealTimeStatus_t& status)
+{
+    ++nConnections;
+    nPingTotalMs += (uint64)std::max(0, status.m_nPing);
+    nPingMaxMs = std::max(nPingMaxMs, status.m_nPing);
+    cbPendingReliableTotal += (uint64)status.m_cbPendingReliable;
+    cbPendingReliableMax = std::max(cbPendingReliableMax, status.m_cbPendingReliable);
+    cbPendingUnreliableTotal += (uint64)status.m_cbPendingUnreliable;
+    usecQueueTimeMax = std::max(usecQueueTimeMax, status.m_usecQueueTime);
+}
+
+std::string HistogramToJson(const LatencyHistogram& histogram)
+{
+    return MY_FMT(
+        R"({{"count":{},"p50":{},"p99":{},"p999":{},"max":{}}})", histogram.GetCount(), histogram.GetPercentile(50.0),
+        histogram.GetPercentile(99.0), histogram.GetPercentile(99.9), histogram.GetMax());
+}
+
+std::string ConnectionStatusToJson(const ConnectionStatusSummary& summary)
+{
+    return MY_FMT(
+        R"({{"count":{},"ping_ms_avg":{},"ping_ms_max":{},"pending_reliable_bytes_total":{},"pending_reliable_bytes_max":{},"pending_unreliable_bytes_total":{},"queue_time_us_max":{}}})",
+        summary.nConnections, summary.nConnections ? summary.nPingTotalMs / summary.nConnections : 0,
+        summary.nPingMaxMs, summary.cbPendingReliableTotal, summary.cbPendingReliableMax,
+        summary.cbPendingUnreliableTotal, summary.usecQueueTimeMax);
+}
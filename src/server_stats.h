@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <latency_histogram.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+
+// Add to a counter that only one thread writes.  Readers on other threads see a
+// consistent value without the cost of a locked read-modify-write.
+inline void AddRelaxed(std::atomic<uint64>& counter, uint64 nValue)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + nValue, std::memory_order_relaxed);
+}
+
+// Counters of one loop thread (a shard, or the server thread itself).
+// Written by the owning thread only, readable from any thread.
+struct LoopStats
+{
+    std::atomic<uint64> nTicks = 0;
+    std::atomic<uint64> nSaturatedTicks = 0; // Ticks that needed more than one batch to drain the poll group.
+    std::atomic<uint64> nMaxMessagesPerTick = 0;
+    std::atomic<uint64> nMessagesIn = 0;
+    std::atomic<uint64> nBytesIn = 0;
+    std::atomic<uint64> nMessagesOut = 0;
+    std::atomic<uint64> nBytesOut = 0;
+    std::atomic<uint64> nFanouts = 0;
+    std::atomic<uint64> nRelayedMessages = 0;
+    std::atomic<uint64> nRelayAllocations = 0; // Heap allocations made while relaying those messages.
+    std::atomic<uint64> nSendBudgetHits = 0;        // Times a client went over its outbound budget.
+    std::atomic<uint64> nSendBudgetSkips = 0;       // Room lines not sent to clients over budget.
+    std::atomic<uint64> nSlowConsumerEvictions = 0; // Clients disconnected for not keeping up.
+    std::atomic<uint64> nSendFailures = 0;          // Messages the library refused because its send buffer was full.
+    std::atomic<uint64> nBatchFrames = 0;           // Coalesced messages sent, each counted once in nMessagesOut.
+    std::atomic<uint64> nBatchedLines = 0;          // Envelopes that went out inside those messages.
+    std::atomic<uint64> nMalformedMessages = 0;     // Client messages that were not exactly one valid envelope.
+    std::atomic<uint64> nEphemeralRelayed = 0;      // Typing, Presence and ReadMarker messages passed on.
+    std::atomic<uint64> nHistoryReplays = 0;        // Newcomers to a room who were sent its history.
+    std::atomic<uint64> nHistoryLinesReplayed = 0;
+    std::atomic<uint64> nFloodDrops = 0;            // Client messages dropped for being over their flood limits.
+    std::atomic<uint64> nFloodEvictions = 0;        // Clients disconnected for flooding.
+    std::atomic<uint64> nConnectionsAdmitted = 0;   // Server thread only: connections accepted from the queue.
+    std::atomic<uint64> nConnectionsRejected = 0;   // Server thread only: turned away, full or queue too long.
+    std::atomic<uint64> nSessionsResumed = 0;       // Server thread only: clients back with a session token.
+    std::atomic<uint64> nSessionsDetached = 0;      // Server thread only: clients lost, held for them to resume.
+    std::atomic<uint64> nSessionsExpired = 0;       // Server thread only: sessions nobody resumed in time.
+    LatencyHistogram fanoutWidth;              // Recipients per fan-out.
+    LatencyHistogram pollIncomingUsec;         // Time spent in PollIncomingMessages per tick.
+    LatencyHistogram callbacksUsec;            // Time spent in PollConnectionStateChanges per tick.
+    LatencyHistogram consoleUsec;              // Time spent in PollLocalUserInput per tick.
+    LatencyHistogram admissionUsec;            // Time spent in AdmitPendingConnections per tick it admitted any.
+
+    void RecordSend(uint64 nRecipients, uint64 cbMessage)
+    {
+        AddRelaxed(nMessagesOut, nRecipients);
+        AddRelaxed(nBytesOut, nRecipients * cbMessage);
+    }
+};
+
+// Records the duration of a scope, in microseconds, into a histogram.
+class ScopedPhaseTimer
+{
+public:
+    explicit ScopedPhaseTimer(LatencyHistogram& histogram)
+      : histogram(histogram), start(std::chrono::steady_clock::now())
+    {}
+    ~ScopedPhaseTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        histogram.Record((uint64)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+private:
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Aggregate of GetConnectionRealTimeStatus over many connections.
+struct ConnectionStatusSummary
+{
+    uint64 nConnections = 0;
+    uint64 nPingTotalMs = 0;
+    int nPingMaxMs = 0;
+    uint64 cbPendingReliableTotal = 0;
+    int cbPendingReliableMax = 0;
+    uint64 cbPendingUnreliableTotal = 0;
+    SteamNetworkingMicroseconds usecQueueTimeMax = 0;
+
+    void Add(const SteamNetConnectionRealTimeStatus_t& status);
+};
+
+// Formats JSON fragments for the stats report.
+std::string HistogramToJson(const LatencyHistogram& histogram);
+std::string ConnectionStatusToJson(const ConnectionStatusSummary& summary);
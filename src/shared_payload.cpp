@@ -0,0 +1,47 @@
+#include "shared_payload.h"
+#include <cstring>
+#include <new>
+
+SharedPayload* SharedPayload::Create(const void* pData, uint32 cbData, PayloadPool* pPool)
+{
+    size_t cbBlock = sizeof(SharedPayload) + cbData;
+    int nSizeClass = PayloadPool::k_nNoClass;
+    void* pMemory = pPool ? pPool->Allocate(cbBlock, nSizeClass) : ::operator new(cbBlock);
+    SharedPayload* pPayload = new (pMemory) SharedPayload(cbData, pPool, nSizeClass);
+    memcpy(reinterpret_cast<char*>(pPayload + 1), pData, cbData);
+    return pPayload;
+}
+
+void SharedPayload::AddRef()
+{
+    nRefs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedPayload::Release()
+{
+    // The library may free messages on its own service thread, hence the atomic.
+    if (nRefs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    PayloadPool* pOwner = pPool;
+    int nClass = nSizeClass;
+    this->~SharedPayload();
+    if (pOwner)
+        pOwner->Free(this, nClass);
+    else
+        ::operator delete(this);
+}
+
+void SharedPayload::AttachTo(SteamNetworkingMessage_t* pMsg)
+{
+    AddRef();
+    pMsg->m_pData = const_cast<void*>(Data());
+    pMsg->m_cbSize = (int)cbSize;
+    pMsg->m_nUserData = (int64)(intptr_t)this;
+    pMsg->m_pfnFreeData = &SharedPayload::FreeMessageData;
+}
+
+void SharedPayload::FreeMessageData(SteamNetworkingMessage_t* pMsg)
+{
+    SharedPayload* pPayload = (SharedPayload*)(intptr_t)pMsg->m_nUserData;
+    pPayload->Release();
+}
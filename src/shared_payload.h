@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+#include <payload_pool.h>
+#include <steam/steamnetworkingtypes.h>
+
+// Reference-counted, immutable payload shared by every message of one fan-out.
+// The line is encoded once into this buffer; each recipient gets a lightweight
+// message (see ISteamNetworkingUtils::AllocateMessage) that points at it.
+class SharedPayload
+{
+public:
+    // Copy `cbData` bytes into a new payload. The caller owns the initial reference.
+    // With a pool the block comes from there, and goes back there once the last reference is gone.
+    static SharedPayload* Create(const void* pData, uint32 cbData, PayloadPool* pPool = nullptr);
+    void AddRef();
+    void Release();
+    const void* Data() const { return this + 1; }
+    uint32 Size() const { return cbSize; }
+public:
+    // Point the message at this payload. The message holds a reference until the
+    // library frees it, so the caller can drop its own reference right after sending.
+    void AttachTo(SteamNetworkingMessage_t* pMsg);
+private:
+    SharedPayload(uint32 cbData, PayloadPool* pPool, int nSizeClass)
+      : cbSize(cbData), nSizeClass(nSizeClass), pPool(pPool)
+    {}
+    static void FreeMessageData(SteamNetworkingMessage_t* pMsg);
+private:
+    std::atomic<int> nRefs = 1;
+    uint32 cbSize;
+    int nSizeClass;
+    PayloadPool* pPool;
+    // The payload bytes follow the header in the same allocation.
+};
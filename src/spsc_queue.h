@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+// Bounded lock-free single-producer/single-consumer ring.  The slots are allocated once and filled in
+// place: the producer writes into the slot BeginPush() hands out, the consumer reads the one Front()
+// hands out, so nothing is copied or allocated on the way.  Each side caches the other's position and
+// only reloads it when the ring looks full (or empty), so the two threads rarely share a cache line.
+template <typename T>
+class SpscQueue
+{
+public:
+    // `nCapacity` must be a power of two.
+    explicit SpscQueue(size_t nCapacity) : slots(new T[nCapacity]), nMask(nCapacity - 1)
+    {
+        assert(nCapacity >= 2 && (nCapacity & nMask) == 0);
+    }
+public: // Producer thread only.
+    // The next free slot, or nullptr if the ring is full.  It keeps whatever it held last time round.
+    T* BeginPush()
+    {
+        size_t nTail = nTailPos.load(std::memory_order_relaxed);
+        if (nTail - nCachedHead > nMask)
+        {
+            nCachedHead = nHeadPos.load(std::memory_order_acquire);
+            if (nTail - nCachedHead > nMask)
+                return nullptr;
+        }
+        return &slots[nTail & nMask];
+    }
+    // Publish the slot from BeginPush().
+    void CommitPush() { nTailPos.store(nTailPos.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+public: // Consumer thread only.
+    // The oldest slot, or nullptr if the ring is empty.  Valid until Pop().
+    T* Front()
+    {
+        size_t nHead = nHeadPos.load(std::memory_order_relaxed);
+        if (nHead == nCachedTail)
+        {
+            nCachedTail = nTailPos.load(std::memory_order_acquire);
+            if (nHead == nCachedTail)
+                return nullptr;
+        }
+        return &slots[nHead & nMask];
+    }
+    // Hand the slot from Front() back to the producer.
+    void Pop() { nHeadPos.store(nHeadPos.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+private:
+    std::unique_ptr<T[]> slots;
+    const size_t nMask;
+    alignas(64) std::atomic<size_t> nHeadPos = 0; // Written by the consumer.
+    size_t nCachedTail = 0;                       // The consumer's copy of nTailPos.
+    alignas(64) std::atomic<size_t> nTailPos = 0; // Written by the producer.
+    size_t nCachedHead = 0;                       // The producer's copy of nHeadPos.
+};
@@ -1,6 +1,8 @@
 #include "steam_networking_init_RAII.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -37,18 +39,14 @@ SteamNetworkingInitRAII::SteamNetworkingInitRAII(const Options& options) : optio
     SteamNetworkingUtils()->SetGlobalConfigValueInt32(k_ESteamNetworkingConfig_IP_AllowWithoutAuth, 1);
 #endif
 
-    SteamNetworkingUtils()->SetDebugOutputFunction(options.debugSeverity, SteamNetworkingInitRAII::OnDebugOutput);
+    SetDebugSeverity(options.debugSeverity);
 }
 
 SteamNetworkingInitRAII::~SteamNetworkingInitRAII()
 {
-    // Give connections time to finish up.  This is an application layer protocol
-    // here, it's not TCP.  Note that if you have an application and you need to be
-    // more sure about cleanup, you won't be able to do this.  You will need to send
-    // a message and then either wait for the peer to close the connection, or
-    // you can pool the connection to see if any reliable data is pending.
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
-
+    // Whatever is still lingering is dropped.  This is an application layer protocol
+    // here, it's not TCP, so whoever has something worth delivering waits for it
+    // with WaitForFlush() before closing their connections.
 #ifdef STEAMNETWORKINGSOCKETS_OPENSOURCE
     GameNetworkingSockets_Kill();
 #else
@@ -56,6 +54,33 @@ SteamNetworkingInitRAII::~SteamNetworkingInitRAII()
 #endif
 }
 
+std::vector<HSteamNetConnection> SteamNetworkingInitRAII::WaitForFlush(
+    ISteamNetworkingSockets* pInterface, const std::vector<HSteamNetConnection>& connections,
+    std::chrono::milliseconds timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<HSteamNetConnection> unflushed = connections;
+    while (true)
+    {
+        // Only those still waiting are asked again, so the cost goes down as they finish.
+        std::erase_if(
+            unflushed,
+            [&](HSteamNetConnection hConn)
+            {
+                SteamNetConnectionRealTimeStatus_t status;
+                if (pInterface->GetConnectionRealTimeStatus(hConn, &status, 0, nullptr) != k_EResultOK)
+                    return true;
+                if (status.m_eState != k_ESteamNetworkingConnectionState_Connected)
+                    return true;
+                return status.m_cbPendingReliable == 0 && status.m_cbSentUnackedReliable == 0;
+            });
+        if (unflushed.empty() || std::chrono::steady_clock::now() >= deadline)
+            return unflushed;
+        // About one round trip on a LAN.
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
 void SteamNetworkingInitRAII::OnDebugOutput(ESteamNetworkingSocketsDebugOutputType eType, const char* pszMsg)
 {
     if (debugCallback)
@@ -67,3 +92,37 @@ void SteamNetworkingInitRAII::SetDebugCallback(
 {
     debugCallback = callback;
 }
+
+void SteamNetworkingInitRAII::SetDebugSeverity(ESteamNetworkingSocketsDebugOutputType debugSeverity)
+{
+    SteamNetworkingUtils()->SetDebugOutputFunction(debugSeverity, SteamNetworkingInitRAII::OnDebugOutput);
+}
+
+bool SteamNetworkingInitRAII::ParseDebugSeverity(
+    const char* pszName, ESteamNetworkingSocketsDebugOutputType& debugSeverity)
+{
+    static const struct
+    {
+        const char* pszName;
+        ESteamNetworkingSocketsDebugOutputType eType;
+    } k_severities[] = {
+        {"none", k_ESteamNetworkingSocketsDebugOutputType_None},
+        {"bug", k_ESteamNetworkingSocketsDebugOutputType_Bug},
+        {"error", k_ESteamNetworkingSocketsDebugOutputType_Error},
+        {"important", k_ESteamNetworkingSocketsDebugOutputType_Important},
+        {"warning", k_ESteamNetworkingSocketsDebugOutputType_Warning},
+        {"msg", k_ESteamNetworkingSocketsDebugOutputType_Msg},
+        {"verbose", k_ESteamNetworkingSocketsDebugOutputType_Verbose},
+        {"debug", k_ESteamNetworkingSocketsDebugOutputType_Debug},
+        {"everything", k_ESteamNetworkingSocketsDebugOutputType_Everything},
+    };
+    for (const auto& severity : k_severities)
+    {
+        if (!strcmp(pszName, severity.pszName))
+        {
+            debugSeverity = severity.eType;
+            return true;
+        }
+    }
+    return false;
+}
@@ -1,6 +1,10 @@
 #pragma once
+#include <chrono>
 #include <functional>
 #include <steam/steamnetworkingtypes.h>
+#include <vector>
+
+class ISteamNetworkingSockets;
 
 class SteamNetworkingInitRAII
 {
@@ -11,9 +15,19 @@ public:
     };
 
     SteamNetworkingInitRAII(const Options& options);
+    // Does not wait for anything still in flight, see WaitForFlush().
     ~SteamNetworkingInitRAII();
+    // Wait until the peers have acknowledged all the reliable data sent on `connections`, or until `timeout`.
+    // Connections that are no longer connected count as done.  Returns those that were not done in time.
+    static std::vector<HSteamNetConnection> WaitForFlush(
+        ISteamNetworkingSockets* pInterface, const std::vector<HSteamNetConnection>& connections,
+        std::chrono::milliseconds timeout);
 public: // *** Implement setting debug callback ***
     static void SetDebugCallback(std::function<void(ESteamNetworkingSocketsDebugOutputType, const char*)> callback);
+    // Can be changed at any time, the library reads it on every message.
+    static void SetDebugSeverity(ESteamNetworkingSocketsDebugOutputType debugSeverity);
+    // Accepts "none", "bug", "error", "important", "warning", "msg", "verbose", "debug" and "everything".
+    static bool ParseDebugSeverity(const char* pszName, ESteamNetworkingSocketsDebugOutputType& debugSeverity);
 private:
     static void OnDebugOutput(ESteamNetworkingSocketsDebugOutputType eType, const char* pszMsg);
     static std::function<void(ESteamNetworkingSocketsDebugOutputType, const char*)> debugCallback;
@@ -0,0 +1,40 @@
+#pragma once
+#include <algorithm>
+#include <steam/steamnetworkingtypes.h>
+
+// Allows `flRatePerSec` units a second on average, and bursts of up to `flBurst`.  Starts full.
+// Not thread-safe; each bucket belongs to one loop.
+class TokenBucket
+{
+    double flRatePerSec = 0;
+    double flBurst = 0;
+    double flTokens = 0;
+    SteamNetworkingMicroseconds usecLastRefill = 0;
+public:
+    TokenBucket() = default;
+    TokenBucket(double flRatePerSec, double flBurst, SteamNetworkingMicroseconds usecNow)
+      : flRatePerSec(flRatePerSec), flBurst(flBurst), flTokens(flBurst), usecLastRefill(usecNow)
+    {}
+    // Take `flCost` units if there are that many.
+    bool TryTake(SteamNetworkingMicroseconds usecNow, double flCost = 1.0)
+    {
+        Refill(usecNow);
+        if (flTokens < flCost)
+            return false;
+        flTokens -= flCost;
+        return true;
+    }
+    double GetTokens(SteamNetworkingMicroseconds usecNow)
+    {
+        Refill(usecNow);
+        return flTokens;
+    }
+private:
+    void Refill(SteamNetworkingMicroseconds usecNow)
+    {
+        if (usecNow <= usecLastRefill)
+            return;
+        flTokens = std::min(flBurst, flTokens + flRatePerSec * (double)(usecNow - usecLastRefill) / 1e6);
+        usecLastRefill = usecNow;
+    }
+};
@@ -0,0 +1,407 @@
+#include "transcript_log.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <my_cpp_utils/logger.h>
+#include <server_stats.h>
+#include <unistd.h>
+#include <wire_protocol.h>
+
+namespace
+{
+
+constexpr std::string_view k_sSegmentPrefix = "transcript-";
+constexpr std::string_view k_sSegmentSuffix = ".log";
+// How long the writer sleeps when the queue is empty.
+constexpr std::chrono::milliseconds k_idleSleep{5};
+// Size, CRC, time and room name size.
+constexpr size_t k_cbRecordHeader = 4 + 4 + 8 + 1;
+constexpr size_t k_cbMaxRecord =
+    k_cbRecordHeader + 255 + Wire::EncodedSize(WireTraits<WireType::Replay>::k_cbMaxBody);
+
+constexpr std::array<uint32, 256> MakeCrcTable()
+{
+    std::array<uint32, 256> table = {};
+    for (uint32 i = 0; i < 256; ++i)
+    {
+        uint32 c = i;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return table;
+}
+constexpr std::array<uint32, 256> k_crcTable = MakeCrcTable();
+
+// The CRC-32 of zlib and PNG.
+uint32 Crc32(const char* pData, size_t cbData)
+{
+    uint32 c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < cbData; ++i)
+        c = k_crcTable[(c ^ (uint8)pData[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+void StoreU32(char* p, uint32 n)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = (char)(n >> (8 * i));
+}
+
+void StoreU64(char* p, uint64 n)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = (char)(n >> (8 * i));
+}
+
+uint64 LoadLittleEndian(const char* p, int cb)
+{
+    uint64 n = 0;
+    for (int i = 0; i < cb; ++i)
+        n |= (uint64)(uint8)p[i] << (8 * i);
+    return n;
+}
+
+} // namespace
+
+TranscriptLog::Reader::Reader(const std::string& sPath) : buffer(k_cbMaxRecord)
+{
+    pFile = fopen(sPath.c_str(), "rb");
+    if (!pFile)
+        return;
+    char magic[k_cbMagic];
+    if (fread(magic, 1, k_cbMagic, pFile) != k_cbMagic || memcmp(magic, k_szMagic, k_cbMagic) != 0)
+    {
+        fclose(pFile);
+        pFile = nullptr;
+        return;
+    }
+    cbValid = k_cbMagic;
+}
+
+TranscriptLog::Reader::~Reader()
+{
+    if (pFile)
+        fclose(pFile);
+}
+
+bool TranscriptLog::Reader::Next(Record_t& record)
+{
+    if (!pFile)
+        return false;
+    char header[8];
+    if (fread(header, 1, sizeof(header), pFile) != sizeof(header))
+        return false;
+    size_t cbRest = (size_t)LoadLittleEndian(header, 4);
+    uint32 nCrc = (uint32)LoadLittleEndian(header + 4, 4);
+    if (cbRest < k_cbRecordHeader - sizeof(header) || cbRest > buffer.size())
+        return false;
+    if (fread(buffer.data(), 1, cbRest, pFile) != cbRest || Crc32(buffer.data(), cbRest) != nCrc)
+        return false;
+
+    size_t cbRoom = (uint8)buffer[8];
+    if (9 + cbRoom > cbRest)
+        return false;
+    record.nTimeMs = (int64)LoadLittleEndian(buffer.data(), 8);
+    record.sRoom = std::string_view(buffer.data() + 9, cbRoom);
+    record.sEnvelope = std::string_view(buffer.data() + 9 + cbRoom, cbRest - 9 - cbRoom);
+    cbValid += sizeof(header) + cbRest;
+    return true;
+}
+
+TranscriptLog::TranscriptLog(const Options& options, RoomDirectory& rooms)
+  : options(options), queue(options.nQueueCapacity)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(options.sDirectory, ec);
+    if (ec)
+        MY_LOG_FMT(error, "[TranscriptLog] Cannot create {}: {}", options.sDirectory, ec.message());
+
+    Recover(rooms);
+    OpenNextSegment();
+    writerThread = std::thread([this]() { RunWriter(); });
+}
+
+TranscriptLog::~TranscriptLog()
+{
+    bStop = true;
+    writerThread.join();
+    MY_LOG_FMT(
+        info, "[TranscriptLog] Wrote {} line(s), {} fsync(s). Dropped {} line(s).", GetLinesWritten(),
+        GetFsyncCount(), GetDroppedCount());
+}
+
+void TranscriptLog::Append(std::string_view sRoom, SharedPayload* pPayload)
+{
+    Pending_t pending;
+    pending.cbRoom = (uint8)sRoom.copy(pending.room.data(), pending.room.size());
+    pending.pPayload = pPayload;
+    if (!queue.TryPush(std::move(pending)))
+    {
+        pPayload->Release();
+        nDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int TranscriptLog::DumpSegment(const std::string& sPath)
+{
+    Reader reader(sPath);
+    if (!reader.IsOpen())
+    {
+        fprintf(stderr, "%s is not a chat transcript segment\n", sPath.c_str());
+        return 1;
+    }
+
+    Record_t record;
+    while (reader.Next(record))
+    {
+        char szTime[32];
+        time_t nTime = (time_t)(record.nTimeMs / 1000);
+        strftime(szTime, sizeof(szTime), "%Y-%m-%d %H:%M:%S", gmtime(&nTime));
+
+        WireMessage msg;
+        std::string_view sNick, sText;
+        if (Wire::Decode(record.sEnvelope.data(), record.sEnvelope.size(), msg) != record.sEnvelope.size() ||
+            msg.eType != WireType::Replay || !Wire::DecodeReplay(msg.sBody, sNick, sText))
+        {
+            sNick = "?";
+            sText = "(unreadable line)";
+        }
+        printf(
+            "%s.%03d [%.*s] %.*s: %.*s\n", szTime, (int)(record.nTimeMs % 1000), (int)record.sRoom.size(),
+            record.sRoom.data(), (int)sNick.size(), sNick.data(), (int)sText.size(), sText.data());
+    }
+
+    std::error_code ec;
+    uint64 cbFile = std::filesystem::file_size(sPath, ec);
+    if (!ec && reader.GetValidSize() < cbFile)
+    {
+        fprintf(
+            stderr, "Stopped at byte %llu of %llu, the rest is torn or corrupt\n",
+            (unsigned long long)reader.GetValidSize(), (unsigned long long)cbFile);
+        return 1;
+    }
+    return 0;
+}
+
+std::vector<std::pair<uint32, std::string>> TranscriptLog::ListSegments() const
+{
+    std::vector<std::pair<uint32, std::string>> segments;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(options.sDirectory, ec))
+    {
+        std::string sName = entry.path().filename().string();
+        if (!sName.starts_with(k_sSegmentPrefix) || !sName.ends_with(k_sSegmentSuffix))
+            continue;
+        uint32 nIndex = 0;
+        const char* pDigits = sName.data() + k_sSegmentPrefix.size();
+        const char* pDigitsEnd = sName.data() + sName.size() - k_sSegmentSuffix.size();
+        if (std::from_chars(pDigits, pDigitsEnd, nIndex).ptr != pDigitsEnd)
+            continue;
+        segments.emplace_back(nIndex, entry.path().string());
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+void TranscriptLog::Recover(RoomDirectory& rooms)
+{
+    std::vector<std::pair<uint32, std::string>> segments = ListSegments();
+    if (segments.empty())
+        return;
+    nSegmentIndex = segments.back().first;
+
+    // Only the newest segments matter, the history keeps no more than the last lines of each room.  Every
+    // start begins a segment, so walk back by size rather than count, or a few quiet restarts would leave
+    // nothing but near-empty segments to read.
+    uint64 cbWanted = (uint64)std::max(0, options.nRecoverySegments) * options.cbSegmentSize;
+    uint64 cbSelected = 0;
+    size_t nFirst = segments.size();
+    while (nFirst > 0 && cbSelected < cbWanted)
+    {
+        --nFirst;
+        std::error_code ec;
+        uint64 cbFile = std::filesystem::file_size(segments[nFirst].second, ec);
+        if (!ec)
+            cbSelected += cbFile;
+    }
+    uint64 nLines = 0;
+    for (size_t i = nFirst; i < segments.size(); ++i)
+    {
+        const std::string& sPath = segments[i].second;
+        uint64 cbValid = 0;
+        {
+            Reader reader(sPath);
+            if (!reader.IsOpen())
+            {
+                MY_LOG_FMT(warn, "[TranscriptLog] Skipping {}, it is not a transcript segment", sPath);
+                continue;
+            }
+            Record_t record;
+            while (reader.Next(record))
+            {
+                if (RoomDirectory::Room_t* pRoom = rooms.FindOrCreate(record.sRoom))
+                    pRoom->m_history.Append(record.sEnvelope.data(), (uint32)record.sEnvelope.size());
+                ++nLines;
+            }
+            cbValid = reader.GetValidSize();
+        }
+
+        // Whatever follows the last good record was being written when we went down.
+        std::error_code ec;
+        uint64 cbFile = std::filesystem::file_size(sPath, ec);
+        if (!ec && cbValid < cbFile)
+        {
+            MY_LOG_FMT(
+                warn, "[TranscriptLog] Cutting the torn end off {}, from {} to {} bytes", sPath, cbFile, cbValid);
+            std::filesystem::resize_file(sPath, cbValid, ec);
+        }
+    }
+    MY_LOG_FMT(
+        info, "[TranscriptLog] Recovered {} line(s) from {} segment(s) in {}", nLines, segments.size() - nFirst,
+        options.sDirectory);
+}
+
+bool TranscriptLog::OpenNextSegment()
+{
+    ++nSegmentIndex;
+    std::string sPath =
+        MY_FMT("{}/{}{:08}{}", options.sDirectory, k_sSegmentPrefix, nSegmentIndex, k_sSegmentSuffix);
+    fd = open(sPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        MY_LOG_FMT(error, "[TranscriptLog] Cannot create {}: {}", sPath, strerror(errno));
+        return false;
+    }
+    cbSegment = 0;
+    WriteOut(k_szMagic, k_cbMagic);
+
+    // The new file's directory entry must survive a crash as well as its contents.
+    int fdDirectory = open(options.sDirectory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fdDirectory >= 0)
+    {
+        fsync(fdDirectory);
+        close(fdDirectory);
+    }
+    return fd >= 0;
+}
+
+void TranscriptLog::CloseSegment()
+{
+    if (fd < 0)
+        return;
+    Sync();
+    close(fd);
+    fd = -1;
+}
+
+void TranscriptLog::RunWriter()
+{
+    auto nextSync = std::chrono::steady_clock::now() + options.fsyncInterval;
+    while (!bStop)
+    {
+        int nLines = WriteBatch();
+
+        // One fsync for everything written since the last one.
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextSync)
+        {
+            Sync();
+            nextSync = now + options.fsyncInterval;
+        }
+        if (nLines == 0)
+            std::this_thread::sleep_for(std::min<std::chrono::milliseconds>(k_idleSleep, options.fsyncInterval));
+    }
+    // Producers are gone by now, so this empties the queue.
+    while (WriteBatch() > 0)
+    {
+    }
+    CloseSegment();
+}
+
+int TranscriptLog::WriteBatch()
+{
+    // Bounded, so a flood of lines does not keep the writer from syncing or noticing bStop.
+    static constexpr int k_nMaxBatch = 1024;
+    int64 nTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    writeBuffer.clear();
+    int nLines = 0;
+    Pending_t pending;
+    while (nLines < k_nMaxBatch && queue.TryPop(pending))
+    {
+        ++nLines;
+        std::string_view sRoom(pending.room.data(), pending.cbRoom);
+        size_t cbRoom = sRoom.size();
+        size_t cbRest = k_cbRecordHeader - 8 + cbRoom + pending.pPayload->Size();
+        size_t nOffset = writeBuffer.size();
+        writeBuffer.resize(nOffset + 8 + cbRest);
+        char* p = writeBuffer.data() + nOffset;
+        StoreU32(p, (uint32)cbRest);
+        StoreU64(p + 8, (uint64)nTimeMs);
+        p[16] = (char)cbRoom;
+        memcpy(p + 17, sRoom.data(), cbRoom);
+        memcpy(p + 17 + cbRoom, pending.pPayload->Data(), pending.pPayload->Size());
+        StoreU32(p + 4, Crc32(p + 8, cbRest));
+        pending.pPayload->Release();
+    }
+    if (nLines == 0)
+        return 0;
+
+    // After a write error the transcript stays off, rather than filling the log with the same error.
+    if (fd < 0)
+    {
+        nDropped.fetch_add((uint64)nLines, std::memory_order_relaxed);
+        return nLines;
+    }
+    WriteOut(writeBuffer.data(), writeBuffer.size());
+    if (fd < 0)
+    {
+        nDropped.fetch_add((uint64)nLines, std::memory_order_relaxed);
+        return nLines;
+    }
+    AddRelaxed(nLinesWritten, (uint64)nLines);
+
+    if (cbSegment >= options.cbSegmentSize)
+    {
+        CloseSegment();
+        OpenNextSegment();
+    }
+    return nLines;
+}
+
+void TranscriptLog::WriteOut(const char* pData, size_t cbData)
+{
+    while (cbData > 0)
+    {
+        ssize_t cbWritten = write(fd, pData, cbData);
+        if (cbWritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            MY_LOG_FMT(error, "[TranscriptLog] Write failed, the transcript stops here: {}", strerror(errno));
+            close(fd);
+            fd = -1;
+            return;
+        }
+        pData += cbWritten;
+        cbData -= (size_t)cbWritten;
+        cbSegment += (uint64)cbWritten;
+    }
+    bUnsynced = true;
+}
+
+void TranscriptLog::Sync()
+{
+    if (fd < 0 || !bUnsynced)
+        return;
+    fdatasync(fd);
+    bUnsynced = false;
+    AddRelaxed(nFsyncs, 1);
+}
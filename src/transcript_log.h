@@ -0,0 +1,107 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mpsc_queue.h>
+#include <room_directory.h>
+#include <shared_payload.h>
+#include <stdio.h>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Durable transcript of every chat line the server relays: an append-only series of segment files in
+// one directory.  A shard hands over the Replay envelope it already encoded for the room history, so
+// logging a line is one queue push.  A writer thread turns what it finds queued into one write(), and
+// makes everything written durable with one fdatasync() per `Options::fsyncInterval`.  Nothing on the
+// relay path ever waits for the disk; if the queue is full the line is missing from the transcript.
+//
+// A segment is "CHATLOG1" followed by records of, little-endian:
+//
+//   uint32 size of the rest | uint32 CRC-32 of the rest | int64 unix time ms | uint8 room name size |
+//   room name | Replay envelope
+//
+// A crash may leave a torn record at the end of a segment.  Recovery cuts the file back to its last
+// record with a good CRC.
+class TranscriptLog
+{
+public:
+    struct Options
+    {
+        std::string sDirectory;                        // Empty turns the transcript off.
+        uint64 cbSegmentSize = 64 << 20;               // A new segment is started once one reaches this.
+        std::chrono::milliseconds fsyncInterval{1000}; // Lines are durable at most this long after relaying.
+        int nRecoverySegments = 2;                     // Segments' worth of the newest lines read back on start.
+        size_t nQueueCapacity = 1 << 14;               // Lines in flight.  Must be a power of two.
+    };
+    // One record of a segment.  The views point into the Reader's buffer.
+    struct Record_t
+    {
+        int64 nTimeMs = 0;
+        std::string_view sRoom;
+        std::string_view sEnvelope;
+    };
+    // Reads a segment one record at a time through a buffer of one record, however big the file is.
+    class Reader
+    {
+        FILE* pFile = nullptr;
+        std::vector<char> buffer;
+        uint64 cbValid = 0;
+    public:
+        explicit Reader(const std::string& sPath);
+        ~Reader();
+        bool IsOpen() const { return pFile != nullptr; }
+        // Returns false at the end of the segment, or at the first torn or corrupt record.
+        bool Next(Record_t& record);
+        // Bytes up to the end of the last good record read so far.
+        uint64 GetValidSize() const { return cbValid; }
+    };
+    static constexpr char k_szMagic[] = "CHATLOG1";
+    static constexpr size_t k_cbMagic = sizeof(k_szMagic) - 1;
+private:
+    struct Pending_t
+    {
+        // A copy: by the time the writer gets to it the room may have been reclaimed, and renamed.
+        std::array<char, RoomDirectory::k_nMaxRoomNameLength> room = {};
+        uint8 cbRoom = 0;
+        SharedPayload* pPayload = nullptr; // Holds one reference.
+    };
+    Options options;
+    MpscQueue<Pending_t> queue;
+    std::atomic<bool> bStop = false;
+    std::atomic<uint64> nLinesWritten = 0; // Written by the writer thread only.
+    std::atomic<uint64> nDropped = 0;
+    std::atomic<uint64> nFsyncs = 0; // Written by the writer thread only.
+    // Writer thread only.
+    int fd = -1;
+    uint32 nSegmentIndex = 0;
+    uint64 cbSegment = 0;
+    bool bUnsynced = false;
+    std::vector<char> writeBuffer;
+    std::thread writerThread;
+public:
+    // Reads the newest segments back into the rooms' history, then starts writing a new segment.
+    TranscriptLog(const Options& options, RoomDirectory& rooms);
+    // Writes and syncs everything still queued.
+    ~TranscriptLog();
+    // Thread-safe.  Takes over the reference to `pPayload`, which holds one Replay envelope said in `sRoom`.
+    void Append(std::string_view sRoom, SharedPayload* pPayload);
+    uint64 GetLinesWritten() const { return nLinesWritten.load(std::memory_order_relaxed); }
+    uint64 GetDroppedCount() const { return nDropped.load(std::memory_order_relaxed); }
+    uint64 GetFsyncCount() const { return nFsyncs.load(std::memory_order_relaxed); }
+    // Print every record of a segment to stdout.  Returns the process exit code.
+    static int DumpSegment(const std::string& sPath);
+private:
+    // Segment files in the directory, oldest first.
+    std::vector<std::pair<uint32, std::string>> ListSegments() const;
+    void Recover(RoomDirectory& rooms);
+    bool OpenNextSegment();
+    void CloseSegment();
+    void RunWriter();
+    int WriteBatch();
+    void WriteOut(const char* pData, size_t cbData);
+    void Sync();
+};
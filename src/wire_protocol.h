@@ -0,0 +1,352 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <string_view>
+
+// The chat protocol shared by ChatServer, ChatClient and LoadGenerator.  Every message is one envelope:
+//
+//   uint8 type | uint8 flags | uint32 sender | uint32 body size | body
+//
+// Integers are little-endian.  `sender` is the id the server gave a client (0 is the server itself);
+// clients learn which nick goes with an id from NickMap messages, so chat lines carry 4 bytes instead
+// of "nick: ".  A client sends one envelope per message.  The server may pack several envelopes back
+// to back into one message, to clients that asked for it with WireHello::k_nFlagBatch and for rosters.
+// Ephemeral messages travel unreliable on a lane of their own, see WireLane.
+enum class WireType : uint8
+{
+    // Client -> server.
+    Hello = 1, // `flags` are the WireHello capabilities the client wants, the body a session token if any.
+    Say,       // A chat line for the client's room.
+    SetNick,
+    Join, // Body is the room name.
+    Leave,
+    ListRooms,
+
+    // Server -> client.
+    Welcome = 16, // `sender` is the client's own id, `flags` the capabilities the server agreed to.
+    Notice,       // Text from the server.
+    Chat,         // A line said by `sender`.
+    NickMap,      // `sender` is now known as the body.
+    Replay,       // A line from the room's history, see Wire::AppendReplay.
+    Session,      // Body is the token with which the client can resume as who it is now, see WireHello.
+
+    // Ephemeral, both directions.  A client sends them with `sender` 0 and the server relays them to the
+    // client's room with `sender` filled in.  They may be lost, so a newer one always supersedes an older one.
+    Typing = 32, // `flags` is WireTyping::k_nFlagTyping while they type, 0 once they stopped.
+    Presence,    // Heartbeat, `flags` is a WirePresence state.
+    ReadMarker,  // Body is how far the sender has read, in a form of its own choosing.
+};
+
+// A client says Hello first thing.  The server waits for it before introducing them to everybody else, so a
+// client that comes back with the token of an earlier Session is put back as it was, nick and room, without
+// anybody hearing of it leaving or joining.
+class WireHello
+{
+public:
+    static constexpr uint8 k_nFlagBatch = 1 << 0; // Coalesce everything for one tick into one message.
+    static constexpr size_t k_cbResumeToken = 16;
+};
+
+class WireTyping
+{
+public:
+    static constexpr uint8 k_nFlagTyping = 1 << 0;
+};
+
+class WirePresence
+{
+public:
+    static constexpr uint8 k_nActive = 0;
+    static constexpr uint8 k_nIdle = 1;
+    static constexpr uint8 k_nAway = 2;
+    static constexpr uint8 k_nMaxState = k_nAway;
+};
+
+// The lanes both ends configure on every connection with ISteamNetworkingSockets::ConfigureConnectionLanes.
+// Ephemeral messages have a lane of their own, so a burst of them never queues behind a backlog of chat,
+// nor chat behind them, and losing one costs no retransmit.
+class WireLane
+{
+public:
+    static constexpr uint16 k_nChat = 0; // Reliable, everything that is not ephemeral.
+    static constexpr int k_nChatSendFlags = k_nSteamNetworkingSend_Reliable;
+    static constexpr uint16 k_nPresence = 1; // Unreliable without Nagle, so heartbeats are never held back.
+    static constexpr int k_nPresenceSendFlags = k_nSteamNetworkingSend_UnreliableNoNagle;
+    static constexpr int k_nCount = 2;
+    // A lower number is a higher priority, and starves the lanes below it while it has data.  Lanes of
+    // equal priority share the bandwidth by weight.  By default neither lane can starve the other.
+    static constexpr std::array<int, k_nCount> k_defaultPriorities = {0, 0};
+    static constexpr std::array<uint16, k_nCount> k_defaultWeights = {3, 1};
+public:
+    static constexpr uint16 Of(WireType eType)
+    {
+        switch (eType)
+        {
+        case WireType::Typing:
+        case WireType::Presence:
+        case WireType::ReadMarker:
+            return k_nPresence;
+        default:
+            return k_nChat;
+        }
+    }
+    static constexpr int SendFlagsOf(uint16 nLane)
+    {
+        return nLane == k_nPresence ? k_nPresenceSendFlags : k_nChatSendFlags;
+    }
+};
+
+// Limits and shape of each message type, checked when encoding and decoding.
+template <WireType eType>
+struct WireTraits
+{
+    static constexpr uint32 k_cbMaxBody = 4096;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Hello>
+{
+    static constexpr uint32 k_cbMaxBody = WireHello::k_cbResumeToken;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::SetNick>
+{
+    static constexpr uint32 k_cbMaxBody = 64;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Join>
+{
+    static constexpr uint32 k_cbMaxBody = 256; // The room directory has the final word on names.
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Leave>
+{
+    static constexpr uint32 k_cbMaxBody = 0;
+    static constexpr bool k_bHasBody = false;
+};
+template <>
+struct WireTraits<WireType::ListRooms>
+{
+    static constexpr uint32 k_cbMaxBody = 16; // The page, in decimal, 1 when empty.
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Welcome>
+{
+    static constexpr uint32 k_cbMaxBody = 0;
+    static constexpr bool k_bHasBody = false;
+};
+template <>
+struct WireTraits<WireType::NickMap>
+{
+    static constexpr uint32 k_cbMaxBody = WireTraits<WireType::SetNick>::k_cbMaxBody;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Notice>
+{
+    static constexpr uint32 k_cbMaxBody = 64 * 1024; // Room listings can be long.
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Replay>
+{
+    // The nick's length, the nick `sender` had when they said the line, and the line.
+    static constexpr uint32 k_cbMaxBody =
+        1 + WireTraits<WireType::NickMap>::k_cbMaxBody + WireTraits<WireType::Say>::k_cbMaxBody;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Session>
+{
+    static constexpr uint32 k_cbMaxBody = WireHello::k_cbResumeToken;
+    static constexpr bool k_bHasBody = true;
+};
+template <>
+struct WireTraits<WireType::Typing>
+{
+    static constexpr uint32 k_cbMaxBody = 0;
+    static constexpr bool k_bHasBody = false;
+};
+template <>
+struct WireTraits<WireType::Presence>
+{
+    static constexpr uint32 k_cbMaxBody = 0;
+    static constexpr bool k_bHasBody = false;
+};
+template <>
+struct WireTraits<WireType::ReadMarker>
+{
+    static constexpr uint32 k_cbMaxBody = 16;
+    static constexpr bool k_bHasBody = true;
+};
+
+// A decoded envelope.  `sBody` points into the received buffer.
+struct WireMessage
+{
+    WireType eType = WireType::Notice;
+    uint8 nFlags = 0;
+    uint32 nSender = 0;
+    std::string_view sBody;
+};
+
+class Wire
+{
+public:
+    static constexpr size_t k_cbHeader = 10;
+public:
+    // Bytes needed to encode a message with `cbBody` bytes of body.
+    static constexpr size_t EncodedSize(size_t cbBody) { return k_cbHeader + cbBody; }
+
+    // Write one envelope to `pOut`, which must have room for EncodedSize(sBody.size()) bytes.
+    template <WireType eType>
+    static size_t Encode(char* pOut, uint32 nSender, std::string_view sBody = {}, uint8 nFlags = 0)
+    {
+        if constexpr (!WireTraits<eType>::k_bHasBody)
+            sBody = {};
+        // Longer bodies are cut, so a decoder never has a reason to reject what we send.
+        if (sBody.size() > WireTraits<eType>::k_cbMaxBody)
+            sBody = sBody.substr(0, WireTraits<eType>::k_cbMaxBody);
+        StoreHeader(pOut, eType, nFlags, nSender, (uint32)sBody.size());
+        sBody.copy(pOut + k_cbHeader, sBody.size());
+        return EncodedSize(sBody.size());
+    }
+
+    // Append one envelope to `out`.  Does not allocate once `out` has the capacity.
+    template <WireType eType>
+    static void Append(std::string& out, uint32 nSender, std::string_view sBody = {}, uint8 nFlags = 0)
+    {
+        size_t cbOld = out.size();
+        out.resize(cbOld + EncodedSize(std::min<size_t>(sBody.size(), WireTraits<eType>::k_cbMaxBody)));
+        Encode<eType>(out.data() + cbOld, nSender, sBody, nFlags);
+    }
+
+    // Append a Replay of `sText`, said by `nSender` while they were known by the nick in `sNickField`.
+    // Replays carry the nick because the sender may have changed it or left by the time the line is
+    // replayed.  `sNickField` is the nick as it goes on the wire, its size in one byte followed by the
+    // nick (see CompactNick::GetWireField), so the body is two memcpys.
+    static void AppendReplay(std::string& out, uint32 nSender, std::string_view sNickField, std::string_view sText)
+    {
+        assert(!sNickField.empty() && (size_t)(uint8)sNickField[0] == sNickField.size() - 1);
+        assert(sNickField.size() - 1 <= WireTraits<WireType::NickMap>::k_cbMaxBody);
+        sText = sText.substr(0, WireTraits<WireType::Say>::k_cbMaxBody);
+        size_t cbBody = sNickField.size() + sText.size();
+        size_t cbOld = out.size();
+        out.resize(cbOld + EncodedSize(cbBody));
+        char* p = out.data() + cbOld;
+        StoreHeader(p, WireType::Replay, 0, nSender, (uint32)cbBody);
+        sNickField.copy(p + k_cbHeader, sNickField.size());
+        sText.copy(p + k_cbHeader + sNickField.size(), sText.size());
+    }
+
+    // Split the body of a Replay.  Returns false if it is malformed.
+    static bool DecodeReplay(std::string_view sBody, std::string_view& sNick, std::string_view& sText)
+    {
+        if (sBody.empty() || (size_t)(uint8)sBody[0] > sBody.size() - 1)
+            return false;
+        size_t cbNick = (uint8)sBody[0];
+        sNick = sBody.substr(1, cbNick);
+        sText = sBody.substr(1 + cbNick);
+        return true;
+    }
+
+    // Decode the envelope at the start of [pData, pData + cbData).  Returns the bytes it took, or 0
+    // if the data is truncated or breaks the limits of its type.
+    static size_t Decode(const void* pData, size_t cbData, WireMessage& msg)
+    {
+        const char* p = (const char*)pData;
+        if (cbData < k_cbHeader)
+            return 0;
+        msg.eType = (WireType)(uint8)p[0];
+        msg.nFlags = (uint8)p[1];
+        msg.nSender = LoadU32(p + 2);
+        uint32 cbBody = LoadU32(p + 6);
+        if (cbData - k_cbHeader < cbBody || cbBody > MaxBody(msg.eType))
+            return 0;
+        msg.sBody = std::string_view(p + k_cbHeader, cbBody);
+        return EncodedSize(cbBody);
+    }
+
+    // Calls `fnMessage(const WireMessage&)` for every envelope in the buffer.
+    // Returns false if something could not be decoded.
+    template <typename Fn>
+    static bool ForEachMessage(const void* pData, size_t cbData, Fn&& fnMessage)
+    {
+        const char* p = (const char*)pData;
+        const char* pEnd = p + cbData;
+        while (p != pEnd)
+        {
+            WireMessage msg;
+            size_t cbMsg = Decode(p, (size_t)(pEnd - p), msg);
+            if (cbMsg == 0)
+                return false;
+            fnMessage(msg);
+            p += cbMsg;
+        }
+        return true;
+    }
+private:
+    static constexpr uint32 MaxBody(WireType eType)
+    {
+        switch (eType)
+        {
+        case WireType::Hello:
+            return WireTraits<WireType::Hello>::k_cbMaxBody;
+        case WireType::Say:
+            return WireTraits<WireType::Say>::k_cbMaxBody;
+        case WireType::SetNick:
+            return WireTraits<WireType::SetNick>::k_cbMaxBody;
+        case WireType::Join:
+            return WireTraits<WireType::Join>::k_cbMaxBody;
+        case WireType::Leave:
+            return WireTraits<WireType::Leave>::k_cbMaxBody;
+        case WireType::ListRooms:
+            return WireTraits<WireType::ListRooms>::k_cbMaxBody;
+        case WireType::Welcome:
+            return WireTraits<WireType::Welcome>::k_cbMaxBody;
+        case WireType::Notice:
+            return WireTraits<WireType::Notice>::k_cbMaxBody;
+        case WireType::Chat:
+            return WireTraits<WireType::Chat>::k_cbMaxBody;
+        case WireType::NickMap:
+            return WireTraits<WireType::NickMap>::k_cbMaxBody;
+        case WireType::Replay:
+            return WireTraits<WireType::Replay>::k_cbMaxBody;
+        case WireType::Session:
+            return WireTraits<WireType::Session>::k_cbMaxBody;
+        case WireType::Typing:
+            return WireTraits<WireType::Typing>::k_cbMaxBody;
+        case WireType::Presence:
+            return WireTraits<WireType::Presence>::k_cbMaxBody;
+        case WireType::ReadMarker:
+            return WireTraits<WireType::ReadMarker>::k_cbMaxBody;
+        }
+        return 0; // Unknown type.
+    }
+    static void StoreHeader(char* p, WireType eType, uint8 nFlags, uint32 nSender, uint32 cbBody)
+    {
+        p[0] = (char)eType;
+        p[1] = (char)nFlags;
+        StoreU32(p + 2, nSender);
+        StoreU32(p + 6, cbBody);
+    }
+    static void StoreU32(char* p, uint32 n)
+    {
+        p[0] = (char)n;
+        p[1] = (char)(n >> 8);
+        p[2] = (char)(n >> 16);
+        p[3] = (char)(n >> 24);
+    }
+    static uint32 LoadU32(const char* p)
+    {
+        const unsigned char* u = (const unsigned char*)p;
+        return (uint32)u[0] | (uint32)u[1] << 8 | (uint32)u[2] << 16 | (uint32)u[3] << 24;
+    }
+};